@@ -12,7 +12,8 @@ COMPILER_FLAGS = \
 	-std=c++2a \
 	-Wno-deprecated-volatile -Wno-unused-function -Wno-unknown-pragmas -Wno-comment \
 	-Wno-unused-parameter -Wno-sign-compare -Wno-missing-field-initializers \
-	-Wno-unused-result -Wno-class-memaccess -Wno-unused-but-set-variable
+	-Wno-unused-result -Wno-class-memaccess -Wno-unused-but-set-variable \
+	-mssse3
 
 LINKER_FLAGS = \
   -L/usr/lib/x86_64-linux-gnu \
@@ -25,5 +26,14 @@ unity: shaders
 	@echo "################################################################################"
 	time g++ $(COMPILER_FLAGS) src/_unity.cpp -o bin/peony $(LINKER_FLAGS)
 
+cooker:
+	@echo "################################################################################"
+	@echo "### Building cooker"
+	@echo "################################################################################"
+	time g++ $(COMPILER_FLAGS) src/_cooker_unity.cpp -o bin/peony_cooker $(LINKER_FLAGS)
+
+assets: cooker shaders
+	./bin/peony_cooker bin/assets.pack $(SHADER_OBJS) $(ASSET_SRCS)
+
 run:
 	@./bin/peony
@@ -34,5 +34,14 @@ unity-bare: shaders
 
 unity: unity-bundle
 
+cooker:
+	@echo "################################################################################"
+	@echo "### Building cooker"
+	@echo "################################################################################"
+	time g++ $(COMPILER_FLAGS) $(LINKER_FLAGS) src/_cooker_unity.cpp -o bin/peony_cooker
+
+assets: cooker shaders
+	./bin/peony_cooker bin/assets.pack $(SHADER_OBJS) $(ASSET_SRCS)
+
 run:
 	@./bin/peony.app/Contents/MacOS/peony
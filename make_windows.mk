@@ -27,5 +27,14 @@ unity: shaders
 	cl $(COMPILER_FLAGS) src/_unity.cpp -link $(LINKER_FLAGS) -out:bin/peony.exe
 	ctime -end bin/peony.ctm %LastError%
 
+cooker:
+	@echo "################################################################################"
+	@echo "### Building cooker"
+	@echo "################################################################################"
+	cl $(COMPILER_FLAGS) src/_cooker_unity.cpp -link $(LINKER_FLAGS) -out:bin/peony_cooker.exe
+
+assets: cooker shaders
+	bin/peony_cooker.exe bin/assets.pack $(SHADER_OBJS) $(ASSET_SRCS)
+
 run:
 	@bin/peony.exe
@@ -0,0 +1,8 @@
+#include "../src_external/pstr.c"
+#include "logs.cpp"
+#include "tasks.cpp"
+#include "files_os.cpp"
+#include "images.cpp"
+#include "ktx.cpp"
+#include "pack.cpp"
+#include "cooker.cpp"
@@ -1,8 +1,14 @@
 #include "../src_external/pstr.c"
 #include "logs.cpp"
+#include "tasks.cpp"
 #include "files.cpp"
 #include "engine.cpp"
 #include "vulkan.cpp"
 #include "memory.cpp"
 #include "util.cpp"
+#include "meshopt.cpp"
+#include "images.cpp"
+#include "ktx.cpp"
+#include "pack.cpp"
+#include "files_os.cpp"
 #include "main.cpp"
@@ -5,6 +5,7 @@
 #include <GLFW/glfw3.h>
 
 #include "types.hpp"
+#include "tasks.hpp"
 
 struct GlobalUniforms {
   m4 model_matrix;
@@ -16,10 +17,19 @@ struct GlobalUniforms {
 struct EntityUniforms {
 };
 
+// What the lighting stage shows instead of the lit scene. Each one is a
+// separate pipeline variant, see `lighting.frag`.
+enum class LightingDebugView : u32 { none, normal, albedo, pbr, split, length };
+
 struct CommonState {
   GLFWwindow *window;
   VkExtent2D extent;
   GlobalUniforms global_uniforms;
   EntityUniforms entity_uniforms;
+  tasks::WorkerPool worker_pool;
+  LightingDebugView lighting_debug_view;
+  // Whether to keep recorded command buffers and submit them again for as
+  // long as nothing but uniform data changes
+  bool should_cache_command_buffers;
   bool should_quit;
 };
@@ -0,0 +1,367 @@
+/*
+  peony_cooker bakes loose assets into a single asset pack (see pack.hpp) that
+  the engine can map into memory and upload from directly.
+
+  Usage: peony_cooker <output.pack> <input>...
+
+  Inputs are cooked based on their extension:
+    .spv                        shader, copied as-is
+    .ktx2                       texture, copied as-is with all its levels
+    .jpg .jpeg .png .tga .bmp   texture, converted to RGBA8 sRGB with a full mip chain
+    .obj .fbx .gltf .glb .dae   mesh, with all meshes in the file merged into one
+
+  Each entry is named after its input file, see `pack::get_entry_name()`.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <string.h>
+#include <vulkan/vulkan.h>
+#include <assimp/cimport.h>
+#include <assimp/scene.h>
+#include <assimp/postprocess.h>
+#include "../src_external/pstr.h"
+#include "stb.hpp"
+#include "logs.hpp"
+#include "intrinsics.hpp"
+#include "images.hpp"
+#include "ktx.hpp"
+#include "pack.hpp"
+
+
+namespace cooker {
+  static constexpr u32 MAX_N_ENTRIES = 1024;
+
+  struct PackWriter {
+    FILE *file;
+    u64 offset;
+    pack::TocEntry toc[MAX_N_ENTRIES];
+    u32 n_entries;
+  };
+
+
+  static u8* read_file(char const *path, size_t *file_size) {
+    FILE *f = fopen(path, "rb");
+    if (!f) {
+      logs::error("Could not open file %s.", path);
+      return nullptr;
+    }
+    fseek(f, 0, SEEK_END);
+    *file_size = ftell(f);
+    fseek(f, 0, SEEK_SET);
+
+    u8 *buffer = (u8*)malloc(*file_size);
+    size_t result = fread(buffer, *file_size, 1, f);
+    fclose(f);
+    if (result != 1) {
+      logs::error("Could not read from file %s.", path);
+      free(buffer);
+      return nullptr;
+    }
+    return buffer;
+  }
+
+
+  static void write_bytes(PackWriter *writer, void const *data, size_t size) {
+    if (size > 0 && fwrite(data, size, 1, writer->file) != 1) {
+      logs::fatal("Could not write to asset pack");
+    }
+    writer->offset += size;
+  }
+
+
+  static void write_padding(PackWriter *writer, u64 alignment) {
+    constexpr u8 zeroes[pack::ENTRY_ALIGNMENT] = {};
+    u64 const n_padding_bytes = (alignment - (writer->offset % alignment)) % alignment;
+    assert(n_padding_bytes <= sizeof(zeroes));
+    write_bytes(writer, zeroes, (size_t)n_padding_bytes);
+  }
+
+
+  static u64 align_offset(u64 offset) {
+    return (offset + pack::ENTRY_ALIGNMENT - 1) & ~((u64)pack::ENTRY_ALIGNMENT - 1);
+  }
+
+
+  static pack::TocEntry* begin_entry(PackWriter *writer, char const *name, pack::EntryType type) {
+    range (0, writer->n_entries) {
+      if (writer->toc[idx].type == type && pstr_eq(writer->toc[idx].name, name)) {
+        logs::warning("Skipping duplicate entry %s", name);
+        return nullptr;
+      }
+    }
+    if (writer->n_entries >= MAX_N_ENTRIES) {
+      logs::fatal("Too many entries in asset pack");
+    }
+
+    write_padding(writer, pack::ENTRY_ALIGNMENT);
+    pack::TocEntry *entry = &writer->toc[writer->n_entries++];
+    *entry = {
+      .type   = type,
+      .offset = writer->offset,
+    };
+    pstr_copy(entry->name, sizeof(entry->name), name);
+    return entry;
+  }
+
+
+  static void end_entry(PackWriter *writer, pack::TocEntry *entry) {
+    entry->size = writer->offset - entry->offset;
+    logs::info("Cooked %s (%d bytes)", entry->name, (u32)entry->size);
+  }
+
+
+  static void write_texture(
+    PackWriter *writer, char const *name,
+    u32 vk_format, u32 width, u32 height, u32 n_mip_levels,
+    u8 const * const *level_data, u64 const *level_sizes
+  ) {
+    pack::TocEntry *entry = begin_entry(writer, name, pack::EntryType::texture);
+    if (!entry) {
+      return;
+    }
+
+    pack::TextureHeader header = {
+      .vk_format    = vk_format,
+      .width        = width,
+      .height       = height,
+      .n_mip_levels = n_mip_levels,
+    };
+    u64 level_offset = align_offset(sizeof(header));
+    range (0, n_mip_levels) {
+      header.level_offsets[idx] = level_offset;
+      header.level_sizes[idx] = level_sizes[idx];
+      level_offset = align_offset(level_offset + level_sizes[idx]);
+    }
+
+    write_bytes(writer, &header, sizeof(header));
+    range (0, n_mip_levels) {
+      write_padding(writer, pack::ENTRY_ALIGNMENT);
+      write_bytes(writer, level_data[idx], (size_t)level_sizes[idx]);
+    }
+    end_entry(writer, entry);
+  }
+
+
+  static bool cook_shader(PackWriter *writer, char const *path, char const *name) {
+    size_t shader_size;
+    u8 *shader = read_file(path, &shader_size);
+    if (!shader) {
+      return false;
+    }
+    pack::TocEntry *entry = begin_entry(writer, name, pack::EntryType::shader);
+    if (entry) {
+      write_bytes(writer, shader, shader_size);
+      end_entry(writer, entry);
+    }
+    free(shader);
+    return true;
+  }
+
+
+  static bool cook_ktx2_texture(PackWriter *writer, char const *path, char const *name) {
+    size_t file_size;
+    u8 *file_data = read_file(path, &file_size);
+    if (!file_data) {
+      return false;
+    }
+    ktx::Texture texture;
+    if (!ktx::parse_ktx2(&texture, file_data, file_size)) {
+      free(file_data);
+      return false;
+    }
+    write_texture(writer, name, texture.format, texture.width, texture.height, texture.n_mip_levels,
+      texture.level_data, texture.level_sizes);
+    free(file_data);
+    return true;
+  }
+
+
+  static bool cook_image_texture(PackWriter *writer, char const *path, char const *name) {
+    int width, height, n_channels;
+    stbi_set_flip_vertically_on_load(false);
+    u8 *image = stbi_load(path, &width, &height, &n_channels, STBI_rgb_alpha);
+    if (!image) {
+      logs::error("Could not load image %s: %s", path, stbi_failure_reason());
+      return false;
+    }
+
+    u32 const n_mip_levels = images::get_n_mip_levels(width, height);
+    if (n_mip_levels > pack::MAX_N_TEXTURE_LEVELS) {
+      logs::error("Image %s is too large", path);
+      stbi_image_free(image);
+      return false;
+    }
+
+    u8 *level_data[pack::MAX_N_TEXTURE_LEVELS];
+    u64 level_sizes[pack::MAX_N_TEXTURE_LEVELS];
+    level_data[0] = image;
+    level_sizes[0] = (u64)width * height * 4;
+    range (1, n_mip_levels) {
+      u32 const mip_width = images::get_mip_dimension(width, idx);
+      u32 const mip_height = images::get_mip_dimension(height, idx);
+      level_sizes[idx] = (u64)mip_width * mip_height * 4;
+      level_data[idx] = (u8*)malloc((size_t)level_sizes[idx]);
+      images::downsample_rgba8(level_data[idx], mip_width, mip_height,
+        level_data[idx - 1], images::get_mip_dimension(width, idx - 1), images::get_mip_dimension(height, idx - 1));
+    }
+
+    write_texture(writer, name, VK_FORMAT_R8G8B8A8_SRGB, width, height, n_mip_levels,
+      level_data, level_sizes);
+
+    range (1, n_mip_levels) {
+      free(level_data[idx]);
+    }
+    stbi_image_free(image);
+    return true;
+  }
+
+
+  static bool cook_mesh(PackWriter *writer, char const *path, char const *name) {
+    aiScene const *scene = aiImportFile(path,
+      aiProcess_Triangulate | aiProcess_JoinIdenticalVertices | aiProcess_GenSmoothNormals |
+      aiProcess_PreTransformVertices);
+    if (!scene) {
+      logs::error("Could not load mesh %s: %s", path, aiGetErrorString());
+      return false;
+    }
+
+    u32 n_vertices = 0;
+    u32 n_indices = 0;
+    range (0, scene->mNumMeshes) {
+      n_vertices += scene->mMeshes[idx]->mNumVertices;
+      n_indices += scene->mMeshes[idx]->mNumFaces * 3;
+    }
+
+    pack::MeshVertex *vertices = (pack::MeshVertex*)calloc(n_vertices, sizeof(pack::MeshVertex));
+    u32 *indices = (u32*)calloc(n_indices, sizeof(u32));
+    u32 idx_vertex = 0;
+    u32 idx_index = 0;
+    range_named (idx_mesh, 0, scene->mNumMeshes) {
+      aiMesh const *mesh = scene->mMeshes[idx_mesh];
+      u32 const base_vertex = idx_vertex;
+      range (0, mesh->mNumVertices) {
+        pack::MeshVertex *vertex = &vertices[idx_vertex++];
+        vertex->position[0] = mesh->mVertices[idx].x;
+        vertex->position[1] = mesh->mVertices[idx].y;
+        vertex->position[2] = mesh->mVertices[idx].z;
+        if (mesh->mNormals) {
+          vertex->normal[0] = mesh->mNormals[idx].x;
+          vertex->normal[1] = mesh->mNormals[idx].y;
+          vertex->normal[2] = mesh->mNormals[idx].z;
+        }
+        if (mesh->mTextureCoords[0]) {
+          vertex->tex_coords[0] = mesh->mTextureCoords[0][idx].x;
+          vertex->tex_coords[1] = mesh->mTextureCoords[0][idx].y;
+        }
+      }
+      range (0, mesh->mNumFaces) {
+        aiFace const *face = &mesh->mFaces[idx];
+        // Triangulation leaves points and lines alone, so skip those
+        if (face->mNumIndices != 3) {
+          continue;
+        }
+        range_named (idx_corner, 0, 3) {
+          indices[idx_index++] = base_vertex + face->mIndices[idx_corner];
+        }
+      }
+    }
+    n_indices = idx_index;
+    aiReleaseImport(scene);
+
+    pack::TocEntry *entry = begin_entry(writer, name, pack::EntryType::mesh);
+    if (entry) {
+      u64 const vertices_offset = align_offset(sizeof(pack::MeshHeader));
+      pack::MeshHeader const header = {
+        .n_vertices      = n_vertices,
+        .n_indices       = n_indices,
+        .vertices_offset = vertices_offset,
+        .indices_offset  = align_offset(vertices_offset + sizeof(pack::MeshVertex) * n_vertices),
+      };
+      write_bytes(writer, &header, sizeof(header));
+      write_padding(writer, pack::ENTRY_ALIGNMENT);
+      write_bytes(writer, vertices, sizeof(pack::MeshVertex) * n_vertices);
+      write_padding(writer, pack::ENTRY_ALIGNMENT);
+      write_bytes(writer, indices, sizeof(u32) * n_indices);
+      end_entry(writer, entry);
+    }
+
+    free(vertices);
+    free(indices);
+    return true;
+  }
+
+
+  static bool cook_file(PackWriter *writer, char const *path) {
+    char name[pack::MAX_ENTRY_NAME_LENGTH];
+    pack::get_entry_name(name, sizeof(name), path);
+
+    char const *extension = strrchr(path, '.');
+    if (!extension) {
+      logs::error("Don't know how to cook %s", path);
+      return false;
+    }
+
+    if (pstr_eq(extension, ".spv")) {
+      return cook_shader(writer, path, name);
+    } else if (pstr_eq(extension, ".ktx2")) {
+      return cook_ktx2_texture(writer, path, name);
+    } else if (
+      pstr_eq(extension, ".jpg") || pstr_eq(extension, ".jpeg") || pstr_eq(extension, ".png") ||
+      pstr_eq(extension, ".tga") || pstr_eq(extension, ".bmp")
+    ) {
+      return cook_image_texture(writer, path, name);
+    } else if (
+      pstr_eq(extension, ".obj") || pstr_eq(extension, ".fbx") || pstr_eq(extension, ".gltf") ||
+      pstr_eq(extension, ".glb") || pstr_eq(extension, ".dae")
+    ) {
+      return cook_mesh(writer, path, name);
+    }
+
+    logs::error("Don't know how to cook %s", path);
+    return false;
+  }
+}
+
+
+int main(int argc, char **argv) {
+  if (argc < 3) {
+    fprintf(stderr, "Usage: %s <output.pack> <input>...\n", argv[0]);
+    return 1;
+  }
+
+  cooker::PackWriter *writer = (cooker::PackWriter*)calloc(1, sizeof(cooker::PackWriter));
+  defer { free(writer); };
+  writer->file = fopen(argv[1], "wb");
+  if (!writer->file) {
+    logs::error("Could not open %s for writing", argv[1]);
+    return 1;
+  }
+
+  // We fill the header in once we know where the table of contents goes
+  pack::Header header = {};
+  cooker::write_bytes(writer, &header, sizeof(header));
+
+  bool did_succeed = true;
+  range (2, (u32)argc) {
+    if (!cooker::cook_file(writer, argv[idx])) {
+      did_succeed = false;
+    }
+  }
+
+  cooker::write_padding(writer, pack::ENTRY_ALIGNMENT);
+  header = {
+    .magic      = pack::MAGIC,
+    .version    = pack::VERSION,
+    .n_entries  = writer->n_entries,
+    .toc_offset = writer->offset,
+  };
+  cooker::write_bytes(writer, writer->toc, sizeof(pack::TocEntry) * writer->n_entries);
+  fseek(writer->file, 0, SEEK_SET);
+  fwrite(&header, sizeof(header), 1, writer->file);
+  fclose(writer->file);
+
+  logs::info("Wrote %s with %d entries", argv[1], writer->n_entries);
+  return did_succeed ? 0 : 1;
+}
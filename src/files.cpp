@@ -5,16 +5,91 @@
 */
 
 #include <errno.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
 #include "logs.hpp"
+#include "intrinsics.hpp"
 #include "memory.hpp"
 #include "stb.hpp"
+#include "images.hpp"
 #include "files.hpp"
 
 
+namespace files {
+  // Opens a file and gets its size from the open handle, rather than seeking
+  // to the end and back
+  static FILE* open_file(char const *path, size_t *file_size) {
+    FILE *f = fopen(path, "rb");
+    if (!f) {
+      logs::error("Could not open file %s.", path);
+      return nullptr;
+    }
+    #if PLATFORM & PLATFORM_WINDOWS
+      struct _stat64 file_stat;
+      bool const did_stat = _fstat64(_fileno(f), &file_stat) == 0;
+    #else
+      struct stat file_stat;
+      bool const did_stat = fstat(fileno(f), &file_stat) == 0;
+    #endif
+    if (!did_stat) {
+      logs::error("Could not get size of file %s.", path);
+      fclose(f);
+      return nullptr;
+    }
+    *file_size = (size_t)file_stat.st_size;
+    return f;
+  }
+
+
+  // Reads `size` bytes into `buffer`, then closes the file
+  static bool read_open_file(FILE *f, void *buffer, size_t size, char const *path) {
+    size_t const result = size > 0 ? fread(buffer, size, 1, f) : 1;
+    fclose(f);
+    if (result != 1) {
+      logs::error("Could not read from file %s.", path);
+      return false;
+    }
+    return true;
+  }
+
+
+  static void decode_image(void *data) {
+    ImageDecodeRequest *request = (ImageDecodeRequest*)data;
+    request->did_succeed = false;
+
+    // We decode to whatever channels the file has, then expand to RGBA8 and
+    // flip in the same pass that writes into `dest`. This saves stb a pass
+    // and an allocation to convert the channels itself. Flipping is per-thread
+    // in stb, and we turn it off since we do it ourselves.
+    stbi_set_flip_vertically_on_load_thread(false);
+    i32 n_channels;
+    unsigned char *image_data = request->encoded_data ?
+      stbi_load_from_memory(request->encoded_data, (int)request->encoded_size, &request->width, &request->height,
+        &n_channels, 0) :
+      stbi_load(request->path, &request->width, &request->height, &n_channels, 0);
+    if (!image_data) {
+      logs::error("Could not decode image %s: %s", request->path, stbi_failure_reason());
+      return;
+    }
+    defer { stbi_image_free(image_data); };
+
+    if ((size_t)request->width * request->height * 4 > request->dest_size) {
+      logs::error("Image %s does not fit in its destination (%d x %d)",
+        request->path, request->width, request->height);
+      return;
+    }
+    images::convert_to_rgba8(request->dest, image_data, request->width, request->height, n_channels,
+      request->should_flip);
+    request->did_succeed = true;
+  }
+}
+
+
 unsigned char* files::load_image(
   char const *path, int32 *width, int32 *height, int32 *n_channels, int32 desired_channels, bool should_flip
 ) {
-  stbi_set_flip_vertically_on_load(should_flip);
+  stbi_set_flip_vertically_on_load_thread(should_flip);
   unsigned char *image_data = stbi_load(path, width, height, n_channels, desired_channels);
   if (!image_data) {
     logs::fatal("Could not open file %s: (strerror: %s) (stbi_failure_reason: %s)",
@@ -29,81 +104,63 @@ void files::free_image(unsigned char *image_data) {
 }
 
 
-u32 files::get_file_size(char const * const path) {
-  FILE *f = fopen(path, "rb");
-  if (!f) {
-    logs::error("Could not open file %s.", path);
-    return 0;
+bool files::get_image_info(char const *path, i32 *width, i32 *height, i32 *n_channels) {
+  // Only reads the header, so this is cheap compared to decoding
+  return stbi_info(path, width, height, n_channels) != 0;
+}
+
+
+bool files::get_image_info_from_memory(u8 const *data, size_t size, i32 *width, i32 *height, i32 *n_channels) {
+  return stbi_info_from_memory(data, (int)size, width, height, n_channels) != 0;
+}
+
+
+void files::decode_images(tasks::WorkerPool *worker_pool, ImageDecodeRequest *requests, u32 n_requests) {
+  // Pipelines might be building on the same pool, and we don't want to wait
+  // for those too
+  tasks::TaskGroup group = {};
+  range (0, n_requests) {
+    tasks::push_group_task(worker_pool, &group, decode_image, &requests[idx]);
   }
-  fseek(f, 0, SEEK_END);
-  u32 size = ftell(f);
-  fclose(f);
-  return size;
+  tasks::wait_for_group(worker_pool, &group);
 }
 
 
 char* files::load_file_to_pool_str(MemoryPool *memory_pool, char const *path, size_t *file_size) {
-  FILE *f = fopen(path, "rb");
+  FILE *f = open_file(path, file_size);
   if (!f) {
-    logs::error("Could not open file %s.", path);
     return nullptr;
   }
-  fseek(f, 0, SEEK_END);
-  *file_size = ftell(f);
-  fseek(f, 0, SEEK_SET);
-
   char *buffer = (char*)memory::push(memory_pool, (*file_size) + 1, path);
-  size_t result = fread(buffer, *file_size, 1, f);
-  fclose(f);
-  if (result != 1) {
-    logs::error("Could not read from file %s.", path);
+  if (!read_open_file(f, buffer, *file_size, path)) {
     return nullptr;
   }
-
   buffer[*file_size] = 0;
   return buffer;
 }
 
 
 u8* files::load_file_to_pool_u8(MemoryPool *memory_pool, char const *path, size_t *file_size) {
-  FILE *f = fopen(path, "rb");
+  FILE *f = open_file(path, file_size);
   if (!f) {
-    logs::error("Could not open file %s.", path);
     return nullptr;
   }
-  fseek(f, 0, SEEK_END);
-  *file_size = ftell(f);
-  fseek(f, 0, SEEK_SET);
-
   u8 *buffer = (u8*)memory::push(memory_pool, *file_size, path);
-  size_t result = fread(buffer, *file_size, 1, f);
-  fclose(f);
-  if (result != 1) {
-    logs::error("Could not read from file %s.", path);
+  if (!read_open_file(f, buffer, *file_size, path)) {
     return nullptr;
   }
-
   return buffer;
 }
 
 
 char* files::load_file_to_str(char *buffer, char const *path, size_t *file_size) {
-  FILE *f = fopen(path, "rb");
+  FILE *f = open_file(path, file_size);
   if (!f) {
-    logs::error("Could not open file %s.", path);
     return nullptr;
   }
-  fseek(f, 0, SEEK_END);
-  *file_size = ftell(f);
-  fseek(f, 0, SEEK_SET);
-
-  size_t result = fread(buffer, *file_size, 1, f);
-  fclose(f);
-  if (result != 1) {
-    logs::error("Could not read from file %s.", path);
+  if (!read_open_file(f, buffer, *file_size, path)) {
     return nullptr;
   }
-
   buffer[*file_size] = 0;
   return buffer;
 }
@@ -6,16 +6,135 @@
 
 #pragma once
 
+#include <mutex>
+#include <condition_variable>
 #include "types.hpp"
+#include "constants.hpp"
 #include "memory.hpp"
+#include "tasks.hpp"
 
 namespace files {
+  static constexpr u32 MAX_N_PENDING_READS = 256;
+
+  // A read-only view of a whole file, mapped into memory
+  struct FileView {
+    u8 const *data;
+    size_t size;
+    #if PLATFORM & PLATFORM_WINDOWS
+      void *file_handle;
+      void *mapping_handle;
+    #endif
+  };
+
+  struct FileReader;
+
+  struct FileReadRequest {
+    char const *path;
+    // Where the file goes, which needs room for `dest_size` bytes. We read
+    // until the end of the file or until `dest` is full.
+    u8 *dest;
+    size_t dest_size;
+    // Filled in once the read has completed
+    size_t n_bytes_read;
+    bool did_succeed;
+    // Used by the reader while the request is in flight
+    FileReader *reader;
+    i32 fd;
+  };
+
+  #if defined(__linux__)
+    // The parts of an io_uring instance that we need. The rings are shared
+    // with the kernel, and we set them up ourselves with raw syscalls.
+    struct IoUring {
+      i32 fd;
+      void *sq_ring;
+      size_t sq_ring_size;
+      void *cq_ring;
+      size_t cq_ring_size;
+      void *sqes;
+      size_t sqes_size;
+      u32 *sq_head;
+      u32 *sq_tail;
+      u32 *sq_ring_mask;
+      u32 *sq_array;
+      u32 *cq_head;
+      u32 *cq_tail;
+      u32 *cq_ring_mask;
+      void *cqes;
+    };
+  #endif
+
+  // Reads many files at once, handing back each one as it completes. On Linux
+  // this uses io_uring, and everywhere else (or if io_uring isn't available)
+  // the reads happen on the worker pool.
+  struct FileReader {
+    tasks::WorkerPool *worker_pool;
+    std::mutex mutex;
+    std::condition_variable read_completed;
+    // Reads that have been submitted but not handed back yet
+    u32 n_pending_reads;
+    // A ring buffer of completed reads that haven't been handed back yet
+    FileReadRequest *completed_reads[MAX_N_PENDING_READS];
+    u32 idx_completed_reads_head;
+    u32 n_completed_reads;
+    #if defined(__linux__)
+      // Whether new reads go to io_uring, which we turn off if it doesn't work
+      bool is_using_io_uring;
+      // Reads that are currently with the kernel. Only touched by the thread
+      // that owns the reader.
+      u32 n_io_uring_reads;
+      IoUring io_uring;
+    #endif
+  };
+  // Watches a directory for files that have been written to. This uses inotify
+  // on Linux, and doesn't do anything anywhere else.
+  struct FileWatcher {
+    bool is_watching;
+    #if defined(__linux__)
+      i32 fd;
+      // Events we've read from the kernel but not handed back yet
+      alignas(8) u8 event_buffer[4096];
+      u32 event_buffer_size;
+      u32 idx_next_event;
+    #endif
+  };
+
+  // Images are always decoded to RGBA8
+  struct ImageDecodeRequest {
+    char const *path;
+    // The file's contents, if we've already read it, otherwise we read `path`
+    u8 const *encoded_data;
+    size_t encoded_size;
+    bool should_flip;
+    // Where the pixels go, which needs room for `width * height * 4` bytes
+    u8 *dest;
+    size_t dest_size;
+    // Filled in once the image has been decoded
+    i32 width;
+    i32 height;
+    bool did_succeed;
+  };
+
   unsigned char* load_image(
     const char *path, int32 *width, int32 *height, int32 *n_channels, int32 desired_channels, bool should_flip
   );
   void free_image(unsigned char *image_data);
+  bool get_image_info(char const *path, i32 *width, i32 *height, i32 *n_channels);
+  bool get_image_info_from_memory(u8 const *data, size_t size, i32 *width, i32 *height, i32 *n_channels);
+  void decode_images(tasks::WorkerPool *worker_pool, ImageDecodeRequest *requests, u32 n_requests);
 
-  u32 get_file_size(char const * const path);
+  bool does_file_exist(char const * const path);
+  size_t get_file_size(char const * const path);
+  bool map_file(FileView *view, char const *path);
+  void unmap_file(FileView *view);
+  void init_file_reader(FileReader *reader, tasks::WorkerPool *worker_pool);
+  void destroy_file_reader(FileReader *reader);
+  void submit_reads(FileReader *reader, FileReadRequest *requests, u32 n_requests);
+  FileReadRequest* poll_read(FileReader *reader);
+  FileReadRequest* wait_for_read(FileReader *reader);
+  bool init_file_watcher(FileWatcher *watcher, char const *dir_path);
+  void destroy_file_watcher(FileWatcher *watcher);
+  bool poll_file_watcher(FileWatcher *watcher, char *changed_file_name, size_t changed_file_name_size);
   char* load_file_to_pool_str(MemoryPool *memory_pool, char const *path, size_t *file_size);
   u8* load_file_to_pool_u8(MemoryPool *memory_pool, char const *path, size_t *file_size);
   char* load_file_to_str(char *buffer, char const *path, size_t *file_size);
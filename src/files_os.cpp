@@ -0,0 +1,535 @@
+/*
+  The parts of `files` that talk to the OS directly: stat, memory-mapped
+  views and batched asynchronous reads. Nothing in here needs a memory pool
+  or an image decoder, so the asset cooker can use it too.
+*/
+
+#include <new>
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include "constants.hpp"
+#if PLATFORM & PLATFORM_WINDOWS
+  #include <windows.h>
+  #include <sys/types.h>
+  #include <sys/stat.h>
+#else
+  #include <fcntl.h>
+  #include <sys/mman.h>
+  #include <sys/stat.h>
+  #include <unistd.h>
+#endif
+#if defined(__linux__)
+  #include <linux/io_uring.h>
+  #include <sys/inotify.h>
+  #include <sys/syscall.h>
+#endif
+#include "logs.hpp"
+#include "intrinsics.hpp"
+#include "files.hpp"
+
+
+namespace files {
+  static void push_completed_read(FileReader *reader, FileReadRequest *request) {
+    std::lock_guard<std::mutex> lock(reader->mutex);
+    assert(reader->n_completed_reads < MAX_N_PENDING_READS);
+    u32 const idx_tail = (reader->idx_completed_reads_head + reader->n_completed_reads) % MAX_N_PENDING_READS;
+    reader->completed_reads[idx_tail] = request;
+    reader->n_completed_reads++;
+    reader->read_completed.notify_all();
+  }
+
+
+  // Must be called with the reader's mutex held
+  static FileReadRequest* pop_completed_read(FileReader *reader) {
+    if (reader->n_completed_reads == 0) {
+      return nullptr;
+    }
+    FileReadRequest *request = reader->completed_reads[reader->idx_completed_reads_head];
+    reader->idx_completed_reads_head = (reader->idx_completed_reads_head + 1) % MAX_N_PENDING_READS;
+    reader->n_completed_reads--;
+    reader->n_pending_reads--;
+    return request;
+  }
+
+
+  static void read_file_blocking(FileReadRequest *request) {
+    request->n_bytes_read = 0;
+    request->did_succeed = false;
+    FILE *f = fopen(request->path, "rb");
+    if (!f) {
+      logs::error("Could not open file %s.", request->path);
+      return;
+    }
+    while (request->n_bytes_read < request->dest_size) {
+      size_t const n_bytes_read = fread(request->dest + request->n_bytes_read, 1,
+        request->dest_size - request->n_bytes_read, f);
+      if (n_bytes_read == 0) {
+        break;
+      }
+      request->n_bytes_read += n_bytes_read;
+    }
+    request->did_succeed = !ferror(f);
+    if (!request->did_succeed) {
+      logs::error("Could not read from file %s.", request->path);
+    }
+    fclose(f);
+  }
+
+
+  static void read_file_task(void *data) {
+    FileReadRequest *request = (FileReadRequest*)data;
+    read_file_blocking(request);
+    push_completed_read(request->reader, request);
+  }
+
+
+  #if defined(__linux__)
+    static i32 io_uring_setup(u32 n_entries, io_uring_params *params) {
+      return (i32)syscall(__NR_io_uring_setup, n_entries, params);
+    }
+
+
+    static i32 io_uring_enter(i32 fd, u32 n_to_submit, u32 min_complete, u32 flags) {
+      return (i32)syscall(__NR_io_uring_enter, fd, n_to_submit, min_complete, flags, nullptr, 0);
+    }
+
+
+    static bool init_io_uring(IoUring *ring) {
+      *ring = {};
+      io_uring_params params = {};
+      ring->fd = io_uring_setup(MAX_N_PENDING_READS, &params);
+      if (ring->fd < 0) {
+        // Usually because the kernel is too old, or because we're in a
+        // sandbox that doesn't allow io_uring
+        logs::info("io_uring is not available (%s), reading files on worker threads", strerror(errno));
+        return false;
+      }
+
+      ring->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(u32);
+      ring->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+      bool const is_single_mmap = params.features & IORING_FEAT_SINGLE_MMAP;
+      if (is_single_mmap) {
+        ring->sq_ring_size = max(ring->sq_ring_size, ring->cq_ring_size);
+        ring->cq_ring_size = ring->sq_ring_size;
+      }
+      ring->sqes_size = params.sq_entries * sizeof(io_uring_sqe);
+
+      ring->sq_ring = mmap(nullptr, ring->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+        ring->fd, IORING_OFF_SQ_RING);
+      ring->cq_ring = is_single_mmap ? ring->sq_ring :
+        mmap(nullptr, ring->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+          ring->fd, IORING_OFF_CQ_RING);
+      ring->sqes = mmap(nullptr, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+        ring->fd, IORING_OFF_SQES);
+      if (ring->sq_ring == MAP_FAILED || ring->cq_ring == MAP_FAILED || ring->sqes == MAP_FAILED) {
+        logs::warning("Could not map io_uring rings, reading files on worker threads");
+        if (ring->sqes != MAP_FAILED) {
+          munmap(ring->sqes, ring->sqes_size);
+        }
+        if (!is_single_mmap && ring->cq_ring != MAP_FAILED) {
+          munmap(ring->cq_ring, ring->cq_ring_size);
+        }
+        if (ring->sq_ring != MAP_FAILED) {
+          munmap(ring->sq_ring, ring->sq_ring_size);
+        }
+        close(ring->fd);
+        *ring = {};
+        return false;
+      }
+
+      u8 *sq_ring = (u8*)ring->sq_ring;
+      u8 *cq_ring = (u8*)ring->cq_ring;
+      ring->sq_head      = (u32*)(sq_ring + params.sq_off.head);
+      ring->sq_tail      = (u32*)(sq_ring + params.sq_off.tail);
+      ring->sq_ring_mask = (u32*)(sq_ring + params.sq_off.ring_mask);
+      ring->sq_array     = (u32*)(sq_ring + params.sq_off.array);
+      ring->cq_head      = (u32*)(cq_ring + params.cq_off.head);
+      ring->cq_tail      = (u32*)(cq_ring + params.cq_off.tail);
+      ring->cq_ring_mask = (u32*)(cq_ring + params.cq_off.ring_mask);
+      ring->cqes         = cq_ring + params.cq_off.cqes;
+      logs::info("Reading files with io_uring");
+      return true;
+    }
+
+
+    static void destroy_io_uring(IoUring *ring) {
+      munmap(ring->sqes, ring->sqes_size);
+      if (ring->cq_ring != ring->sq_ring) {
+        munmap(ring->cq_ring, ring->cq_ring_size);
+      }
+      munmap(ring->sq_ring, ring->sq_ring_size);
+      close(ring->fd);
+    }
+
+
+    // Queues a read of the rest of the request's file. It only gets to the
+    // kernel once we call `io_uring_enter()`.
+    static void queue_io_uring_read(IoUring *ring, FileReadRequest *request) {
+      // We never have more reads in flight than the ring has entries, so
+      // there's always room
+      u32 const tail = *ring->sq_tail;
+      u32 const idx_sqe = tail & *ring->sq_ring_mask;
+      io_uring_sqe *sqe = &((io_uring_sqe*)ring->sqes)[idx_sqe];
+      memset(sqe, 0, sizeof(*sqe));
+      sqe->opcode    = IORING_OP_READ;
+      sqe->fd        = request->fd;
+      sqe->off       = request->n_bytes_read;
+      sqe->addr      = (u64)(request->dest + request->n_bytes_read);
+      sqe->len       = (u32)min(request->dest_size - request->n_bytes_read, (size_t)INT32_MAX);
+      sqe->user_data = (u64)request;
+      ring->sq_array[idx_sqe] = idx_sqe;
+      __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    }
+
+
+    static void submit_io_uring_reads(IoUring *ring, u32 n_reads) {
+      while (n_reads > 0) {
+        i32 const n_submitted = io_uring_enter(ring->fd, n_reads, 0, 0);
+        if (n_submitted < 0) {
+          if (errno == EINTR || errno == EAGAIN || errno == EBUSY) {
+            continue;
+          }
+          logs::fatal("Could not submit file reads to io_uring: %s", strerror(errno));
+        }
+        n_reads -= (u32)n_submitted;
+      }
+    }
+
+
+    static void finish_io_uring_read(FileReader *reader, FileReadRequest *request, bool did_succeed) {
+      reader->n_io_uring_reads--;
+      close(request->fd);
+      request->fd = -1;
+      request->did_succeed = did_succeed;
+      if (!did_succeed) {
+        logs::error("Could not read from file %s.", request->path);
+      }
+    }
+
+
+    // Handles every completion the kernel has posted, moving finished reads
+    // to the reader's completed list and requeueing short reads.
+    static void reap_io_uring_completions(FileReader *reader, bool should_wait) {
+      IoUring *ring = &reader->io_uring;
+      if (should_wait) {
+        while (io_uring_enter(ring->fd, 0, 1, IORING_ENTER_GETEVENTS) < 0) {
+          if (errno != EINTR) {
+            logs::fatal("Could not wait for io_uring completions: %s", strerror(errno));
+          }
+        }
+      }
+
+      u32 n_requeued_reads = 0;
+      u32 head = *ring->cq_head;
+      while (head != __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+        io_uring_cqe const *cqe = &((io_uring_cqe*)ring->cqes)[head & *ring->cq_ring_mask];
+        FileReadRequest *request = (FileReadRequest*)cqe->user_data;
+        i32 const result = cqe->res;
+        head++;
+        __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+
+        if (result == -EINTR || result == -EAGAIN) {
+          queue_io_uring_read(ring, request);
+          n_requeued_reads++;
+        } else if (result == -EINVAL && request->n_bytes_read == 0) {
+          // Kernels before 5.6 don't have IORING_OP_READ, so just read this
+          // one ourselves and stop using io_uring from now on
+          reader->n_io_uring_reads--;
+          close(request->fd);
+          request->fd = -1;
+          reader->is_using_io_uring = false;
+          read_file_blocking(request);
+          push_completed_read(reader, request);
+        } else if (result < 0) {
+          finish_io_uring_read(reader, request, false);
+          push_completed_read(reader, request);
+        } else {
+          request->n_bytes_read += (size_t)result;
+          if (result == 0 || request->n_bytes_read == request->dest_size) {
+            finish_io_uring_read(reader, request, true);
+            push_completed_read(reader, request);
+          } else {
+            // Short read, so carry on from where we stopped
+            queue_io_uring_read(ring, request);
+            n_requeued_reads++;
+          }
+        }
+      }
+
+      if (n_requeued_reads > 0) {
+        submit_io_uring_reads(ring, n_requeued_reads);
+      }
+    }
+  #endif
+}
+
+
+bool files::does_file_exist(char const * const path) {
+  #if PLATFORM & PLATFORM_WINDOWS
+    struct _stat64 file_stat;
+    return _stat64(path, &file_stat) == 0;
+  #else
+    struct stat file_stat;
+    return stat(path, &file_stat) == 0;
+  #endif
+}
+
+
+size_t files::get_file_size(char const * const path) {
+  #if PLATFORM & PLATFORM_WINDOWS
+    struct _stat64 file_stat;
+    if (_stat64(path, &file_stat) != 0) {
+      logs::error("Could not open file %s.", path);
+      return 0;
+    }
+  #else
+    struct stat file_stat;
+    if (stat(path, &file_stat) != 0) {
+      logs::error("Could not open file %s.", path);
+      return 0;
+    }
+  #endif
+  return (size_t)file_stat.st_size;
+}
+
+
+bool files::map_file(FileView *view, char const *path) {
+  *view = {};
+  #if PLATFORM & PLATFORM_WINDOWS
+    HANDLE file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING,
+      FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (file == INVALID_HANDLE_VALUE) {
+      return false;
+    }
+    LARGE_INTEGER file_size;
+    if (!GetFileSizeEx(file, &file_size) || file_size.QuadPart == 0) {
+      CloseHandle(file);
+      return false;
+    }
+    HANDLE mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+    if (!mapping) {
+      CloseHandle(file);
+      return false;
+    }
+    void *data = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+    if (!data) {
+      CloseHandle(mapping);
+      CloseHandle(file);
+      return false;
+    }
+    view->data = (u8 const*)data;
+    view->size = (size_t)file_size.QuadPart;
+    view->file_handle = file;
+    view->mapping_handle = mapping;
+    return true;
+  #else
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+      return false;
+    }
+    struct stat file_stat;
+    if (fstat(fd, &file_stat) != 0 || file_stat.st_size == 0) {
+      close(fd);
+      return false;
+    }
+    void *data = mmap(nullptr, (size_t)file_stat.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    // The mapping stays valid after we close the file
+    close(fd);
+    if (data == MAP_FAILED) {
+      return false;
+    }
+    view->data = (u8 const*)data;
+    view->size = (size_t)file_stat.st_size;
+    return true;
+  #endif
+}
+
+
+void files::unmap_file(FileView *view) {
+  if (!view->data) {
+    return;
+  }
+  #if PLATFORM & PLATFORM_WINDOWS
+    UnmapViewOfFile(view->data);
+    CloseHandle((HANDLE)view->mapping_handle);
+    CloseHandle((HANDLE)view->file_handle);
+  #else
+    munmap((void*)view->data, view->size);
+  #endif
+  *view = {};
+}
+
+
+void files::init_file_reader(FileReader *reader, tasks::WorkerPool *worker_pool) {
+  // Like the worker pool, this usually lives in zeroed memory, so construct
+  // its lock in place
+  new (reader) FileReader();
+  reader->worker_pool = worker_pool;
+  #if defined(__linux__)
+    reader->is_using_io_uring = init_io_uring(&reader->io_uring);
+  #endif
+}
+
+
+void files::destroy_file_reader(FileReader *reader) {
+  // Let everything finish, since the kernel or the workers might still be
+  // writing into the requests' buffers
+  while (wait_for_read(reader)) {}
+  #if defined(__linux__)
+    if (reader->io_uring.sq_ring) {
+      destroy_io_uring(&reader->io_uring);
+    }
+  #endif
+  reader->~FileReader();
+}
+
+
+void files::submit_reads(FileReader *reader, FileReadRequest *requests, u32 n_requests) {
+  {
+    std::lock_guard<std::mutex> lock(reader->mutex);
+    if (reader->n_pending_reads + n_requests > MAX_N_PENDING_READS) {
+      logs::fatal("Too many pending file reads (%d + %d)", reader->n_pending_reads, n_requests);
+    }
+    reader->n_pending_reads += n_requests;
+  }
+
+  #if defined(__linux__)
+    if (reader->is_using_io_uring) {
+      u32 n_queued_reads = 0;
+      range (0, n_requests) {
+        FileReadRequest *request = &requests[idx];
+        request->reader = reader;
+        request->n_bytes_read = 0;
+        request->did_succeed = false;
+        request->fd = open(request->path, O_RDONLY | O_CLOEXEC);
+        if (request->fd < 0) {
+          logs::error("Could not open file %s.", request->path);
+          push_completed_read(reader, request);
+          continue;
+        }
+        reader->n_io_uring_reads++;
+        if (request->dest_size == 0) {
+          finish_io_uring_read(reader, request, true);
+          push_completed_read(reader, request);
+          continue;
+        }
+        queue_io_uring_read(&reader->io_uring, request);
+        n_queued_reads++;
+      }
+      submit_io_uring_reads(&reader->io_uring, n_queued_reads);
+      return;
+    }
+  #endif
+
+  range (0, n_requests) {
+    requests[idx].reader = reader;
+    requests[idx].fd = -1;
+    tasks::push_task(reader->worker_pool, read_file_task, &requests[idx]);
+  }
+}
+
+
+files::FileReadRequest* files::poll_read(FileReader *reader) {
+  #if defined(__linux__)
+    if (reader->n_io_uring_reads > 0) {
+      reap_io_uring_completions(reader, false);
+    }
+  #endif
+  std::lock_guard<std::mutex> lock(reader->mutex);
+  return pop_completed_read(reader);
+}
+
+
+files::FileReadRequest* files::wait_for_read(FileReader *reader) {
+  // Returns the next read to complete, or `nullptr` if there are no reads
+  // left to wait for
+  #if defined(__linux__)
+    // Reads that are still with the kernel only complete when we reap them,
+    // so we can't just sleep until the workers wake us up
+    while (reader->n_io_uring_reads > 0) {
+      {
+        std::lock_guard<std::mutex> lock(reader->mutex);
+        if (reader->n_completed_reads > 0 || reader->n_pending_reads == 0) {
+          return pop_completed_read(reader);
+        }
+      }
+      reap_io_uring_completions(reader, true);
+    }
+  #endif
+  std::unique_lock<std::mutex> lock(reader->mutex);
+  reader->read_completed.wait(lock, [reader] {
+    return reader->n_completed_reads > 0 || reader->n_pending_reads == 0;
+  });
+  return pop_completed_read(reader);
+}
+
+
+bool files::init_file_watcher(FileWatcher *watcher, char const *dir_path) {
+  *watcher = {};
+  #if defined(__linux__)
+    watcher->fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (watcher->fd < 0) {
+      logs::warning("Could not start watching %s: %s", dir_path, strerror(errno));
+      return false;
+    }
+    // Compilers and editors often write to a temporary file and then rename it,
+    // so we want to know about both finished writes and renames
+    if (inotify_add_watch(watcher->fd, dir_path, IN_CLOSE_WRITE | IN_MOVED_TO) < 0) {
+      logs::warning("Could not start watching %s: %s", dir_path, strerror(errno));
+      close(watcher->fd);
+      *watcher = {};
+      return false;
+    }
+    watcher->is_watching = true;
+    return true;
+  #else
+    logs::info("Not watching %s, since file watching is only supported on Linux", dir_path);
+    return false;
+  #endif
+}
+
+
+void files::destroy_file_watcher(FileWatcher *watcher) {
+  #if defined(__linux__)
+    if (watcher->is_watching) {
+      close(watcher->fd);
+    }
+  #endif
+  *watcher = {};
+}
+
+
+bool files::poll_file_watcher(FileWatcher *watcher, char *changed_file_name, size_t changed_file_name_size) {
+  // Hands back the name of one file that changed, without blocking. Call this
+  // until it returns false to get all of them.
+  #if defined(__linux__)
+    if (!watcher->is_watching) {
+      return false;
+    }
+    while (true) {
+      if (watcher->idx_next_event >= watcher->event_buffer_size) {
+        ssize_t const n_bytes_read = read(watcher->fd, watcher->event_buffer, sizeof(watcher->event_buffer));
+        watcher->idx_next_event = 0;
+        watcher->event_buffer_size = 0;
+        if (n_bytes_read <= 0) {
+          if (n_bytes_read < 0 && errno != EAGAIN) {
+            logs::warning("Could not read file watcher events: %s", strerror(errno));
+          }
+          return false;
+        }
+        watcher->event_buffer_size = (u32)n_bytes_read;
+      }
+
+      inotify_event const *event = (inotify_event const*)&watcher->event_buffer[watcher->idx_next_event];
+      watcher->idx_next_event += sizeof(inotify_event) + event->len;
+      if (event->len == 0 || (event->mask & IN_ISDIR)) {
+        continue;
+      }
+      snprintf(changed_file_name, changed_file_name_size, "%s", event->name);
+      return true;
+    }
+  #else
+    return false;
+  #endif
+}
@@ -11,6 +11,7 @@
 #include <glm/gtc/type_ptr.hpp>
 #include <glm/gtc/matrix_transform.hpp>
 #include <glm/gtc/matrix_access.hpp>
+#include <glm/gtc/packing.hpp>
 #include <glm/gtx/quaternion.hpp>
 using glm::dot, glm::cross, glm::normalize, glm::abs, glm::max, glm::min, glm::ceil, glm::floor, glm::degrees,
   glm::radians, glm::transpose, glm::inverse, glm::length, glm::length2, glm::column, glm::row, glm::clamp, glm::rotate;
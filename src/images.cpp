@@ -0,0 +1,121 @@
+#include <string.h>
+#if defined(__SSSE3__) || defined(__AVX__)
+  #include <tmmintrin.h>
+#elif defined(__ARM_NEON)
+  #include <arm_neon.h>
+#endif
+#include "intrinsics.hpp"
+#include "images.hpp"
+
+
+namespace images {
+  static void convert_row_rgb_to_rgba8(u8 *dest, u8 const *src, u32 width) {
+    u32 x = 0;
+    #if defined(__SSSE3__) || defined(__AVX__)
+      // Four pixels at a time. Each load reads 16 bytes but only uses 12, so
+      // we stop while there are still at least 16 bytes of source left.
+      __m128i const shuffle = _mm_setr_epi8(0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11, -1);
+      __m128i const alpha = _mm_set1_epi32((i32)0xFF000000);
+      for (; x + 6 <= width; x += 4) {
+        __m128i const rgb = _mm_loadu_si128((__m128i const*)(src + x * 3));
+        __m128i const rgba = _mm_or_si128(_mm_shuffle_epi8(rgb, shuffle), alpha);
+        _mm_storeu_si128((__m128i*)(dest + x * 4), rgba);
+      }
+    #elif defined(__ARM_NEON)
+      // Sixteen pixels at a time, deinterleaving on load and interleaving on
+      // store
+      for (; x + 16 <= width; x += 16) {
+        uint8x16x3_t const rgb = vld3q_u8(src + x * 3);
+        uint8x16x4_t const rgba = {{rgb.val[0], rgb.val[1], rgb.val[2], vdupq_n_u8(0xFF)}};
+        vst4q_u8(dest + x * 4, rgba);
+      }
+    #endif
+    for (; x < width; x++) {
+      dest[x * 4 + 0] = src[x * 3 + 0];
+      dest[x * 4 + 1] = src[x * 3 + 1];
+      dest[x * 4 + 2] = src[x * 3 + 2];
+      dest[x * 4 + 3] = 0xFF;
+    }
+  }
+
+
+  static void convert_row_to_rgba8(u8 *dest, u8 const *src, u32 width, u32 n_src_channels) {
+    // Same rules as stb_image's own conversion, so we get identical results
+    // to asking it for 4 channels
+    switch (n_src_channels) {
+      case 1:
+        range_named (x, 0, width) {
+          dest[x * 4 + 0] = dest[x * 4 + 1] = dest[x * 4 + 2] = src[x];
+          dest[x * 4 + 3] = 0xFF;
+        }
+        break;
+      case 2:
+        range_named (x, 0, width) {
+          dest[x * 4 + 0] = dest[x * 4 + 1] = dest[x * 4 + 2] = src[x * 2];
+          dest[x * 4 + 3] = src[x * 2 + 1];
+        }
+        break;
+      case 3:
+        convert_row_rgb_to_rgba8(dest, src, width);
+        break;
+      case 4:
+        memcpy(dest, src, (size_t)width * 4);
+        break;
+    }
+  }
+}
+
+
+u32 images::get_n_mip_levels(u32 width, u32 height) {
+  u32 n_mip_levels = 1;
+  u32 size = width > height ? width : height;
+  while (size > 1) {
+    size /= 2;
+    n_mip_levels++;
+  }
+  return n_mip_levels;
+}
+
+
+u32 images::get_mip_dimension(u32 dimension, u32 idx_mip_level) {
+  u32 const mip_dimension = dimension >> idx_mip_level;
+  return mip_dimension > 0 ? mip_dimension : 1;
+}
+
+
+void images::downsample_rgba8(
+  u8 *dest, u32 dest_width, u32 dest_height,
+  u8 const *src, u32 src_width, u32 src_height
+) {
+  // 2x2 box filter. Odd source dimensions just clamp at the edge. This
+  // averages the stored values directly, so sRGB images come out a little
+  // dark, but it's good enough for the places we use it.
+  range_named (y, 0, dest_height) {
+    u32 const y0 = min(y * 2, src_height - 1);
+    u32 const y1 = min(y * 2 + 1, src_height - 1);
+    range_named (x, 0, dest_width) {
+      u32 const x0 = min(x * 2, src_width - 1);
+      u32 const x1 = min(x * 2 + 1, src_width - 1);
+      range_named (c, 0, 4) {
+        u32 const sum = src[(y0 * src_width + x0) * 4 + c] + src[(y0 * src_width + x1) * 4 + c] +
+          src[(y1 * src_width + x0) * 4 + c] + src[(y1 * src_width + x1) * 4 + c];
+        dest[(y * dest_width + x) * 4 + c] = (u8)((sum + 2) / 4);
+      }
+    }
+  }
+}
+
+
+void images::convert_to_rgba8(
+  u8 *dest, u8 const *src, u32 width, u32 height, u32 n_src_channels, bool should_flip
+) {
+  // Expands `src` to RGBA8 and optionally flips it vertically, all in one
+  // pass, so that decoded images can go straight into their destination.
+  assert(n_src_channels >= 1 && n_src_channels <= 4);
+  size_t const src_row_size = (size_t)width * n_src_channels;
+  size_t const dest_row_size = (size_t)width * 4;
+  range_named (y, 0, height) {
+    u32 const src_y = should_flip ? height - 1 - y : y;
+    convert_row_to_rgba8(dest + dest_row_size * y, src + src_row_size * src_y, width, n_src_channels);
+  }
+}
@@ -0,0 +1,17 @@
+#pragma once
+
+#include "types.hpp"
+
+// CPU-side image processing that doesn't depend on any graphics API, so that
+// both the engine and the asset cooker can use it.
+namespace images {
+  u32 get_n_mip_levels(u32 width, u32 height);
+  u32 get_mip_dimension(u32 dimension, u32 idx_mip_level);
+  void downsample_rgba8(
+    u8 *dest, u32 dest_width, u32 dest_height,
+    u8 const *src, u32 src_width, u32 src_height
+  );
+  void convert_to_rgba8(
+    u8 *dest, u8 const *src, u32 width, u32 height, u32 n_src_channels, bool should_flip
+  );
+}
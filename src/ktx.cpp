@@ -0,0 +1,196 @@
+#include <string.h>
+#include "logs.hpp"
+#include "intrinsics.hpp"
+#include "images.hpp"
+#include "ktx.hpp"
+
+
+namespace ktx {
+  static constexpr u8 KTX2_IDENTIFIER[12] = {
+    0xAB, 0x4B, 0x54, 0x58, 0x20, 0x32, 0x30, 0xBB, 0x0D, 0x0A, 0x1A, 0x0A,
+  };
+
+  // These mirror the layout in the KTX2 spec, which is naturally aligned, so
+  // we can just copy them out of the file.
+  struct Ktx2Header {
+    u8 identifier[12];
+    u32 vk_format;
+    u32 type_size;
+    u32 pixel_width;
+    u32 pixel_height;
+    u32 pixel_depth;
+    u32 layer_count;
+    u32 face_count;
+    u32 level_count;
+    u32 supercompression_scheme;
+    u32 dfd_byte_offset;
+    u32 dfd_byte_length;
+    u32 kvd_byte_offset;
+    u32 kvd_byte_length;
+    u64 sgd_byte_offset;
+    u64 sgd_byte_length;
+  };
+  static_assert(sizeof(Ktx2Header) == 80);
+
+  struct Ktx2LevelIndex {
+    u64 byte_offset;
+    u64 byte_length;
+    u64 uncompressed_byte_length;
+  };
+  static_assert(sizeof(Ktx2LevelIndex) == 24);
+}
+
+
+bool ktx::get_format_block(FormatBlock *block, VkFormat format) {
+  switch (format) {
+    case VK_FORMAT_R8G8B8A8_UNORM:
+    case VK_FORMAT_R8G8B8A8_SRGB:
+    case VK_FORMAT_B8G8R8A8_UNORM:
+    case VK_FORMAT_B8G8R8A8_SRGB:
+      *block = {1, 1, 4};
+      return true;
+    case VK_FORMAT_BC1_RGB_UNORM_BLOCK:
+    case VK_FORMAT_BC1_RGB_SRGB_BLOCK:
+    case VK_FORMAT_BC1_RGBA_UNORM_BLOCK:
+    case VK_FORMAT_BC1_RGBA_SRGB_BLOCK:
+    case VK_FORMAT_BC4_UNORM_BLOCK:
+    case VK_FORMAT_BC4_SNORM_BLOCK:
+    case VK_FORMAT_ETC2_R8G8B8_UNORM_BLOCK:
+    case VK_FORMAT_ETC2_R8G8B8_SRGB_BLOCK:
+    case VK_FORMAT_ETC2_R8G8B8A1_UNORM_BLOCK:
+    case VK_FORMAT_ETC2_R8G8B8A1_SRGB_BLOCK:
+    case VK_FORMAT_EAC_R11_UNORM_BLOCK:
+    case VK_FORMAT_EAC_R11_SNORM_BLOCK:
+      *block = {4, 4, 8};
+      return true;
+    case VK_FORMAT_BC2_UNORM_BLOCK:
+    case VK_FORMAT_BC2_SRGB_BLOCK:
+    case VK_FORMAT_BC3_UNORM_BLOCK:
+    case VK_FORMAT_BC3_SRGB_BLOCK:
+    case VK_FORMAT_BC5_UNORM_BLOCK:
+    case VK_FORMAT_BC5_SNORM_BLOCK:
+    case VK_FORMAT_BC6H_UFLOAT_BLOCK:
+    case VK_FORMAT_BC6H_SFLOAT_BLOCK:
+    case VK_FORMAT_BC7_UNORM_BLOCK:
+    case VK_FORMAT_BC7_SRGB_BLOCK:
+    case VK_FORMAT_ETC2_R8G8B8A8_UNORM_BLOCK:
+    case VK_FORMAT_ETC2_R8G8B8A8_SRGB_BLOCK:
+    case VK_FORMAT_EAC_R11G11_UNORM_BLOCK:
+    case VK_FORMAT_EAC_R11G11_SNORM_BLOCK:
+    case VK_FORMAT_ASTC_4x4_UNORM_BLOCK:
+    case VK_FORMAT_ASTC_4x4_SRGB_BLOCK:
+      *block = {4, 4, 16};
+      return true;
+    // Every ASTC block is 16 bytes, however many texels it covers
+    case VK_FORMAT_ASTC_5x4_UNORM_BLOCK:   case VK_FORMAT_ASTC_5x4_SRGB_BLOCK:   *block = {5, 4, 16};   return true;
+    case VK_FORMAT_ASTC_5x5_UNORM_BLOCK:   case VK_FORMAT_ASTC_5x5_SRGB_BLOCK:   *block = {5, 5, 16};   return true;
+    case VK_FORMAT_ASTC_6x5_UNORM_BLOCK:   case VK_FORMAT_ASTC_6x5_SRGB_BLOCK:   *block = {6, 5, 16};   return true;
+    case VK_FORMAT_ASTC_6x6_UNORM_BLOCK:   case VK_FORMAT_ASTC_6x6_SRGB_BLOCK:   *block = {6, 6, 16};   return true;
+    case VK_FORMAT_ASTC_8x5_UNORM_BLOCK:   case VK_FORMAT_ASTC_8x5_SRGB_BLOCK:   *block = {8, 5, 16};   return true;
+    case VK_FORMAT_ASTC_8x6_UNORM_BLOCK:   case VK_FORMAT_ASTC_8x6_SRGB_BLOCK:   *block = {8, 6, 16};   return true;
+    case VK_FORMAT_ASTC_8x8_UNORM_BLOCK:   case VK_FORMAT_ASTC_8x8_SRGB_BLOCK:   *block = {8, 8, 16};   return true;
+    case VK_FORMAT_ASTC_10x5_UNORM_BLOCK:  case VK_FORMAT_ASTC_10x5_SRGB_BLOCK:  *block = {10, 5, 16};  return true;
+    case VK_FORMAT_ASTC_10x6_UNORM_BLOCK:  case VK_FORMAT_ASTC_10x6_SRGB_BLOCK:  *block = {10, 6, 16};  return true;
+    case VK_FORMAT_ASTC_10x8_UNORM_BLOCK:  case VK_FORMAT_ASTC_10x8_SRGB_BLOCK:  *block = {10, 8, 16};  return true;
+    case VK_FORMAT_ASTC_10x10_UNORM_BLOCK: case VK_FORMAT_ASTC_10x10_SRGB_BLOCK: *block = {10, 10, 16}; return true;
+    case VK_FORMAT_ASTC_12x10_UNORM_BLOCK: case VK_FORMAT_ASTC_12x10_SRGB_BLOCK: *block = {12, 10, 16}; return true;
+    case VK_FORMAT_ASTC_12x12_UNORM_BLOCK: case VK_FORMAT_ASTC_12x12_SRGB_BLOCK: *block = {12, 12, 16}; return true;
+    default:
+      return false;
+  }
+}
+
+
+// Checks that there aren't more levels than a full mip chain has, and that each
+// level is exactly as big as its format and dimensions say, since we copy
+// whole levels to the GPU based on their dimensions.
+bool ktx::are_levels_valid(VkFormat format, u32 width, u32 height, u32 n_levels, VkDeviceSize const *level_sizes) {
+  FormatBlock block;
+  if (!get_format_block(&block, format)) {
+    logs::error("Texture has format %d, which we don't know the block size of", format);
+    return false;
+  }
+  if (width == 0 || height == 0 || n_levels == 0 || n_levels > images::get_n_mip_levels(width, height)) {
+    logs::error("Texture has %d levels, which doesn't fit its size (%dx%d)", n_levels, width, height);
+    return false;
+  }
+  range (0, n_levels) {
+    u64 const n_blocks_x = (images::get_mip_dimension(width, idx) + block.width - 1) / block.width;
+    u64 const n_blocks_y = (images::get_mip_dimension(height, idx) + block.height - 1) / block.height;
+    u64 const expected_size = n_blocks_x * n_blocks_y * block.size;
+    if (level_sizes[idx] != expected_size) {
+      logs::error("Texture level %d is %zu bytes, but should be %zu bytes",
+        idx, (size_t)level_sizes[idx], (size_t)expected_size);
+      return false;
+    }
+  }
+  return true;
+}
+
+
+bool ktx::parse_ktx2(Texture *texture, u8 const *data, size_t size) {
+  if (size < sizeof(Ktx2Header)) {
+    logs::error("KTX2 file is too small to contain a header");
+    return false;
+  }
+  Ktx2Header header;
+  memcpy(&header, data, sizeof(header));
+
+  if (memcmp(header.identifier, KTX2_IDENTIFIER, sizeof(KTX2_IDENTIFIER)) != 0) {
+    logs::error("KTX2 file has an invalid identifier");
+    return false;
+  }
+  if (header.vk_format == VK_FORMAT_UNDEFINED) {
+    logs::error("KTX2 file has no Vulkan format, Basis Universal textures are not supported");
+    return false;
+  }
+  if (header.supercompression_scheme != 0) {
+    logs::error("KTX2 file uses supercompression scheme %d, which is not supported", header.supercompression_scheme);
+    return false;
+  }
+  if (header.pixel_width == 0 || header.pixel_height == 0 || header.pixel_depth > 1) {
+    logs::error("KTX2 file is not a 2D texture");
+    return false;
+  }
+  if (header.layer_count > 1 || header.face_count != 1) {
+    logs::error("KTX2 file is an array or cubemap texture, which is not supported");
+    return false;
+  }
+
+  // A level count of 0 asks us to generate mips, which we can't do for
+  // compressed formats, so we just use the one level we have
+  u32 const n_levels = header.level_count > 0 ? header.level_count : 1;
+  if (n_levels > MAX_N_LEVELS) {
+    logs::error("KTX2 file has too many levels (%d)", n_levels);
+    return false;
+  }
+  if (size < sizeof(Ktx2Header) + sizeof(Ktx2LevelIndex) * n_levels) {
+    logs::error("KTX2 file is too small to contain its level index");
+    return false;
+  }
+
+  *texture = {
+    .format       = (VkFormat)header.vk_format,
+    .width        = header.pixel_width,
+    .height       = header.pixel_height,
+    .n_mip_levels = n_levels,
+  };
+
+  range (0, n_levels) {
+    Ktx2LevelIndex level;
+    memcpy(&level, data + sizeof(Ktx2Header) + sizeof(Ktx2LevelIndex) * idx, sizeof(level));
+    if (level.byte_length == 0 || level.byte_offset > size || level.byte_length > size - level.byte_offset) {
+      logs::error("KTX2 file has an invalid level %d", idx);
+      return false;
+    }
+    texture->level_data[idx] = data + level.byte_offset;
+    texture->level_sizes[idx] = level.byte_length;
+  }
+
+  if (!are_levels_valid(texture->format, texture->width, texture->height, n_levels, texture->level_sizes)) {
+    logs::error("KTX2 file has levels that don't match its format and size");
+    return false;
+  }
+
+  return true;
+}
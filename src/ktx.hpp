@@ -0,0 +1,33 @@
+#pragma once
+
+#include <vulkan/vulkan.h>
+#include "types.hpp"
+
+// A minimal reader for KTX2 textures, which we use for textures that have
+// been block-compressed offline. We only support single-layer 2D textures
+// without supercompression, since those can be uploaded as-is.
+namespace ktx {
+  static constexpr u32 MAX_N_LEVELS = 16;
+
+  struct Texture {
+    VkFormat format;
+    u32 width;
+    u32 height;
+    u32 n_mip_levels;
+    // Pointers into the file data, from the largest level to the smallest
+    u8 const *level_data[MAX_N_LEVELS];
+    VkDeviceSize level_sizes[MAX_N_LEVELS];
+  };
+
+  // Formats are made of blocks of texels that are stored together. For
+  // uncompressed formats, a block is just one texel.
+  struct FormatBlock {
+    u32 width;
+    u32 height;
+    u32 size;
+  };
+
+  bool get_format_block(FormatBlock *block, VkFormat format);
+  bool are_levels_valid(VkFormat format, u32 width, u32 height, u32 n_levels, VkDeviceSize const *level_sizes);
+  bool parse_ktx2(Texture *texture, u8 const *data, size_t size);
+}
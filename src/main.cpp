@@ -30,6 +30,17 @@ void key_callback(GLFWwindow* window, int key, int scancode, int action, int mod
   if (key == GLFW_KEY_ESCAPE && action == GLFW_PRESS) {
     state->common_state.should_quit = true;
   }
+
+  if (key == GLFW_KEY_F1 && action == GLFW_PRESS) {
+    CommonState *common_state = &state->common_state;
+    common_state->lighting_debug_view = (LightingDebugView)(
+      ((u32)common_state->lighting_debug_view + 1) % (u32)LightingDebugView::length);
+  }
+
+  if (key == GLFW_KEY_F2 && action == GLFW_PRESS) {
+    CommonState *common_state = &state->common_state;
+    common_state->should_cache_command_buffers = !common_state->should_cache_command_buffers;
+  }
 }
 
 
@@ -66,6 +77,9 @@ int main() {
   init_window(&state->common_state.window, state);
   defer { destroy_window(state->common_state.window); };
 
+  tasks::init_worker_pool(&state->common_state.worker_pool, tasks::get_default_n_workers());
+  defer { tasks::destroy_worker_pool(&state->common_state.worker_pool); };
+
   vulkan::init(&state->vk_state, &state->common_state);
   defer { vulkan::destroy(&state->vk_state); };
 
@@ -12,15 +12,6 @@
 
 
 namespace memory {
-  pny_internal void reset_memory_pool(MemoryPool *pool) {
-    #if USE_MEMORY_DEBUG_LOGS
-      logs::info("Resetting memory pool");
-    #endif
-    pool->used = 0;
-    pool->n_items = 0;
-  }
-
-
   pny_internal void zero_out_memory_pool(MemoryPool *pool) {
     memset(pool->memory, 0, pool->size);
     pool->used = 0;
@@ -76,6 +67,15 @@ void* memory::push(
 }
 
 
+void memory::reset_memory_pool(MemoryPool *pool) {
+  #if USE_MEMORY_DEBUG_LOGS
+    logs::info("Resetting memory pool");
+  #endif
+  pool->used = 0;
+  pool->n_items = 0;
+}
+
+
 void memory::print_memory_pool(MemoryPool *pool) {
   logs::info("MemoryPool:");
   logs::info("  Used: %.2fMB (%dB)", util::b_to_mb((uint32)pool->used), pool->used);
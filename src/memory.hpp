@@ -28,6 +28,7 @@ namespace memory {
   };
 
   void* push(MemoryPool *pool, size_t item_size, const char *item_debug_name);
+  void reset_memory_pool(MemoryPool *pool);
   void print_memory_pool(MemoryPool *pool);
   void destroy_memory_pool(MemoryPool *memory_pool);
 }
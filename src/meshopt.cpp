@@ -0,0 +1,361 @@
+#include <stdlib.h>
+#include <string.h>
+#include "intrinsics.hpp"
+#include "memory.hpp"
+#include "util.hpp"
+#include "meshopt.hpp"
+
+
+namespace meshopt {
+  static constexpr u32 NO_VERTEX = 0xFFFFFFFF;
+
+  struct ClusterSortItem {
+    f32 sort_metric;
+    u32 idx_cluster;
+  };
+
+
+  static v3 get_position(void const *vertices, size_t vertex_size, size_t position_offset, u32 idx_vertex) {
+    v3 position;
+    memcpy(&position, (u8 const*)vertices + idx_vertex * vertex_size + position_offset, sizeof(position));
+    return position;
+  }
+
+
+  static int compare_clusters(void const *a, void const *b) {
+    // Descending by metric, then by index so that the result is deterministic
+    ClusterSortItem const *cluster_a = (ClusterSortItem const*)a;
+    ClusterSortItem const *cluster_b = (ClusterSortItem const*)b;
+    if (cluster_a->sort_metric != cluster_b->sort_metric) {
+      return cluster_a->sort_metric > cluster_b->sort_metric ? -1 : 1;
+    }
+    return cluster_a->idx_cluster < cluster_b->idx_cluster ? -1 : 1;
+  }
+
+
+  // Simulates a FIFO cache of `VERTEX_CACHE_SIZE` vertices, using timestamps:
+  // a vertex is in the cache if it was added less than `VERTEX_CACHE_SIZE`
+  // additions ago. `cache_times` must start out zeroed, and `timestamp` must
+  // start at `VERTEX_CACHE_SIZE + 1`. Returns whether the vertex missed.
+  static bool touch_vertex(u32 *cache_times, u32 *timestamp, u32 idx_vertex) {
+    if (*timestamp - cache_times[idx_vertex] > VERTEX_CACHE_SIZE) {
+      cache_times[idx_vertex] = (*timestamp)++;
+      return true;
+    }
+    return false;
+  }
+}
+
+
+u32 meshopt::deduplicate_vertices(
+  u32 *indices, u32 n_indices, void *vertices, u32 n_vertices, size_t vertex_size
+) {
+  // Open-addressed hash table from vertex contents to the vertex's new index.
+  // Unique vertices get compacted towards the front of the array as we go,
+  // which never overwrites a vertex we haven't looked at yet.
+  u32 table_size = 16;
+  while (table_size < n_vertices * 2) {
+    table_size *= 2;
+  }
+  u32 const table_mask = table_size - 1;
+
+  MemoryPool temp_memory_pool = {.size = sizeof(u32) * (table_size + n_vertices)};
+  defer { memory::destroy_memory_pool(&temp_memory_pool); };
+  u32 *table = (u32*)memory::push(&temp_memory_pool, sizeof(u32) * table_size, "dedupe_table");
+  u32 *remap = (u32*)memory::push(&temp_memory_pool, sizeof(u32) * n_vertices, "dedupe_remap");
+  memset(table, 0xFF, sizeof(u32) * table_size);
+
+  u8 *vertex_bytes = (u8*)vertices;
+  u32 n_unique_vertices = 0;
+  range (0, n_vertices) {
+    u8 const *vertex = vertex_bytes + idx * vertex_size;
+    u32 slot = (u32)util::hash_fnv1a(vertex, vertex_size, util::FNV_OFFSET_BASIS) & table_mask;
+    while (
+      table[slot] != NO_VERTEX &&
+      memcmp(vertex_bytes + table[slot] * vertex_size, vertex, vertex_size) != 0
+    ) {
+      slot = (slot + 1) & table_mask;
+    }
+
+    if (table[slot] == NO_VERTEX) {
+      if (n_unique_vertices != idx) {
+        memcpy(vertex_bytes + n_unique_vertices * vertex_size, vertex, vertex_size);
+      }
+      table[slot] = n_unique_vertices++;
+    }
+    remap[idx] = table[slot];
+  }
+
+  range (0, n_indices) {
+    indices[idx] = remap[indices[idx]];
+  }
+
+  return n_unique_vertices;
+}
+
+
+void meshopt::optimize_vertex_cache(u32 *dest_indices, u32 const *indices, u32 n_indices, u32 n_vertices) {
+  // This is Tipsify, from Sander, Nehab and Barczak, "Fast Triangle
+  // Reordering for Vertex Locality and Reduced Overdraw" (2007). We fan out
+  // around one vertex at a time, emitting all its remaining triangles, then
+  // move on to a neighbouring vertex that is still likely to be in the cache.
+  assert(n_indices % 3 == 0);
+  assert(dest_indices != indices);
+  if (n_indices == 0 || n_vertices == 0) {
+    return;
+  }
+  u32 const n_triangles = n_indices / 3;
+
+  MemoryPool temp_memory_pool = {
+    .size = sizeof(u32) * ((n_vertices + 1) + (n_vertices * 2) + (n_indices * 3)) + n_triangles,
+  };
+  defer { memory::destroy_memory_pool(&temp_memory_pool); };
+  u32 *adjacency_offsets = (u32*)memory::push(&temp_memory_pool, sizeof(u32) * (n_vertices + 1), "adjacency_offsets");
+  u32 *live_counts = (u32*)memory::push(&temp_memory_pool, sizeof(u32) * n_vertices, "live_counts");
+  u32 *cache_times = (u32*)memory::push(&temp_memory_pool, sizeof(u32) * n_vertices, "cache_times");
+  u32 *adjacency = (u32*)memory::push(&temp_memory_pool, sizeof(u32) * n_indices, "adjacency");
+  u32 *dead_ends = (u32*)memory::push(&temp_memory_pool, sizeof(u32) * n_indices, "dead_ends");
+  u32 *candidates = (u32*)memory::push(&temp_memory_pool, sizeof(u32) * n_indices, "candidates");
+  u8 *is_emitted = (u8*)memory::push(&temp_memory_pool, n_triangles, "is_emitted");
+
+  // Build vertex-to-triangle adjacency. We borrow `cache_times` as a fill
+  // cursor for each vertex while we do this.
+  range (0, n_indices) {
+    live_counts[indices[idx]]++;
+  }
+  adjacency_offsets[0] = 0;
+  range (0, n_vertices) {
+    adjacency_offsets[idx + 1] = adjacency_offsets[idx] + live_counts[idx];
+  }
+  range (0, n_indices) {
+    u32 const idx_vertex = indices[idx];
+    adjacency[adjacency_offsets[idx_vertex] + cache_times[idx_vertex]++] = idx / 3;
+  }
+  memset(cache_times, 0, sizeof(u32) * n_vertices);
+
+  u32 timestamp = VERTEX_CACHE_SIZE + 1;
+  u32 n_dead_ends = 0;
+  u32 idx_next_unvisited = 0;
+  u32 n_dest_indices = 0;
+  u32 fan_vertex = indices[0];
+
+  while (fan_vertex != NO_VERTEX) {
+    // Emit all remaining triangles around the fanning vertex
+    u32 n_candidates = 0;
+    range_named (idx_adjacency, adjacency_offsets[fan_vertex], adjacency_offsets[fan_vertex + 1]) {
+      u32 const idx_triangle = adjacency[idx_adjacency];
+      if (is_emitted[idx_triangle]) {
+        continue;
+      }
+      range_named (idx_corner, 0, 3) {
+        u32 const idx_vertex = indices[idx_triangle * 3 + idx_corner];
+        dest_indices[n_dest_indices++] = idx_vertex;
+        dead_ends[n_dead_ends++] = idx_vertex;
+        candidates[n_candidates++] = idx_vertex;
+        live_counts[idx_vertex]--;
+        touch_vertex(cache_times, &timestamp, idx_vertex);
+      }
+      is_emitted[idx_triangle] = true;
+    }
+
+    // Pick the next fanning vertex from the vertices we just touched. We
+    // prefer the oldest vertex that will still be in the cache after we fan
+    // around it, since that uses the cache the most before it expires.
+    u32 next_vertex = NO_VERTEX;
+    i64 best_priority = -1;
+    range (0, n_candidates) {
+      u32 const idx_vertex = candidates[idx];
+      if (live_counts[idx_vertex] == 0) {
+        continue;
+      }
+      i64 priority = 0;
+      i64 const age = (i64)timestamp - (i64)cache_times[idx_vertex];
+      if (age + 2 * (i64)live_counts[idx_vertex] <= (i64)VERTEX_CACHE_SIZE) {
+        priority = age;
+      }
+      if (priority > best_priority) {
+        best_priority = priority;
+        next_vertex = idx_vertex;
+      }
+    }
+
+    // If we've hit a dead end, first try recently used vertices, then just
+    // take the next vertex with triangles left
+    while (next_vertex == NO_VERTEX && n_dead_ends > 0) {
+      u32 const idx_vertex = dead_ends[--n_dead_ends];
+      if (live_counts[idx_vertex] > 0) {
+        next_vertex = idx_vertex;
+      }
+    }
+    while (next_vertex == NO_VERTEX && idx_next_unvisited < n_vertices) {
+      if (live_counts[idx_next_unvisited] > 0) {
+        next_vertex = idx_next_unvisited;
+      }
+      idx_next_unvisited++;
+    }
+
+    fan_vertex = next_vertex;
+  }
+
+  assert(n_dest_indices == n_indices);
+}
+
+
+void meshopt::optimize_overdraw(
+  u32 *dest_indices, u32 const *indices, u32 n_indices,
+  void const *vertices, u32 n_vertices, size_t vertex_size, size_t position_offset
+) {
+  // Following the second half of Tipsify, we cut the cache-optimised triangle
+  // order into clusters wherever the cache would have been flushed anyway,
+  // which happens when a triangle misses on all three of its vertices. We then
+  // draw clusters that face outwards from the middle of the mesh first, since
+  // they are the ones most likely to occlude the rest of the mesh. This keeps
+  // the cache locality within each cluster.
+  assert(n_indices % 3 == 0);
+  assert(dest_indices != indices);
+  if (n_indices == 0) {
+    return;
+  }
+  u32 const n_triangles = n_indices / 3;
+
+  MemoryPool temp_memory_pool = {
+    .size = sizeof(u32) * (n_vertices + n_triangles + 1) + sizeof(ClusterSortItem) * n_triangles,
+  };
+  defer { memory::destroy_memory_pool(&temp_memory_pool); };
+  u32 *cache_times = (u32*)memory::push(&temp_memory_pool, sizeof(u32) * n_vertices, "cache_times");
+  u32 *cluster_starts = (u32*)memory::push(&temp_memory_pool, sizeof(u32) * (n_triangles + 1), "cluster_starts");
+  ClusterSortItem *clusters = (ClusterSortItem*)memory::push(&temp_memory_pool,
+    sizeof(ClusterSortItem) * n_triangles, "clusters");
+
+  // Find cluster boundaries
+  u32 n_clusters = 0;
+  u32 timestamp = VERTEX_CACHE_SIZE + 1;
+  range_named (idx_triangle, 0, n_triangles) {
+    u32 n_misses = 0;
+    range_named (idx_corner, 0, 3) {
+      if (touch_vertex(cache_times, &timestamp, indices[idx_triangle * 3 + idx_corner])) {
+        n_misses++;
+      }
+    }
+    if (idx_triangle == 0 || n_misses == 3) {
+      cluster_starts[n_clusters++] = idx_triangle;
+    }
+  }
+  cluster_starts[n_clusters] = n_triangles;
+
+  // Find the area-weighted centroid of the whole mesh
+  v3 mesh_centroid = v3(0.0f);
+  f32 mesh_area = 0.0f;
+  range_named (idx_triangle, 0, n_triangles) {
+    v3 const p0 = get_position(vertices, vertex_size, position_offset, indices[idx_triangle * 3 + 0]);
+    v3 const p1 = get_position(vertices, vertex_size, position_offset, indices[idx_triangle * 3 + 1]);
+    v3 const p2 = get_position(vertices, vertex_size, position_offset, indices[idx_triangle * 3 + 2]);
+    f32 const area = length(cross(p1 - p0, p2 - p0));
+    mesh_centroid += (p0 + p1 + p2) * (area / 3.0f);
+    mesh_area += area;
+  }
+  if (mesh_area > 0.0f) {
+    mesh_centroid /= mesh_area;
+  }
+
+  // Score each cluster by how much it faces away from the mesh's centroid
+  range_named (idx_cluster, 0, n_clusters) {
+    v3 cluster_centroid = v3(0.0f);
+    v3 cluster_normal = v3(0.0f);
+    f32 cluster_area = 0.0f;
+    range_named (idx_triangle, cluster_starts[idx_cluster], cluster_starts[idx_cluster + 1]) {
+      v3 const p0 = get_position(vertices, vertex_size, position_offset, indices[idx_triangle * 3 + 0]);
+      v3 const p1 = get_position(vertices, vertex_size, position_offset, indices[idx_triangle * 3 + 1]);
+      v3 const p2 = get_position(vertices, vertex_size, position_offset, indices[idx_triangle * 3 + 2]);
+      // The length of this cross product is twice the triangle's area, so
+      // summing these gives us an area-weighted normal
+      v3 const weighted_normal = cross(p1 - p0, p2 - p0);
+      f32 const area = length(weighted_normal);
+      cluster_centroid += (p0 + p1 + p2) * (area / 3.0f);
+      cluster_normal += weighted_normal;
+      cluster_area += area;
+    }
+
+    f32 sort_metric = 0.0f;
+    f32 const normal_length = length(cluster_normal);
+    if (cluster_area > 0.0f && normal_length > 0.0f) {
+      sort_metric = dot(cluster_centroid / cluster_area - mesh_centroid, cluster_normal / normal_length);
+    }
+    clusters[idx_cluster] = {
+      .sort_metric = sort_metric,
+      .idx_cluster = idx_cluster,
+    };
+  }
+
+  qsort(clusters, n_clusters, sizeof(ClusterSortItem), compare_clusters);
+
+  u32 n_dest_indices = 0;
+  range (0, n_clusters) {
+    u32 const idx_cluster = clusters[idx].idx_cluster;
+    u32 const idx_first_index = cluster_starts[idx_cluster] * 3;
+    u32 const n_cluster_indices = cluster_starts[idx_cluster + 1] * 3 - idx_first_index;
+    memcpy(&dest_indices[n_dest_indices], &indices[idx_first_index], sizeof(u32) * n_cluster_indices);
+    n_dest_indices += n_cluster_indices;
+  }
+
+  assert(n_dest_indices == n_indices);
+}
+
+
+u32 meshopt::optimize_vertex_fetch(
+  void *dest_vertices, u32 *indices, u32 n_indices, void const *vertices, u32 n_vertices, size_t vertex_size
+) {
+  // Lay vertices out in the order that the index buffer first uses them, so
+  // that vertex fetch walks through memory mostly linearly. Vertices that no
+  // index refers to get dropped.
+  assert(dest_vertices != vertices);
+
+  MemoryPool temp_memory_pool = {.size = sizeof(u32) * n_vertices};
+  defer { memory::destroy_memory_pool(&temp_memory_pool); };
+  u32 *remap = (u32*)memory::push(&temp_memory_pool, sizeof(u32) * n_vertices, "fetch_remap");
+  memset(remap, 0xFF, sizeof(u32) * n_vertices);
+
+  u32 n_dest_vertices = 0;
+  range (0, n_indices) {
+    u32 const idx_vertex = indices[idx];
+    if (remap[idx_vertex] == NO_VERTEX) {
+      memcpy((u8*)dest_vertices + n_dest_vertices * vertex_size,
+        (u8 const*)vertices + idx_vertex * vertex_size,
+        vertex_size);
+      remap[idx_vertex] = n_dest_vertices++;
+    }
+    indices[idx] = remap[idx_vertex];
+  }
+
+  return n_dest_vertices;
+}
+
+
+meshopt::VertexCacheStats meshopt::analyze_vertex_cache(u32 const *indices, u32 n_indices, u32 n_vertices) {
+  VertexCacheStats stats = {};
+  if (n_indices == 0 || n_vertices == 0) {
+    return stats;
+  }
+
+  MemoryPool temp_memory_pool = {.size = sizeof(u32) * n_vertices};
+  defer { memory::destroy_memory_pool(&temp_memory_pool); };
+  u32 *cache_times = (u32*)memory::push(&temp_memory_pool, sizeof(u32) * n_vertices, "cache_times");
+
+  // Timestamps start above zero, so a zero time means we've never seen the
+  // vertex before
+  u32 n_unique_vertices = 0;
+  u32 timestamp = VERTEX_CACHE_SIZE + 1;
+  range (0, n_indices) {
+    u32 const idx_vertex = indices[idx];
+    if (cache_times[idx_vertex] == 0) {
+      n_unique_vertices++;
+    }
+    if (touch_vertex(cache_times, &timestamp, idx_vertex)) {
+      stats.n_cache_misses++;
+    }
+  }
+
+  stats.acmr = (f32)stats.n_cache_misses / (f32)(n_indices / 3);
+  stats.atvr = (f32)stats.n_cache_misses / (f32)n_unique_vertices;
+  return stats;
+}
@@ -0,0 +1,33 @@
+#pragma once
+
+#include "types.hpp"
+
+// Offline-style mesh optimisations that we run when a mesh is loaded, before
+// it gets uploaded to the GPU. All of these operate on triangle lists.
+namespace meshopt {
+  // The size of the post-transform cache we optimise for and simulate. Real
+  // GPUs don't really have a FIFO cache like this anymore, but optimising for
+  // a small one still gives us good locality in practice.
+  static constexpr u32 VERTEX_CACHE_SIZE = 16;
+
+  struct VertexCacheStats {
+    u32 n_cache_misses;
+    // Average cache miss ratio: transformed vertices per triangle, from 0.5 at
+    // best to 3.0 at worst
+    f32 acmr;
+    // Average transform to vertex ratio: transformed vertices per unique
+    // vertex, where 1.0 is perfect
+    f32 atvr;
+  };
+
+  u32 deduplicate_vertices(u32 *indices, u32 n_indices, void *vertices, u32 n_vertices, size_t vertex_size);
+  void optimize_vertex_cache(u32 *dest_indices, u32 const *indices, u32 n_indices, u32 n_vertices);
+  void optimize_overdraw(
+    u32 *dest_indices, u32 const *indices, u32 n_indices,
+    void const *vertices, u32 n_vertices, size_t vertex_size, size_t position_offset
+  );
+  u32 optimize_vertex_fetch(
+    void *dest_vertices, u32 *indices, u32 n_indices, void const *vertices, u32 n_vertices, size_t vertex_size
+  );
+  VertexCacheStats analyze_vertex_cache(u32 const *indices, u32 n_indices, u32 n_vertices);
+}
@@ -0,0 +1,168 @@
+#include <string.h>
+#include "../src_external/pstr.h"
+#include "logs.hpp"
+#include "intrinsics.hpp"
+#include "ktx.hpp"
+#include "pack.hpp"
+
+
+namespace pack {
+  static bool is_range_in_pack(Pack const *pack, u64 offset, u64 size) {
+    return offset <= pack->view.size && size <= pack->view.size - offset;
+  }
+}
+
+
+void pack::get_entry_name(char *name, size_t name_size, char const *path) {
+  // An entry's name is its file name without the directory or the last
+  // extension, so "bin/shaders/geometry.vert.spv" becomes "geometry.vert"
+  char const *file_name = path;
+  for (char const *c = path; *c; c++) {
+    if (*c == '/' || *c == '\\') {
+      file_name = c + 1;
+    }
+  }
+  pstr_copy(name, name_size, file_name);
+  char *last_dot = strrchr(name, '.');
+  if (last_dot && last_dot != name) {
+    *last_dot = '\0';
+  }
+}
+
+
+bool pack::open_pack(Pack *pack, char const *path) {
+  *pack = {};
+  if (!files::map_file(&pack->view, path)) {
+    logs::info("No asset pack at %s, loading assets from loose files", path);
+    return false;
+  }
+
+  Header header;
+  if (pack->view.size < sizeof(Header)) {
+    logs::error("Asset pack %s is too small to contain a header", path);
+    close_pack(pack);
+    return false;
+  }
+  memcpy(&header, pack->view.data, sizeof(header));
+  if (header.magic != MAGIC || header.version != VERSION) {
+    logs::error("Asset pack %s has the wrong magic or version (%d)", path, header.version);
+    close_pack(pack);
+    return false;
+  }
+  if (
+    header.toc_offset % alignof(TocEntry) != 0 ||
+    !is_range_in_pack(pack, header.toc_offset, (u64)sizeof(TocEntry) * header.n_entries)
+  ) {
+    logs::error("Asset pack %s has an invalid table of contents", path);
+    close_pack(pack);
+    return false;
+  }
+
+  pack->toc = (TocEntry const*)(pack->view.data + header.toc_offset);
+  pack->n_entries = header.n_entries;
+  logs::info("Opened asset pack %s with %d entries", path, pack->n_entries);
+  return true;
+}
+
+
+void pack::close_pack(Pack *pack) {
+  files::unmap_file(&pack->view);
+  *pack = {};
+}
+
+
+bool pack::is_pack_open(Pack const *pack) {
+  return pack->view.data != nullptr && pack->toc != nullptr;
+}
+
+
+pack::TocEntry const* pack::find_entry(Pack const *pack, char const *name, EntryType type) {
+  if (!is_pack_open(pack)) {
+    return nullptr;
+  }
+  range (0, pack->n_entries) {
+    TocEntry const *entry = &pack->toc[idx];
+    if (
+      entry->type == type &&
+      strncmp(entry->name, name, MAX_ENTRY_NAME_LENGTH) == 0 &&
+      is_range_in_pack(pack, entry->offset, entry->size)
+    ) {
+      return entry;
+    }
+  }
+  return nullptr;
+}
+
+
+bool pack::get_texture(Pack const *pack, char const *name, Texture *texture) {
+  TocEntry const *entry = find_entry(pack, name, EntryType::texture);
+  if (!entry || entry->size < sizeof(TextureHeader)) {
+    return false;
+  }
+  u8 const *entry_data = pack->view.data + entry->offset;
+  TextureHeader const *header = (TextureHeader const*)entry_data;
+  if (header->n_mip_levels == 0 || header->n_mip_levels > MAX_N_TEXTURE_LEVELS) {
+    return false;
+  }
+
+  *texture = {
+    .vk_format    = header->vk_format,
+    .width        = header->width,
+    .height       = header->height,
+    .n_mip_levels = header->n_mip_levels,
+  };
+  range (0, header->n_mip_levels) {
+    if (
+      header->level_offsets[idx] > entry->size ||
+      header->level_sizes[idx] > entry->size - header->level_offsets[idx]
+    ) {
+      return false;
+    }
+    texture->level_data[idx] = entry_data + header->level_offsets[idx];
+    texture->level_sizes[idx] = header->level_sizes[idx];
+  }
+  if (!ktx::are_levels_valid(
+    (VkFormat)texture->vk_format, texture->width, texture->height, texture->n_mip_levels, texture->level_sizes
+  )) {
+    logs::error("Asset pack texture %s has levels that don't match its format and size", name);
+    return false;
+  }
+  return true;
+}
+
+
+bool pack::get_mesh(Pack const *pack, char const *name, Mesh *mesh) {
+  TocEntry const *entry = find_entry(pack, name, EntryType::mesh);
+  if (!entry || entry->size < sizeof(MeshHeader)) {
+    return false;
+  }
+  u8 const *entry_data = pack->view.data + entry->offset;
+  MeshHeader const *header = (MeshHeader const*)entry_data;
+  u64 const vertices_size = (u64)sizeof(MeshVertex) * header->n_vertices;
+  u64 const indices_size = (u64)sizeof(u32) * header->n_indices;
+  if (
+    header->vertices_offset > entry->size || vertices_size > entry->size - header->vertices_offset ||
+    header->indices_offset > entry->size || indices_size > entry->size - header->indices_offset
+  ) {
+    return false;
+  }
+
+  *mesh = {
+    .vertices   = (MeshVertex const*)(entry_data + header->vertices_offset),
+    .n_vertices = header->n_vertices,
+    .indices    = (u32 const*)(entry_data + header->indices_offset),
+    .n_indices  = header->n_indices,
+  };
+  return true;
+}
+
+
+bool pack::get_shader(Pack const *pack, char const *name, u8 const **shader, size_t *shader_size) {
+  TocEntry const *entry = find_entry(pack, name, EntryType::shader);
+  if (!entry) {
+    return false;
+  }
+  *shader = pack->view.data + entry->offset;
+  *shader_size = (size_t)entry->size;
+  return true;
+}
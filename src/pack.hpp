@@ -0,0 +1,94 @@
+#pragma once
+
+#include "types.hpp"
+#include "files.hpp"
+
+// Asset packs bundle cooked assets into a single file that we map into memory
+// and read from directly. They are built offline by `peony_cooker`.
+//
+// The layout is:
+//   [Header] [entry data, each entry 16-byte aligned] [TocEntry * n_entries]
+// All offsets are in bytes. Entry offsets are from the start of the file, and
+// offsets inside an entry are from the start of that entry.
+namespace pack {
+  static constexpr u32 MAGIC                 = 0x50594E50; // "PNYP"
+  static constexpr u32 VERSION               = 1;
+  static constexpr u32 ENTRY_ALIGNMENT       = 16;
+  static constexpr u32 MAX_ENTRY_NAME_LENGTH = 64;
+  static constexpr u32 MAX_N_TEXTURE_LEVELS  = 16;
+
+  enum class EntryType : u32 { texture, mesh, shader };
+
+  struct Header {
+    u32 magic;
+    u32 version;
+    u32 n_entries;
+    u32 padding;
+    u64 toc_offset;
+  };
+
+  struct TocEntry {
+    char name[MAX_ENTRY_NAME_LENGTH];
+    EntryType type;
+    u32 padding;
+    u64 offset;
+    u64 size;
+  };
+
+  // Followed by the level data. Levels are already in the layout the GPU
+  // wants, so they can be copied straight into a staging buffer.
+  struct TextureHeader {
+    u32 vk_format;
+    u32 width;
+    u32 height;
+    u32 n_mip_levels;
+    u64 level_offsets[MAX_N_TEXTURE_LEVELS];
+    u64 level_sizes[MAX_N_TEXTURE_LEVELS];
+  };
+
+  // Has the same layout as the engine's `Vertex`
+  struct MeshVertex {
+    f32 position[3];
+    f32 normal[3];
+    f32 tex_coords[2];
+  };
+
+  // Followed by `MeshVertex * n_vertices` and `u32 * n_indices`
+  struct MeshHeader {
+    u32 n_vertices;
+    u32 n_indices;
+    u64 vertices_offset;
+    u64 indices_offset;
+  };
+
+  struct Texture {
+    u32 vk_format;
+    u32 width;
+    u32 height;
+    u32 n_mip_levels;
+    u8 const *level_data[MAX_N_TEXTURE_LEVELS];
+    u64 level_sizes[MAX_N_TEXTURE_LEVELS];
+  };
+
+  struct Mesh {
+    MeshVertex const *vertices;
+    u32 n_vertices;
+    u32 const *indices;
+    u32 n_indices;
+  };
+
+  struct Pack {
+    files::FileView view;
+    TocEntry const *toc;
+    u32 n_entries;
+  };
+
+  void get_entry_name(char *name, size_t name_size, char const *path);
+  bool open_pack(Pack *pack, char const *path);
+  void close_pack(Pack *pack);
+  bool is_pack_open(Pack const *pack);
+  TocEntry const* find_entry(Pack const *pack, char const *name, EntryType type);
+  bool get_texture(Pack const *pack, char const *name, Texture *texture);
+  bool get_mesh(Pack const *pack, char const *name, Mesh *mesh);
+  bool get_shader(Pack const *pack, char const *name, u8 const **shader, size_t *shader_size);
+}
@@ -0,0 +1,177 @@
+#include <new>
+#include "logs.hpp"
+#include "intrinsics.hpp"
+#include "tasks.hpp"
+
+
+namespace tasks {
+  // Must be called with the pool's mutex held
+  static bool pop_task(WorkerPool *pool, Task *task) {
+    if (pool->n_queued_tasks == 0) {
+      return false;
+    }
+    *task = pool->queue[pool->idx_queue_head];
+    pool->idx_queue_head = (pool->idx_queue_head + 1) % MAX_N_QUEUED_TASKS;
+    pool->n_queued_tasks--;
+    return true;
+  }
+
+
+  // Must be called with the pool's mutex held. Takes the oldest queued task
+  // that's in `group`, wherever it is in the queue, so that we can help with
+  // our own tasks without getting stuck behind some long task that isn't ours.
+  // Everything queued after it moves up to close the gap, so the other tasks
+  // keep their order.
+  static bool pop_group_task(WorkerPool *pool, TaskGroup *group, Task *task) {
+    range_named (idx_task, 0, pool->n_queued_tasks) {
+      u32 const idx_found = (pool->idx_queue_head + idx_task) % MAX_N_QUEUED_TASKS;
+      if (pool->queue[idx_found].group != group) {
+        continue;
+      }
+      *task = pool->queue[idx_found];
+      range_named (idx_later, idx_task + 1, pool->n_queued_tasks) {
+        u32 const idx_src = (pool->idx_queue_head + idx_later) % MAX_N_QUEUED_TASKS;
+        u32 const idx_dest = (idx_src + MAX_N_QUEUED_TASKS - 1) % MAX_N_QUEUED_TASKS;
+        pool->queue[idx_dest] = pool->queue[idx_src];
+      }
+      pool->n_queued_tasks--;
+      return true;
+    }
+    return false;
+  }
+
+
+  static void finish_task(WorkerPool *pool, TaskGroup *group) {
+    std::lock_guard<std::mutex> lock(pool->mutex);
+    pool->n_unfinished_tasks--;
+    bool is_anything_finished = pool->n_unfinished_tasks == 0;
+    if (group) {
+      group->n_unfinished_tasks--;
+      is_anything_finished = is_anything_finished || group->n_unfinished_tasks == 0;
+    }
+    if (is_anything_finished) {
+      pool->tasks_finished.notify_all();
+    }
+  }
+
+
+  static void queue_task(WorkerPool *pool, TaskGroup *group, TaskFunction function, void *data) {
+    {
+      std::lock_guard<std::mutex> lock(pool->mutex);
+      if (pool->n_queued_tasks < MAX_N_QUEUED_TASKS) {
+        u32 const idx_tail = (pool->idx_queue_head + pool->n_queued_tasks) % MAX_N_QUEUED_TASKS;
+        pool->queue[idx_tail] = {.function = function, .data = data, .group = group};
+        pool->n_queued_tasks++;
+        pool->n_unfinished_tasks++;
+        if (group) {
+          group->n_unfinished_tasks++;
+        }
+        pool->task_available.notify_one();
+        return;
+      }
+    }
+    // If the queue is full, the workers are busy anyway, so we might as well
+    // just do the work ourselves
+    function(data);
+  }
+
+
+  static void run_worker(WorkerPool *pool) {
+    while (true) {
+      Task task;
+      {
+        std::unique_lock<std::mutex> lock(pool->mutex);
+        pool->task_available.wait(lock, [pool] { return pool->should_stop || pool->n_queued_tasks > 0; });
+        if (!pop_task(pool, &task)) {
+          // We only get here when we're stopping and there's nothing left to do
+          return;
+        }
+      }
+      task.function(task.data);
+      finish_task(pool, task.group);
+    }
+  }
+}
+
+
+u32 tasks::get_default_n_workers() {
+  // Leave a core for the main thread, which also runs tasks while it waits
+  u32 const n_cores = std::thread::hardware_concurrency();
+  if (n_cores <= 1) {
+    return 1;
+  }
+  return min(n_cores - 1, MAX_N_WORKERS);
+}
+
+
+void tasks::init_worker_pool(WorkerPool *pool, u32 n_workers) {
+  assert(n_workers > 0 && n_workers <= MAX_N_WORKERS);
+  // The pool usually lives in zeroed memory rather than being constructed, so
+  // construct it in place to properly set up its threads and locks
+  new (pool) WorkerPool();
+  pool->n_workers = n_workers;
+  range (0, n_workers) {
+    pool->workers[idx] = std::thread(run_worker, pool);
+  }
+  logs::info("Started %d worker threads", n_workers);
+}
+
+
+void tasks::push_task(WorkerPool *pool, TaskFunction function, void *data) {
+  queue_task(pool, nullptr, function, data);
+}
+
+
+void tasks::push_group_task(WorkerPool *pool, TaskGroup *group, TaskFunction function, void *data) {
+  queue_task(pool, group, function, data);
+}
+
+
+void tasks::wait_for_tasks(WorkerPool *pool) {
+  // Rather than sleeping while the workers do everything, help them out
+  while (true) {
+    Task task;
+    {
+      std::lock_guard<std::mutex> lock(pool->mutex);
+      if (!pop_task(pool, &task)) {
+        break;
+      }
+    }
+    task.function(task.data);
+    finish_task(pool, task.group);
+  }
+
+  std::unique_lock<std::mutex> lock(pool->mutex);
+  pool->tasks_finished.wait(lock, [pool] { return pool->n_unfinished_tasks == 0; });
+}
+
+
+void tasks::wait_for_group(WorkerPool *pool, TaskGroup *group) {
+  while (true) {
+    Task task;
+    {
+      std::lock_guard<std::mutex> lock(pool->mutex);
+      if (!pop_group_task(pool, group, &task)) {
+        break;
+      }
+    }
+    task.function(task.data);
+    finish_task(pool, task.group);
+  }
+
+  std::unique_lock<std::mutex> lock(pool->mutex);
+  pool->tasks_finished.wait(lock, [group] { return group->n_unfinished_tasks == 0; });
+}
+
+
+void tasks::destroy_worker_pool(WorkerPool *pool) {
+  {
+    std::lock_guard<std::mutex> lock(pool->mutex);
+    pool->should_stop = true;
+  }
+  pool->task_available.notify_all();
+  range (0, pool->n_workers) {
+    pool->workers[idx].join();
+  }
+  pool->~WorkerPool();
+}
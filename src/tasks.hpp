@@ -0,0 +1,52 @@
+#pragma once
+
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include "types.hpp"
+
+// A fixed set of worker threads that run tasks pushed from the main thread.
+// Tasks are plain function pointers with a pointer to their data, and whoever
+// pushes them is responsible for keeping that data alive until they've run.
+namespace tasks {
+  static constexpr u32 MAX_N_WORKERS      = 32;
+  static constexpr u32 MAX_N_QUEUED_TASKS = 1024;
+
+  typedef void (*TaskFunction)(void *data);
+
+  // Tasks we want to wait for without also waiting for everything else on the
+  // pool, like shader compiles or file reads, see `wait_for_group()`
+  struct TaskGroup {
+    u32 n_unfinished_tasks;
+  };
+
+  struct Task {
+    TaskFunction function;
+    void *data;
+    // Can be null
+    TaskGroup *group;
+  };
+
+  struct WorkerPool {
+    std::thread workers[MAX_N_WORKERS];
+    u32 n_workers;
+    std::mutex mutex;
+    std::condition_variable task_available;
+    std::condition_variable tasks_finished;
+    // A ring buffer of tasks that haven't been picked up yet
+    Task queue[MAX_N_QUEUED_TASKS];
+    u32 idx_queue_head;
+    u32 n_queued_tasks;
+    // Tasks that have been pushed but haven't finished running
+    u32 n_unfinished_tasks;
+    bool should_stop;
+  };
+
+  u32 get_default_n_workers();
+  void init_worker_pool(WorkerPool *pool, u32 n_workers);
+  void push_task(WorkerPool *pool, TaskFunction function, void *data);
+  void push_group_task(WorkerPool *pool, TaskGroup *group, TaskFunction function, void *data);
+  void wait_for_tasks(WorkerPool *pool);
+  void wait_for_group(WorkerPool *pool, TaskGroup *group);
+  void destroy_worker_pool(WorkerPool *pool);
+}
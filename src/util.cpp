@@ -52,3 +52,15 @@ real32 util::b_to_kb(uint32 value) { return value / 1024.0f; }
 real32 util::b_to_mb(uint32 value) { return b_to_kb(value) / 1024.0f; }
 real32 util::b_to_gb(uint32 value) { return b_to_mb(value) / 1024.0f; }
 real32 util::b_to_tb(uint32 value) { return b_to_gb(value) / 1024.0f; }
+
+
+// Pass `FNV_OFFSET_BASIS` as `hash` to start a new hash, or a previous result
+// to keep hashing more data into it.
+u64 util::hash_fnv1a(void const *data, size_t size, u64 hash) {
+  u8 const *bytes = (u8 const*)data;
+  for (size_t idx = 0; idx < size; idx++) {
+    hash ^= bytes[idx];
+    hash *= 1099511628211ull;
+  }
+  return hash;
+}
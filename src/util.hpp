@@ -12,6 +12,8 @@ namespace chrono = std::chrono;
 #include "types.hpp"
 
 namespace util {
+  constexpr u64 FNV_OFFSET_BASIS = 14695981039346656037ull;
+
   GLenum get_texture_format_from_n_components(int32 n_components);
   f64 random(f64 min, f64 max);
   v3 aiVector3D_to_glm(aiVector3D *vec);
@@ -32,4 +34,5 @@ namespace util {
   f32 b_to_mb(uint32 value);
   f32 b_to_gb(uint32 value);
   f32 b_to_tb(uint32 value);
+  u64 hash_fnv1a(void const *data, size_t size, u64 hash);
 }
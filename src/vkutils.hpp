@@ -11,6 +11,7 @@
 #include "vulkan.hpp"
 #include "files.hpp"
 #include "logs.hpp"
+#include "images.hpp"
 
 
 namespace vkutils {
@@ -97,7 +98,7 @@ namespace vkutils {
       .compareEnable           = VK_FALSE,
       .compareOp               = VK_COMPARE_OP_ALWAYS,
       .minLod                  = 0.0f,
-      .maxLod                  = 0.0f,
+      .maxLod                  = VK_LOD_CLAMP_NONE,
       .borderColor             = VK_BORDER_COLOR_INT_OPAQUE_BLACK,
       .unnormalizedCoordinates = VK_FALSE,
     };
@@ -187,11 +188,16 @@ namespace vkutils {
   }
 
 
-  VkPipelineLayoutCreateInfo pipeline_layout_create_info(u32 setLayoutCount, const VkDescriptorSetLayout* pSetLayouts) {
+  VkPipelineLayoutCreateInfo pipeline_layout_create_info(
+    u32 setLayoutCount, const VkDescriptorSetLayout* pSetLayouts,
+    u32 pushConstantRangeCount, const VkPushConstantRange* pPushConstantRanges
+  ) {
     return {
-      .sType          = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO,
-      .setLayoutCount = setLayoutCount,
-      .pSetLayouts    = pSetLayouts,
+      .sType                  = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO,
+      .setLayoutCount         = setLayoutCount,
+      .pSetLayouts            = pSetLayouts,
+      .pushConstantRangeCount = pushConstantRangeCount,
+      .pPushConstantRanges    = pPushConstantRanges,
     };
   }
 
@@ -408,6 +414,18 @@ namespace vkutils {
   }
 
 
+  // For pools whose buffers are short-lived, and which we only ever reset all
+  // at once, with `vkResetCommandPool()`
+  void create_transient_command_pool(VkDevice device, VkCommandPool *command_pool, u32 queueFamilyIndex) {
+    VkCommandPoolCreateInfo const pool_info = {
+      .sType            = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO,
+      .flags            = VK_COMMAND_POOL_CREATE_TRANSIENT_BIT,
+      .queueFamilyIndex = queueFamilyIndex,
+    };
+    check(vkCreateCommandPool(device, &pool_info, nullptr, command_pool));
+  }
+
+
   void create_command_buffer(VkDevice device, VkCommandBuffer *command_buffer, VkCommandPool command_pool) {
       auto const alloc_info = command_buffer_allocate_info(command_pool);
       vkutils::check(vkAllocateCommandBuffers(device, &alloc_info, command_buffer));
@@ -449,21 +467,6 @@ namespace vkutils {
   }
 
 
-  void end_command_buffer(VkDevice device, VkQueue queue, VkCommandPool command_pool, VkCommandBuffer command_buffer) {
-    vkEndCommandBuffer(command_buffer);
-
-    VkSubmitInfo const submit_info = {
-      .sType              = VK_STRUCTURE_TYPE_SUBMIT_INFO,
-      .commandBufferCount = 1,
-      .pCommandBuffers    = &command_buffer,
-    };
-    vkQueueSubmit(queue, 1, &submit_info, VK_NULL_HANDLE);
-
-    vkQueueWaitIdle(queue);
-    vkFreeCommandBuffers(device, command_pool, 1, &command_buffer);
-  }
-
-
   void create_buffer(
     VkDevice device,
     VkPhysicalDevice physical_device,
@@ -498,65 +501,35 @@ namespace vkutils {
   }
 
 
-  void copy_buffer(
-    VkDevice device,
-    VkCommandPool command_pool,
-    VkQueue queue,
-    VkBuffer src, VkBuffer dest, VkDeviceSize size
-  ) {
-    VkCommandBuffer command_buffer = begin_command_buffer(device, command_pool);
-    VkBufferCopy copy_region = {.size = size};
-    vkCmdCopyBuffer(command_buffer, src, dest, 1, &copy_region);
-    end_command_buffer(device, queue, command_pool, command_buffer);
-  }
-
-
-  void create_buffer_resources(
+  void record_buffer_range_upload(
     VkDevice device,
-    BufferResources *buffer_resources,
     VkPhysicalDevice physical_device,
+    VkCommandBuffer command_buffer,
+    VkBuffer dest,
+    VkDeviceSize dest_offset,
     void const *data,
-    u32 n_items,
     VkDeviceSize size,
-    VkBufferUsageFlags usage,
-    VkCommandPool command_pool,
-    VkQueue queue
+    VkBuffer *staging_buffer,
+    VkDeviceMemory *staging_buffer_memory
   ) {
-    buffer_resources->n_items = n_items;
-
-    VkBuffer staging_buffer;
-    VkDeviceMemory staging_buffer_memory;
-
+    // Copies `data` into a new staging buffer, and records copying it into
+    // `dest`. The caller destroys the staging buffer once the copy is done.
     vkutils::create_buffer(device,
       physical_device,
       size,
       VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
       VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
       VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
-      &staging_buffer,
-      &staging_buffer_memory);
+      staging_buffer,
+      staging_buffer_memory);
 
     void *memory;
-    vkMapMemory(device, staging_buffer_memory, 0, size, 0, &memory);
+    vkMapMemory(device, *staging_buffer_memory, 0, size, 0, &memory);
     memcpy(memory, data, (size_t)size);
-    vkUnmapMemory(device, staging_buffer_memory);
-
-    vkutils::create_buffer(device,
-      physical_device,
-      size,
-      VK_BUFFER_USAGE_TRANSFER_DST_BIT | usage,
-      VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
-      &buffer_resources->buffer,
-      &buffer_resources->memory);
-    vkutils::copy_buffer(device,
-      command_pool,
-      queue,
-      staging_buffer,
-      buffer_resources->buffer,
-      size);
+    vkUnmapMemory(device, *staging_buffer_memory);
 
-    vkDestroyBuffer(device, staging_buffer, nullptr);
-    vkFreeMemory(device, staging_buffer_memory, nullptr);
+    VkBufferCopy const copy_region = {.dstOffset = dest_offset, .size = size};
+    vkCmdCopyBuffer(command_buffer, *staging_buffer, dest, 1, &copy_region);
   }
 
 
@@ -572,6 +545,7 @@ namespace vkutils {
     VkImage *image,
     VkDeviceMemory *image_memory,
     u32 width, u32 height,
+    u32 n_mip_levels,
     VkFormat format,
     VkImageTiling tiling,
     VkImageUsageFlags usage,
@@ -587,7 +561,7 @@ namespace vkutils {
         .height              = height,
         .depth               = 1,
       },
-      .mipLevels             = 1,
+      .mipLevels             = n_mip_levels,
       .arrayLayers           = 1,
       .samples               = VK_SAMPLE_COUNT_1_BIT,
       .tiling                = tiling,
@@ -615,7 +589,8 @@ namespace vkutils {
     VkDevice device,
     VkImage image,
     VkFormat format,
-    VkImageAspectFlags aspect_flags
+    VkImageAspectFlags aspect_flags,
+    u32 n_mip_levels
   ) {
     VkImageViewCreateInfo const image_view_info = {
       .sType            = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO,
@@ -625,7 +600,7 @@ namespace vkutils {
       .subresourceRange = {
         .aspectMask     = aspect_flags,
         .baseMipLevel   = 0,
-        .levelCount     = 1,
+        .levelCount     = n_mip_levels,
         .baseArrayLayer = 0,
         .layerCount     = 1,
       },
@@ -636,21 +611,19 @@ namespace vkutils {
   }
 
 
-  void transition_image_layout(
-    VkDevice device,
-    VkQueue queue,
-    VkCommandPool command_pool,
+  VkImageMemoryBarrier image_memory_barrier(
     VkImage image,
-    VkFormat format,
     VkImageLayout old_layout,
-    VkImageLayout new_layout
+    VkImageLayout new_layout,
+    VkAccessFlags src_access_mask,
+    VkAccessFlags dst_access_mask,
+    u32 base_mip_level,
+    u32 n_mip_levels
   ) {
-    VkCommandBuffer command_buffer = begin_command_buffer(device, command_pool);
-
-    VkImageMemoryBarrier barrier = {
+    return {
       .sType               = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER,
-      .srcAccessMask       = 0, // Filled in later
-      .dstAccessMask       = 0, // Filled in later
+      .srcAccessMask       = src_access_mask,
+      .dstAccessMask       = dst_access_mask,
       .oldLayout           = old_layout,
       .newLayout           = new_layout,
       .srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
@@ -658,65 +631,12 @@ namespace vkutils {
       .image               = image,
       .subresourceRange = {
         .aspectMask        = VK_IMAGE_ASPECT_COLOR_BIT,
-        .baseMipLevel      = 0,
-        .levelCount        = 1,
+        .baseMipLevel      = base_mip_level,
+        .levelCount        = n_mip_levels,
         .baseArrayLayer    = 0,
         .layerCount        = 1,
       },
     };
-
-    VkPipelineStageFlags source_stage = {};
-    VkPipelineStageFlags destination_stage = {};
-
-    if (old_layout == VK_IMAGE_LAYOUT_UNDEFINED && new_layout == VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL) {
-      barrier.srcAccessMask = 0;
-      barrier.dstAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
-      source_stage          = VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT;
-      destination_stage     = VK_PIPELINE_STAGE_TRANSFER_BIT;
-
-    } else if (
-      old_layout == VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL &&
-      new_layout == VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL
-    ) {
-      barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
-      barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
-      source_stage          = VK_PIPELINE_STAGE_TRANSFER_BIT;
-      destination_stage     = VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT;
-    } else {
-      logs::fatal("Could not complete requested layout transition as it's unsupported.");
-    }
-
-    vkCmdPipelineBarrier(command_buffer, source_stage, destination_stage, 0, 0, nullptr, 0, nullptr, 1, &barrier);
-
-    end_command_buffer(device, queue, command_pool, command_buffer);
-  }
-
-
-  void copy_buffer_to_image(
-    VkDevice device,
-    VkQueue queue,
-    VkCommandPool command_pool,
-    VkBuffer buffer, VkImage image, u32 width, u32 height
-  ) {
-    VkCommandBuffer command_buffer = begin_command_buffer(device, command_pool);
-
-    VkBufferImageCopy region = {
-      .bufferOffset      = 0,
-      .bufferRowLength   = 0,
-      .bufferImageHeight = 0,
-      .imageSubresource = {
-        .aspectMask      = VK_IMAGE_ASPECT_COLOR_BIT,
-        .mipLevel        = 0,
-        .baseArrayLayer  = 0,
-        .layerCount      = 1,
-      },
-      .imageOffset       = {0, 0, 0},
-      .imageExtent       = {width, height, 1},
-    };
-
-    vkCmdCopyBufferToImage(command_buffer, buffer, image, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 1, &region);
-
-    end_command_buffer(device, queue, command_pool, command_buffer);
   }
 
 
@@ -725,6 +645,7 @@ namespace vkutils {
     ImageResources *image_resources,
     VkPhysicalDevice physical_device,
     u32 width, u32 height,
+    u32 n_mip_levels,
     VkFormat format,
     VkImageTiling tiling,
     VkImageUsageFlags usage,
@@ -732,8 +653,9 @@ namespace vkutils {
     VkImageAspectFlags aspect_flags
   ) {
     create_image(device, physical_device, &image_resources->image, &image_resources->memory,
-      width, height, format, tiling, usage, properties);
-    image_resources->view = create_image_view(device, image_resources->image, format, aspect_flags);
+      width, height, n_mip_levels, format, tiling, usage, properties);
+    image_resources->view = create_image_view(device, image_resources->image, format, aspect_flags, n_mip_levels);
+    image_resources->n_mip_levels = n_mip_levels;
   }
 
 
@@ -742,6 +664,7 @@ namespace vkutils {
     ImageResources *image_resources,
     VkPhysicalDevice physical_device,
     u32 width, u32 height,
+    u32 n_mip_levels,
     VkFormat format,
     VkImageTiling tiling,
     VkImageUsageFlags usage,
@@ -754,6 +677,7 @@ namespace vkutils {
       image_resources,
       physical_device,
       width, height,
+      n_mip_levels,
       format,
       tiling,
       usage,
@@ -765,57 +689,284 @@ namespace vkutils {
   }
 
 
-  void upload_image(
+  void stage_image_levels(
     VkDevice device,
-    ImageResources *image_resources,
     VkPhysicalDevice physical_device,
-    unsigned char *image,
+    u8 const * const *level_data,
+    VkDeviceSize const *level_sizes,
     u32 width, u32 height,
-    VkFormat format,
-    VkQueue queue,
-    VkCommandPool command_pool
+    u32 n_mip_levels,
+    VkBufferImageCopy *regions,
+    VkBuffer *staging_buffer,
+    VkDeviceMemory *staging_buffer_memory
   ) {
-    VkDeviceSize image_size = width * height * 4;
+    // Copies every mip level into a new staging buffer and fills in `regions`
+    // to copy them into an image whose top level is `width` x `height`. The
+    // data can be in any format, including block-compressed ones, since we
+    // just copy it. Offsets need to be a multiple of the texel block size,
+    // which 16 covers for every format we use.
+    assert(n_mip_levels <= MAX_N_MIP_LEVELS);
+    VkDeviceSize staging_size = 0;
+    range (0, n_mip_levels) {
+      staging_size = (staging_size + 15) & ~(VkDeviceSize)15;
+      regions[idx] = {
+        .bufferOffset      = staging_size,
+        .bufferRowLength   = 0,
+        .bufferImageHeight = 0,
+        .imageSubresource = {
+          .aspectMask      = VK_IMAGE_ASPECT_COLOR_BIT,
+          .mipLevel        = idx,
+          .baseArrayLayer  = 0,
+          .layerCount      = 1,
+        },
+        .imageOffset       = {0, 0, 0},
+        .imageExtent       = {images::get_mip_dimension(width, idx), images::get_mip_dimension(height, idx), 1},
+      };
+      staging_size += level_sizes[idx];
+    }
 
-    // Copy image to staging buffer
-    VkBuffer staging_buffer;
-    VkDeviceMemory staging_buffer_memory;
     create_buffer(device, physical_device,
-      image_size,
+      staging_size,
       VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
       VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
-      &staging_buffer,
-      &staging_buffer_memory);
-    void *memory;
-    vkMapMemory(device, staging_buffer_memory, 0, image_size, 0, &memory);
-    memcpy(memory, image, (size_t)image_size);
-    vkUnmapMemory(device, staging_buffer_memory);
-
-    // Copy image
-    transition_image_layout(device,
-      queue,
-      command_pool,
-      image_resources->image,
-      format,
-      VK_IMAGE_LAYOUT_UNDEFINED,
-      VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL);
-    copy_buffer_to_image(device,
-      queue,
-      command_pool,
       staging_buffer,
-      image_resources->image,
-      width,
-      height);
-    transition_image_layout(device,
-      queue,
-      command_pool,
-      image_resources->image,
-      format,
-      VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
-      VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL);
+      staging_buffer_memory);
+    void *memory;
+    vkMapMemory(device, *staging_buffer_memory, 0, staging_size, 0, &memory);
+    range (0, n_mip_levels) {
+      memcpy((u8*)memory + regions[idx].bufferOffset, level_data[idx], (size_t)level_sizes[idx]);
+    }
+    vkUnmapMemory(device, *staging_buffer_memory);
+  }
+
+
+  void record_image_levels_copy(
+    VkCommandBuffer command_buffer,
+    VkImage image,
+    VkBuffer staging_buffer,
+    VkBufferImageCopy const *regions,
+    u32 n_mip_levels,
+    u32 src_queue_family,
+    u32 dst_queue_family
+  ) {
+    // Fills every level of `image` from `staging_buffer`, leaving it ready to
+    // be sampled. If we're recording for a queue from `src_queue_family`, but
+    // want to sample the image on a queue from a different
+    // `dst_queue_family`, this releases the image to that family instead, and
+    // `record_image_ownership_acquire()` has to run there before we sample it.
+    VkImageMemoryBarrier const to_transfer_dst_barrier = image_memory_barrier(image,
+      VK_IMAGE_LAYOUT_UNDEFINED, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+      0, VK_ACCESS_TRANSFER_WRITE_BIT,
+      0, n_mip_levels);
+    vkCmdPipelineBarrier(command_buffer, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT, 0,
+      0, nullptr, 0, nullptr, 1, &to_transfer_dst_barrier);
+
+    vkCmdCopyBufferToImage(command_buffer, staging_buffer, image,
+      VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, n_mip_levels, regions);
+
+    if (src_queue_family == dst_queue_family) {
+      VkImageMemoryBarrier const to_shader_read_barrier = image_memory_barrier(image,
+        VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL,
+        VK_ACCESS_TRANSFER_WRITE_BIT, VK_ACCESS_SHADER_READ_BIT,
+        0, n_mip_levels);
+      vkCmdPipelineBarrier(command_buffer, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT, 0,
+        0, nullptr, 0, nullptr, 1, &to_shader_read_barrier);
+      return;
+    }
+
+    // The release half of the ownership transfer. A transfer queue might not
+    // know about shader stages, so the destination is left to the acquire.
+    // The layout transition happens once, between the two halves.
+    VkImageMemoryBarrier release_barrier = image_memory_barrier(image,
+      VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL,
+      VK_ACCESS_TRANSFER_WRITE_BIT, 0,
+      0, n_mip_levels);
+    release_barrier.srcQueueFamilyIndex = src_queue_family;
+    release_barrier.dstQueueFamilyIndex = dst_queue_family;
+    vkCmdPipelineBarrier(command_buffer, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, 0,
+      0, nullptr, 0, nullptr, 1, &release_barrier);
+  }
+
+
+  void record_image_ownership_acquire(
+    VkCommandBuffer command_buffer,
+    VkImage image,
+    u32 n_mip_levels,
+    u32 src_queue_family,
+    u32 dst_queue_family
+  ) {
+    // The acquire half of the ownership transfer that
+    // `record_image_levels_copy()` started, which has to match its release,
+    // and which we record for a queue from `dst_queue_family` once the
+    // release has finished
+    VkImageMemoryBarrier acquire_barrier = image_memory_barrier(image,
+      VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL,
+      0, VK_ACCESS_SHADER_READ_BIT,
+      0, n_mip_levels);
+    acquire_barrier.srcQueueFamilyIndex = src_queue_family;
+    acquire_barrier.dstQueueFamilyIndex = dst_queue_family;
+    vkCmdPipelineBarrier(command_buffer, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT, 0,
+      0, nullptr, 0, nullptr, 1, &acquire_barrier);
+  }
+
+
+  void record_image_levels_upload(
+    VkDevice device,
+    VkPhysicalDevice physical_device,
+    VkCommandBuffer command_buffer,
+    ImageResources *image_resources,
+    u8 const * const *level_data,
+    VkDeviceSize const *level_sizes,
+    u32 width, u32 height,
+    VkBuffer *staging_buffer,
+    VkDeviceMemory *staging_buffer_memory
+  ) {
+    // Records uploading every mip level of the image as given. The caller
+    // destroys the staging buffer once the upload is done.
+    u32 const n_mip_levels = image_resources->n_mip_levels;
+    VkBufferImageCopy regions[MAX_N_MIP_LEVELS];
+    stage_image_levels(device, physical_device, level_data, level_sizes, width, height, n_mip_levels,
+      regions, staging_buffer, staging_buffer_memory);
+    record_image_levels_copy(command_buffer, image_resources->image, *staging_buffer, regions, n_mip_levels,
+      VK_QUEUE_FAMILY_IGNORED, VK_QUEUE_FAMILY_IGNORED);
+  }
+
+
+  void record_image_upload_from_staging(
+    VkDevice device,
+    VkPhysicalDevice physical_device,
+    VkCommandBuffer command_buffer,
+    ImageResources *image_resources,
+    VkBuffer staging_buffer,
+    VkDeviceSize staging_offset,
+    u8 const *staged_image,
+    u32 width, u32 height,
+    VkFormat format,
+    VkBuffer *mip_staging_buffer,
+    VkDeviceMemory *mip_staging_buffer_memory
+  ) {
+    // The top mip level is already in `staging_buffer` at `staging_offset` as
+    // RGBA8, and `staged_image` points to the same data in mapped memory. If
+    // the image has more levels, we generate them, preferably on the GPU by
+    // blitting each level from the one above it. Blitting needs support for
+    // linear filtering on this format, so if we don't have that, we downsample
+    // on the CPU and upload all the levels instead, from a new staging buffer
+    // that we put in `mip_staging_buffer`, for the caller to destroy once the
+    // upload is done. Otherwise, it's left null.
+    *mip_staging_buffer = VK_NULL_HANDLE;
+    *mip_staging_buffer_memory = VK_NULL_HANDLE;
+    u32 const n_mip_levels = image_resources->n_mip_levels;
+    assert(n_mip_levels <= MAX_N_MIP_LEVELS);
+    VkFormatProperties format_properties;
+    vkGetPhysicalDeviceFormatProperties(physical_device, format, &format_properties);
+    VkFormatFeatureFlags const blit_features = VK_FORMAT_FEATURE_BLIT_SRC_BIT | VK_FORMAT_FEATURE_BLIT_DST_BIT |
+      VK_FORMAT_FEATURE_SAMPLED_IMAGE_FILTER_LINEAR_BIT;
+    bool const should_downsample_on_cpu = n_mip_levels > 1 &&
+      (format_properties.optimalTilingFeatures & blit_features) != blit_features;
+
+    if (should_downsample_on_cpu) {
+      u8 const *level_data[MAX_N_MIP_LEVELS];
+      VkDeviceSize level_sizes[MAX_N_MIP_LEVELS];
+      VkDeviceSize total_size = 0;
+      range (0, n_mip_levels) {
+        level_sizes[idx] = (VkDeviceSize)images::get_mip_dimension(width, idx) *
+          images::get_mip_dimension(height, idx) * 4;
+        total_size += level_sizes[idx];
+      }
+
+      MemoryPool temp_memory_pool = {.size = total_size};
+      defer { memory::destroy_memory_pool(&temp_memory_pool); };
+      level_data[0] = staged_image;
+      range (1, n_mip_levels) {
+        u8 *mip = (u8*)memory::push(&temp_memory_pool, level_sizes[idx], "mip_level");
+        images::downsample_rgba8(
+          mip, images::get_mip_dimension(width, idx), images::get_mip_dimension(height, idx),
+          level_data[idx - 1],
+          images::get_mip_dimension(width, idx - 1), images::get_mip_dimension(height, idx - 1));
+        level_data[idx] = mip;
+      }
 
-    vkDestroyBuffer(device, staging_buffer, nullptr);
-    vkFreeMemory(device, staging_buffer_memory, nullptr);
+      record_image_levels_upload(device, physical_device, command_buffer, image_resources,
+        level_data, level_sizes, width, height, mip_staging_buffer, mip_staging_buffer_memory);
+      return;
+    }
+
+    VkImageMemoryBarrier const to_transfer_dst_barrier = image_memory_barrier(image_resources->image,
+      VK_IMAGE_LAYOUT_UNDEFINED, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+      0, VK_ACCESS_TRANSFER_WRITE_BIT,
+      0, n_mip_levels);
+    vkCmdPipelineBarrier(command_buffer, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT, 0,
+      0, nullptr, 0, nullptr, 1, &to_transfer_dst_barrier);
+
+    VkBufferImageCopy const region = {
+      .bufferOffset      = staging_offset,
+      .bufferRowLength   = 0,
+      .bufferImageHeight = 0,
+      .imageSubresource = {
+        .aspectMask      = VK_IMAGE_ASPECT_COLOR_BIT,
+        .mipLevel        = 0,
+        .baseArrayLayer  = 0,
+        .layerCount      = 1,
+      },
+      .imageOffset       = {0, 0, 0},
+      .imageExtent       = {width, height, 1},
+    };
+    vkCmdCopyBufferToImage(command_buffer, staging_buffer, image_resources->image,
+      VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 1, &region);
+
+    range (1, n_mip_levels) {
+      // The level above has to be fully written before we can read from it
+      VkImageMemoryBarrier const to_transfer_src_barrier = image_memory_barrier(image_resources->image,
+        VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
+        VK_ACCESS_TRANSFER_WRITE_BIT, VK_ACCESS_TRANSFER_READ_BIT,
+        idx - 1, 1);
+      vkCmdPipelineBarrier(command_buffer, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT, 0,
+        0, nullptr, 0, nullptr, 1, &to_transfer_src_barrier);
+
+      VkImageBlit const blit = {
+        .srcSubresource = {
+          .aspectMask     = VK_IMAGE_ASPECT_COLOR_BIT,
+          .mipLevel       = idx - 1,
+          .baseArrayLayer = 0,
+          .layerCount     = 1,
+        },
+        .srcOffsets = {
+          {0, 0, 0},
+          {(i32)images::get_mip_dimension(width, idx - 1), (i32)images::get_mip_dimension(height, idx - 1), 1},
+        },
+        .dstSubresource = {
+          .aspectMask     = VK_IMAGE_ASPECT_COLOR_BIT,
+          .mipLevel       = idx,
+          .baseArrayLayer = 0,
+          .layerCount     = 1,
+        },
+        .dstOffsets = {
+          {0, 0, 0},
+          {(i32)images::get_mip_dimension(width, idx), (i32)images::get_mip_dimension(height, idx), 1},
+        },
+      };
+      vkCmdBlitImage(command_buffer,
+        image_resources->image, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
+        image_resources->image, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+        1, &blit, VK_FILTER_LINEAR);
+    }
+
+    // Every level but the last one has been read from, so they're in two
+    // different layouts now, but we can still transition them all at once
+    VkImageMemoryBarrier to_shader_read_barriers[2];
+    u32 n_to_shader_read_barriers = 0;
+    if (n_mip_levels > 1) {
+      to_shader_read_barriers[n_to_shader_read_barriers++] = image_memory_barrier(image_resources->image,
+        VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL,
+        VK_ACCESS_TRANSFER_READ_BIT, VK_ACCESS_SHADER_READ_BIT,
+        0, n_mip_levels - 1);
+    }
+    to_shader_read_barriers[n_to_shader_read_barriers++] = image_memory_barrier(image_resources->image,
+      VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL,
+      VK_ACCESS_TRANSFER_WRITE_BIT, VK_ACCESS_SHADER_READ_BIT,
+      n_mip_levels - 1, 1);
+    vkCmdPipelineBarrier(command_buffer, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT, 0,
+      0, nullptr, 0, nullptr, n_to_shader_read_barriers, to_shader_read_barriers);
   }
 
 
@@ -850,13 +1001,4 @@ namespace vkutils {
 
     return shader_module;
   }
-
-
-  VkShaderModule create_shader_module_from_file(
-    VkDevice device, MemoryPool *pool, char const *path
-  ) {
-    size_t shader_size;
-    u8 *shader = files::load_file_to_pool_u8(pool, path, &shader_size);
-    return create_shader_module(device, shader, shader_size);
-  }
 }
@@ -5,6 +5,7 @@
 
 
 #include <stdint.h>
+#include <stdio.h>
 #include <vulkan/vulkan.h>
 #define GLFW_INCLUDE_VULKAN
 #include <GLFW/glfw3.h>
@@ -18,14 +19,25 @@
 #include "types.hpp"
 #include "constants.hpp"
 #include "files.hpp"
+#include "memory.hpp"
+#include "util.hpp"
 
 #include "vkutils.hpp"
 #include "vulkan_core.cpp"
+#include "vulkan_sync.cpp"
+#include "vulkan_deletion.cpp"
+#include "vulkan_descriptors.cpp"
+#include "vulkan_reflection.cpp"
+#include "vulkan_layouts.cpp"
 #include "vulkan_rendering.cpp"
+#include "vulkan_recording.cpp"
 #include "vulkan_stage_common.cpp"
 #include "vulkan_stage_geometry.cpp"
 #include "vulkan_stage_lighting.cpp"
 #include "vulkan_stage_forward.cpp"
+#include "vulkan_pipelines.cpp"
+#include "vulkan_streaming.cpp"
+#include "vulkan_hot_reload.cpp"
 #include "vulkan_resources.cpp"
 
 
@@ -33,168 +45,281 @@ static std::thread loading_thread;
 
 
 namespace vulkan {
-  // Global descriptor sets
-  static constexpr VkDescriptorSetLayoutBinding GLOBAL_DESCRIPTOR_BINDINGS[] = {
-    vkutils::descriptor_set_layout_binding(0, VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER),
-  };
-  static constexpr u32 N_GLOBAL_DESCRIPTORS = LEN(GLOBAL_DESCRIPTOR_BINDINGS);
+  static void init_pipeline_cache(VkState *vk_state) {
+    // Start off with whatever we saved last time. The driver checks that the
+    // data is for this device and driver, and ignores it otherwise.
+    files::FileView view = {};
+    if (files::does_file_exist(PIPELINE_CACHE_PATH)) {
+      files::map_file(&view, PIPELINE_CACHE_PATH);
+    }
+    defer { files::unmap_file(&view); };
+
+    VkPipelineCacheCreateInfo const pipeline_cache_info = {
+      .sType           = VK_STRUCTURE_TYPE_PIPELINE_CACHE_CREATE_INFO,
+      .initialDataSize = view.size,
+      .pInitialData    = view.data,
+    };
+    vkutils::check(vkCreatePipelineCache(vk_state->device, &pipeline_cache_info, nullptr,
+      &vk_state->pipeline_cache));
+  }
+
+
+  static void destroy_pipeline_cache(VkState *vk_state) {
+    size_t cache_size;
+    vkutils::check(vkGetPipelineCacheData(vk_state->device, vk_state->pipeline_cache, &cache_size, nullptr));
+    if (cache_size > 0) {
+      MemoryPool temp_memory_pool = {.size = cache_size};
+      defer { memory::destroy_memory_pool(&temp_memory_pool); };
+      void *cache_data = memory::push(&temp_memory_pool, cache_size, "pipeline_cache_data");
+      vkutils::check(vkGetPipelineCacheData(vk_state->device, vk_state->pipeline_cache, &cache_size, cache_data));
+
+      FILE *f = fopen(PIPELINE_CACHE_PATH, "wb");
+      if (f) {
+        fwrite(cache_data, cache_size, 1, f);
+        fclose(f);
+      } else {
+        logs::warning("Could not save pipeline cache to %s", PIPELINE_CACHE_PATH);
+      }
+    }
+    vkDestroyPipelineCache(vk_state->device, vk_state->pipeline_cache, nullptr);
+  }
+
+
+  // Works out the layouts of the sets that every stage shares from what all of
+  // the stages' shaders declare, so each of them has everything any stage needs
+  static void init_shared_descriptor_set_layouts(VkState *vk_state) {
+    geometry_stage::reflect_shaders(vk_state);
+    lighting_stage::reflect_shaders(vk_state);
+    forward_stage::reflect_shaders(vk_state);
+    ShaderReflection all_shaders = {};
+    RenderStage const *stages[] = {&vk_state->geometry_stage, &vk_state->lighting_stage, &vk_state->forward_stage};
+    range (0, LEN(stages)) {
+      if (!reflection::merge(&all_shaders, &stages[idx]->reflection)) {
+        logs::fatal("Our shaders' descriptor sets don't agree with each other");
+      }
+    }
 
-  // Material descriptor sets
-  static constexpr VkDescriptorSetLayoutBinding MATERIAL_DESCRIPTOR_BINDINGS[] = {
-    vkutils::descriptor_set_layout_binding(0, VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER),
-  };
-  static constexpr u32 N_MATERIAL_DESCRIPTORS = LEN(MATERIAL_DESCRIPTOR_BINDINGS);
+    if (
+      vk_state->is_bindless_enabled &&
+      !reflection::find_binding(&all_shaders, (u32)DescriptorSetIndex::global, BINDLESS_TEXTURES_BINDING)
+    ) {
+      logs::fatal("Bindless mode is on, but no shader has a bindless texture table");
+    }
+
+    vk_state->global_descriptor_set_layout = layouts::get_descriptor_set_layout(vk_state, &all_shaders,
+      (u32)DescriptorSetIndex::global);
+    vk_state->n_global_descriptors = reflection::count_set_bindings(&all_shaders,
+      (u32)DescriptorSetIndex::global);
+    vk_state->material_descriptor_set_layout = layouts::get_descriptor_set_layout(vk_state, &all_shaders,
+      (u32)DescriptorSetIndex::material);
+    vk_state->entity_descriptor_set_layout = layouts::get_descriptor_set_layout(vk_state, &all_shaders,
+      (u32)DescriptorSetIndex::entity);
+    vk_state->n_entity_descriptors = reflection::count_set_bindings(&all_shaders,
+      (u32)DescriptorSetIndex::entity);
+  }
 
-  // Entity descriptor sets
-  static constexpr VkDescriptorSetLayoutBinding ENTITY_DESCRIPTOR_BINDINGS[] = {
-    vkutils::descriptor_set_layout_binding(0, VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER),
-  };
-  static constexpr u32 N_ENTITY_DESCRIPTORS = LEN(ENTITY_DESCRIPTOR_BINDINGS);
+
+  // Makes the frame's global set, with every texture in the bindless texture
+  // table. Textures' views change as they stream in, so we do this every frame.
+  static void update_bindless_global_descriptors(VkState *vk_state, u32 idx_frame) {
+    FrameResources *frame_resources = &vk_state->frame_resources[idx_frame];
+    u32 const n_textures = vk_state->n_bindless_textures;
+    assert(n_textures > 0);
+    VkDescriptorSet const descriptor_set = descriptors::allocate(vk_state, &frame_resources->descriptor_allocator,
+      vk_state->global_descriptor_set_layout, n_textures);
+
+    VkDescriptorBufferInfo const buffer_info = {
+      .buffer = frame_resources->global_uniform_buffer,
+      .offset = 0,
+      .range  = sizeof(GlobalUniforms),
+    };
+    VkDescriptorImageInfo image_infos[MAX_N_BINDLESS_TEXTURES];
+    range (0, n_textures) {
+      image_infos[idx] = {
+        .sampler     = vk_state->bindless_textures[idx]->sampler,
+        .imageView   = vk_state->bindless_textures[idx]->view,
+        .imageLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL,
+      };
+    }
+    VkWriteDescriptorSet descriptor_writes[] = {
+      vkutils::write_descriptor_set_buffer(descriptor_set, 0, &buffer_info),
+      vkutils::write_descriptor_set_image(descriptor_set, BINDLESS_TEXTURES_BINDING, image_infos),
+    };
+    descriptor_writes[1].descriptorCount = n_textures;
+    vkUpdateDescriptorSets(vk_state->device, LEN(descriptor_writes), descriptor_writes, 0, nullptr);
+
+    vk_state->global_descriptor_sets[idx_frame] = descriptor_set;
+  }
 
 
   void init(VkState *vk_state, CommonState *common_state) {
     core::init(vk_state, common_state->window, &common_state->extent);
 
-    // We only one command pool which we use for everything graphics-related
+    // One-off graphics commands, like uploads, use this command pool
     vkutils::create_command_pool(vk_state->device, &vk_state->command_pool,
       (u32)vk_state->queue_family_indices.graphics);
-    // We create another command pool for asset loading
-    vkutils::create_command_pool(vk_state->device, &vk_state->asset_command_pool,
-      (u32)vk_state->queue_family_indices.graphics);
+    // We create another command pool for uploads that run while we render,
+    // which might be on a queue from a different family. Uploads that we wait
+    // for anyway go on the graphics queue, since generating mip levels needs
+    // blits, which a transfer queue can't do.
+    vkutils::create_command_pool(vk_state->device, &vk_state->asset_command_pool, vk_state->asset_queue_family);
+
+    // Each frame records its command buffers from its own pools, which
+    // stages can split across our workers
+    recording::init(vk_state, &common_state->worker_pool);
+
+    vk_state->frame_memory_pool = {.size = util::mb_to_b(4)};
+
+    init_pipeline_cache(vk_state);
+
+    // If there's no asset pack, we just load everything from loose files
+    pack::open_pack(&vk_state->asset_pack, ASSET_PACK_PATH);
 
-    resources::init_static_textures(vk_state);
-    resources::init_textures(vk_state);
-    /* loading_thread = std::thread(resources::init_textures, vk_state); */
-    resources::init_entities(vk_state);
     resources::init_uniform_buffers(vk_state);
 
-    // Global descriptors
-    {
-      // Create descriptor set layout
-      auto const layout_info = vkutils::descriptor_set_layout_create_info(vulkan::N_GLOBAL_DESCRIPTORS,
-        vulkan::GLOBAL_DESCRIPTOR_BINDINGS);
-      vkutils::check(vkCreateDescriptorSetLayout(vk_state->device, &layout_info, nullptr,
-        &vk_state->global_descriptor_set_layout));
+    // Descriptor set layouts, which we get from the shaders themselves
+    init_shared_descriptor_set_layouts(vk_state);
 
+    // Global descriptors
+    // With bindless textures, the global set also holds the texture table, so
+    // we make it every frame, see `update_bindless_global_descriptors()`
+    if (!vk_state->is_bindless_enabled) {
       range (0, N_PARALLEL_FRAMES) {
-        // Allocate descriptor sets
-        auto const alloc_info = vkutils::descriptor_set_allocate_info(vk_state->descriptor_pool,
-          &vk_state->global_descriptor_set_layout);
-        vkutils::check(vkAllocateDescriptorSets(vk_state->device, &alloc_info, &vk_state->global_descriptor_sets[idx]));
-
-        // Update descriptor sets
-        VkDescriptorBufferInfo const buffer_info = {
-          .buffer = vk_state->frame_resources[idx].global_uniform_buffer,
-          .offset = 0,
-          .range  = sizeof(GlobalUniforms),
+        DescriptorBinding const bindings[] = {
+          {
+            .type        = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER,
+            .buffer_info = {
+              .buffer = vk_state->frame_resources[idx].global_uniform_buffer,
+              .offset = 0,
+              .range  = sizeof(GlobalUniforms),
+            },
+          },
         };
-        VkWriteDescriptorSet descriptor_writes[] = {
-          vkutils::write_descriptor_set_buffer(vk_state->global_descriptor_sets[idx], 0, &buffer_info),
-        };
-        vkUpdateDescriptorSets(vk_state->device, vulkan::N_GLOBAL_DESCRIPTORS, descriptor_writes, 0, nullptr);
+        assert(vk_state->n_global_descriptors <= LEN(bindings));
+        vk_state->global_descriptor_sets[idx] = descriptors::get_cached_set(vk_state,
+          vk_state->global_descriptor_set_layout, bindings, vk_state->n_global_descriptors);
       }
     }
 
     // Material descriptors
     {
-      // Create descriptor set layout
-      auto const layout_info = vkutils::descriptor_set_layout_create_info(vulkan::N_MATERIAL_DESCRIPTORS,
-        vulkan::MATERIAL_DESCRIPTOR_BINDINGS);
-      vkutils::check(vkCreateDescriptorSetLayout(vk_state->device, &layout_info, nullptr,
-        &vk_state->material_descriptor_set_layout));
-
+      // Nothing is written to these yet, so every frame gets the same set
       range (0, N_PARALLEL_FRAMES) {
-        // Allocate descriptor sets
-        auto const alloc_info = vkutils::descriptor_set_allocate_info(vk_state->descriptor_pool,
-          &vk_state->material_descriptor_set_layout);
-        vkutils::check(vkAllocateDescriptorSets(vk_state->device, &alloc_info, &vk_state->material_descriptor_sets[idx]));
+        vk_state->material_descriptor_sets[idx] = descriptors::get_cached_set(vk_state,
+          vk_state->material_descriptor_set_layout, nullptr, 0);
       }
     }
 
     // Entity descriptors
     {
-      // Create descriptor set layout
-      auto const layout_info = vkutils::descriptor_set_layout_create_info(vulkan::N_ENTITY_DESCRIPTORS,
-        vulkan::ENTITY_DESCRIPTOR_BINDINGS);
-      vkutils::check(vkCreateDescriptorSetLayout(vk_state->device, &layout_info, nullptr,
-        &vk_state->entity_descriptor_set_layout));
-
+      // We only write the entity uniforms if some shader actually reads them
       range (0, N_PARALLEL_FRAMES) {
-        // Allocate descriptor sets
-        auto const alloc_info = vkutils::descriptor_set_allocate_info(vk_state->descriptor_pool,
-          &vk_state->entity_descriptor_set_layout);
-        vkutils::check(vkAllocateDescriptorSets(vk_state->device, &alloc_info, &vk_state->entity_descriptor_sets[idx]));
-
-        // Update descriptor sets
-        VkDescriptorBufferInfo const buffer_info = {
-          .buffer = vk_state->frame_resources[idx].entity_uniform_buffer,
-          .offset = 0,
-          .range  = sizeof(EntityUniforms),
-        };
-        VkWriteDescriptorSet descriptor_writes[] = {
-          vkutils::write_descriptor_set_buffer(vk_state->entity_descriptor_sets[idx], 0, &buffer_info),
+        DescriptorBinding const bindings[] = {
+          {
+            .type        = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER,
+            .buffer_info = {
+              .buffer = vk_state->frame_resources[idx].entity_uniform_buffer,
+              .offset = 0,
+              .range  = sizeof(EntityUniforms),
+            },
+          },
         };
-        vkUpdateDescriptorSets(vk_state->device, vulkan::N_ENTITY_DESCRIPTORS, descriptor_writes, 0, nullptr);
+        assert(vk_state->n_entity_descriptors <= LEN(bindings));
+        vk_state->entity_descriptor_sets[idx] = descriptors::get_cached_set(vk_state,
+          vk_state->entity_descriptor_set_layout, bindings, vk_state->n_entity_descriptors);
       }
     }
 
-    // Init render stages
+    // Init render stages. We start building their pipelines as early as we
+    // can, so that it happens while we load everything else.
     geometry_stage::init(vk_state, common_state->extent);
     lighting_stage::init(vk_state, common_state->extent);
     forward_stage::init(vk_state, common_state->extent);
+    pipelines::start_builds(vk_state, &common_state->worker_pool, common_state->extent);
+    hot_reload::init(vk_state, &common_state->worker_pool);
+
+    resources::init_static_textures(vk_state);
+    resources::init_textures(vk_state, &common_state->worker_pool);
+    /* loading_thread = std::thread(resources::init_textures, vk_state); */
+    resources::init_materials(vk_state);
+    resources::init_geometry_buffer(vk_state);
+    resources::init_entities(vk_state);
 
-    // Create semaphores and fences
+    // Create semaphores and fences, where we only need the fences if we
+    // don't have timelines to wait on
+    sync::init(vk_state);
     range (0, N_PARALLEL_FRAMES) {
       FrameResources *frame_resources = &vk_state->frame_resources[idx];
       vkutils::create_semaphore(vk_state->device, &frame_resources->image_available_semaphore);
-      vkutils::create_fence(vk_state->device, &frame_resources->frame_rendered_fence);
+      if (!vk_state->is_timeline_semaphore_enabled) {
+        vkutils::create_fence(vk_state->device, &frame_resources->frame_rendered_fence);
+      }
     }
   }
 
 
+  // Retires everything that depends on the swapchain, which frames in flight
+  // might still be using
   static void destroy_swapchain(VkState *vk_state) {
-    vkutils::destroy_image_resources(vk_state->device, &vk_state->depthbuffer);
-    vkutils::destroy_image_resources_with_sampler(vk_state->device, &vk_state->g_position);
-    vkutils::destroy_image_resources_with_sampler(vk_state->device, &vk_state->g_normal);
-    vkutils::destroy_image_resources_with_sampler(vk_state->device, &vk_state->g_albedo);
-    vkutils::destroy_image_resources_with_sampler(vk_state->device, &vk_state->g_pbr);
-
-    vkDestroySwapchainKHR(vk_state->device, vk_state->swapchain, nullptr);
-
-    range (0, N_PARALLEL_FRAMES) {
-      FrameResources *frame_resources = &vk_state->frame_resources[idx];
-      vkDestroyBuffer(vk_state->device, frame_resources->global_uniform_buffer, nullptr);
-      vkFreeMemory(vk_state->device, frame_resources->global_uniform_buffer_memory, nullptr);
-      vkDestroyBuffer(vk_state->device, frame_resources->entity_uniform_buffer, nullptr);
-      vkFreeMemory(vk_state->device, frame_resources->entity_uniform_buffer_memory, nullptr);
-    }
+    deletion::retire_image_resources(vk_state, &vk_state->depthbuffer);
+    deletion::retire_image_resources_with_sampler(vk_state, &vk_state->g_position);
+    deletion::retire_image_resources_with_sampler(vk_state, &vk_state->g_normal);
+    deletion::retire_image_resources_with_sampler(vk_state, &vk_state->g_albedo);
+    deletion::retire_image_resources_with_sampler(vk_state, &vk_state->g_pbr);
 
     geometry_stage::destroy_swapchain(vk_state);
     lighting_stage::destroy_swapchain(vk_state);
     forward_stage::destroy_swapchain(vk_state);
-
-    vkDestroyDescriptorSetLayout(vk_state->device, vk_state->global_descriptor_set_layout, nullptr);
-    vkDestroyDescriptorSetLayout(vk_state->device, vk_state->material_descriptor_set_layout, nullptr);
-    vkDestroyDescriptorSetLayout(vk_state->device, vk_state->entity_descriptor_set_layout, nullptr);
+    recording::retire_cached_command_buffers(vk_state, &vk_state->geometry_stage);
+    recording::retire_cached_command_buffers(vk_state, &vk_state->lighting_stage);
+    recording::retire_cached_command_buffers(vk_state, &vk_state->forward_stage);
+    recording::mark_dirty(vk_state);
 
     range (0, vk_state->n_swapchain_images) {
-      vkDestroyImageView(vk_state->device, vk_state->swapchain_image_views[idx], nullptr);
+      deletion::retire_swapchain_image_view(vk_state, vk_state->swapchain_image_views[idx]);
     }
+    deletion::retire_swapchain(vk_state, vk_state->swapchain);
   }
 
 
   void destroy(VkState *vk_state) {
+    vkDeviceWaitIdle(vk_state->device);
+
+    pipelines::cancel_builds(vk_state);
+    hot_reload::destroy(vk_state);
     destroy_swapchain(vk_state);
 
+    // Streaming textures' data can point into the asset pack, so this has to
+    // go before we close it
+    streaming::destroy(vk_state);
+
+    // Nothing is running anymore, so everything we've retired can go. This
+    // has to happen before we destroy the pools some of it came from.
+    deletion::flush(vk_state);
+    descriptors::destroy(vk_state);
+    layouts::destroy(vk_state);
+
+    range (0, N_PARALLEL_FRAMES) {
+      FrameResources *frame_resources = &vk_state->frame_resources[idx];
+      vkDestroyBuffer(vk_state->device, frame_resources->global_uniform_buffer, nullptr);
+      vkFreeMemory(vk_state->device, frame_resources->global_uniform_buffer_memory, nullptr);
+      vkDestroyBuffer(vk_state->device, frame_resources->entity_uniform_buffer, nullptr);
+      vkFreeMemory(vk_state->device, frame_resources->entity_uniform_buffer_memory, nullptr);
+      vkDestroyBuffer(vk_state->device, frame_resources->instance_buffer, nullptr);
+      vkFreeMemory(vk_state->device, frame_resources->instance_buffer_memory, nullptr);
+    }
+
     resources::destroy_static_textures(vk_state);
     resources::destroy_textures(vk_state);
     resources::destroy_entities(vk_state);
+    resources::destroy_geometry_buffer(vk_state);
 
     range (0, N_PARALLEL_FRAMES) {
       FrameResources *frame_resources = &vk_state->frame_resources[idx];
       vkDestroySemaphore(vk_state->device, frame_resources->image_available_semaphore, nullptr);
       vkDestroyFence(vk_state->device, frame_resources->frame_rendered_fence, nullptr);
     }
+    sync::destroy(vk_state);
 
     geometry_stage::destroy_nonswapchain(vk_state);
     lighting_stage::destroy_nonswapchain(vk_state);
@@ -202,6 +327,11 @@ namespace vulkan {
 
     vkDestroyCommandPool(vk_state->device, vk_state->command_pool, nullptr);
     vkDestroyCommandPool(vk_state->device, vk_state->asset_command_pool, nullptr);
+    recording::destroy(vk_state);
+    destroy_pipeline_cache(vk_state);
+
+    memory::destroy_memory_pool(&vk_state->frame_memory_pool);
+    pack::close_pack(&vk_state->asset_pack);
 
     core::destroy(vk_state);
 
@@ -222,24 +352,69 @@ namespace vulkan {
       glfwWaitEvents();
     }
 
-    vkDeviceWaitIdle(vk_state->device);
-
+    // We don't wait for the device to go idle here. Everything that frames in
+    // flight might still be using goes to the deletion queue, and the old
+    // swapchain hands over to the new one.
+    pipelines::cancel_builds(vk_state);
+    hot_reload::cancel_rebuilds(vk_state);
+    VkSwapchainKHR const old_swapchain = vk_state->swapchain;
     destroy_swapchain(vk_state);
 
     core::init_support_details(&vk_state->swapchain_support_details, vk_state->physical_device, vk_state->surface);
-    core::init(vk_state, common_state->window, &common_state->extent);
-    resources::init_uniform_buffers(vk_state);
+    core::init_swapchain(vk_state, common_state->window, &common_state->extent, old_swapchain);
 
     geometry_stage::init_swapchain(vk_state, common_state->extent);
     lighting_stage::init_swapchain(vk_state, common_state->extent);
     forward_stage::init_swapchain(vk_state, common_state->extent);
+    pipelines::start_builds(vk_state, vk_state->pipeline_builds.worker_pool, common_state->extent);
   }
 
 
   void render(VkState *vk_state, CommonState *common_state) {
     FrameResources *frame_resources = &vk_state->frame_resources[vk_state->idx_frame];
 
-    vkWaitForFences(vk_state->device, 1, &frame_resources->frame_rendered_fence, VK_TRUE, UINT64_MAX);
+    // Pipelines get built in the background, and this is the last moment we
+    // can wait for them
+    pipelines::finish_builds(vk_state);
+
+    sync::wait_for_frame(vk_state, frame_resources);
+    memory::reset_memory_pool(&vk_state->frame_memory_pool);
+    recording::reset_frame_command_pools(vk_state, vk_state->idx_frame);
+
+    // Now that this frame's previous submission is done, we can destroy what
+    // it was the last to use, swap in any textures that have finished
+    // streaming, as well as any pipelines we've rebuilt
+    deletion::collect(vk_state);
+    streaming::update(vk_state, common_state);
+    hot_reload::update(vk_state, common_state);
+
+    // Switch to whichever shader variants we want now, building any we haven't
+    // needed before. Frames in flight keep using the old ones, which stay in
+    // their stage's variant cache.
+    if (common_state->lighting_debug_view != vk_state->lighting_debug_view) {
+      vk_state->lighting_debug_view = common_state->lighting_debug_view;
+      vk_state->lighting_stage.permutation_key = (u32)common_state->lighting_debug_view;
+    }
+    pipelines::update_variants(vk_state, common_state->extent);
+
+    // Everything that can make cached command buffers dirty has happened by
+    // now, so we know whether we can keep using them
+    recording::update_cache(vk_state, common_state->should_cache_command_buffers,
+      &common_state->global_uniforms.view);
+
+    // This frame's descriptor sets from last time are free again too, so we
+    // make new ones, which pick up whatever textures we've just swapped in.
+    // If this frame's cached command buffers are still good, they still use
+    // the old ones, which are still good too.
+    if (recording::should_update_descriptors(vk_state, vk_state->idx_frame)) {
+      descriptors::reset_allocator(vk_state, &frame_resources->descriptor_allocator);
+      if (vk_state->is_bindless_enabled) {
+        update_bindless_global_descriptors(vk_state, vk_state->idx_frame);
+      }
+      geometry_stage::update_descriptors(vk_state, vk_state->idx_frame);
+      lighting_stage::update_descriptors(vk_state, vk_state->idx_frame);
+      forward_stage::update_descriptors(vk_state, vk_state->idx_frame);
+    }
 
     // Update UBO
     vkutils::copy_memory(vk_state->device, frame_resources->global_uniform_buffer_memory,
@@ -259,10 +434,29 @@ namespace vulkan {
       }
     }
 
+    // If we've cached command buffers for this frame and image, all we have
+    // to do is submit them again
+    bool const should_record = !recording::is_frame_cached(vk_state, idx_image);
+
+    // Build draw lists. Opaque stages go front-to-back so that early depth
+    // testing can reject as much as possible, while the forward stage's
+    // transparent objects have to go back-to-front to blend correctly.
+    if (should_record) {
+      m4 const *view = &common_state->global_uniforms.view;
+      MemoryPool *pool = &vk_state->frame_memory_pool;
+      frame_resources->n_instances = 0;
+      rendering::build_draw_list(&vk_state->geometry_stage.draw_list, vk_state, frame_resources,
+        RenderStageName::geometry, DrawOrder::front_to_back, view, pool);
+      rendering::build_draw_list(&vk_state->lighting_stage.draw_list, vk_state, frame_resources,
+        RenderStageName::lighting, DrawOrder::front_to_back, view, pool);
+      rendering::build_draw_list(&vk_state->forward_stage.draw_list, vk_state, frame_resources,
+        RenderStageName::forward_depth, DrawOrder::back_to_front, view, pool);
+    }
+
     // Render each stage
-    geometry_stage::render(vk_state, common_state->extent, idx_image);
-    lighting_stage::render(vk_state, common_state->extent, idx_image);
-    forward_stage::render(vk_state, common_state->extent, idx_image);
+    geometry_stage::render(vk_state, common_state->extent, idx_image, should_record);
+    lighting_stage::render(vk_state, common_state->extent, idx_image, should_record);
+    forward_stage::render(vk_state, common_state->extent, idx_image, should_record);
 
     // Present image
     {
@@ -290,6 +484,7 @@ namespace vulkan {
     }
 
     vk_state->idx_frame = (vk_state->idx_frame + 1) % N_PARALLEL_FRAMES;
+    vk_state->frame_number++;
   }
 
 
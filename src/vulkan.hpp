@@ -3,20 +3,63 @@
 #include <GLFW/glfw3.h>
 #include <vulkan/vulkan.h>
 #include <array>
+#include <atomic>
 
 #include "types.hpp"
 #include "common.hpp"
+#include "memory.hpp"
+#include "pack.hpp"
+#include "files.hpp"
+#include "tasks.hpp"
 
 struct Vertex {
   v3 position;
   v3 normal;
   v2 tex_coords;
 };
+static_assert(sizeof(Vertex) == sizeof(pack::MeshVertex), "Cooked mesh vertices should match our vertices");
+
+// A compressed alternative to `Vertex`, at half the size
+struct QuantizedVertex {
+  // Normalised to [-1, 1] within the mesh's bounds, and scaled back by the
+  // shader using the mesh's `position_scale` and `position_offset`. The
+  // fourth component is padding.
+  i16 position[4];
+  // Octahedral encoding of the normal, as SNORM
+  i16 normal[2];
+  // Half floats
+  u16 tex_coords[2];
+};
+
+enum class VertexLayout : u32 { full, quantized, length };
+
+// Per-instance data, fed to the vertex shader through its own vertex binding
+struct InstanceData {
+  v3 position;
+  // Where the instance's material's albedo texture is in the bindless
+  // texture table, see `VkState::bindless_textures`
+  u32 idx_albedo_texture;
+};
+
+// Per-draw data, which goes to the shaders as push constants, so that it
+// doesn't need any descriptor updates. The layout matches the shaders'
+// `push_constant` block, where each vec3 is aligned to 16 bytes. Shaders can
+// declare only the start of the block, and we only push that much.
+struct DrawConstants {
+  // How to get from a `QuantizedVertex` position back to the mesh's actual
+  // position. These are a no-op for `VertexLayout::full` meshes.
+  v3 position_scale;
+  u32 padding;
+  v3 position_offset;
+};
+static_assert(offsetof(DrawConstants, position_offset) == 16);
 
 enum class DescriptorSetIndex : u32 { global, stage, material, entity };
 
 static constexpr i64 NO_QUEUE_FAMILY                       = -1;
 static constexpr u32 MAX_N_CONCURRENT_QUEUE_FAMILY_INDICES = 3;
+// Graphics, present, asset and compute
+static constexpr u32 N_DEVICE_QUEUES                       = 4;
 static constexpr u32 MAX_N_SWAPCHAIN_FORMATS               = 32;
 static constexpr u32 MAX_N_SWAPCHAIN_PRESENT_MODES         = 32;
 static constexpr u32 MAX_N_SWAPCHAIN_IMAGES                = 8;
@@ -24,8 +67,60 @@ static constexpr u32 N_PARALLEL_FRAMES                     = 3;
 static constexpr u32 MAX_N_REQUIRED_EXTENSIONS             = 256;
 static constexpr u32 MAX_N_QUEUE_FAMILIES                  = 64;
 static constexpr u32 MAX_N_ENTITIES                        = 64;
+static constexpr u32 MAX_N_MESHES                          = 64;
+static constexpr u32 MAX_N_INSTANCES                       = 1024;
+static constexpr u32 N_VERTEX_BINDINGS                     = 2;
+static constexpr u32 VERTEX_BINDING                        = 0;
+static constexpr u32 INSTANCE_BINDING                      = 1;
+static constexpr u32 N_VERTEX_LAYOUTS                      = (u32)VertexLayout::length;
+static constexpr u32 N_VERTEX_ATTRIBUTES                   = 5;
+static constexpr VkDeviceSize GEOMETRY_VERTEX_BUFFER_SIZE  = 64 * 1024 * 1024;
+static constexpr VkDeviceSize GEOMETRY_INDEX_BUFFER_SIZE   = 32 * 1024 * 1024;
+static constexpr u32 N_DESCRIPTOR_SET_INDICES              = 4;
+static constexpr char const *ASSET_PACK_PATH               = "bin/assets.pack";
+static constexpr u32 MAX_N_MIP_LEVELS                      = 16;
+static constexpr u32 MAX_N_STREAMING_TEXTURES              = 64;
+// Streaming textures start out with only the levels this size and smaller
+static constexpr u32 STREAMING_MIN_RESIDENT_DIMENSION      = 64;
+// Up to this distance from the camera, we want the full-size level. Each time
+// the distance doubles after that, we need one level less.
+static constexpr f32 STREAMING_FULL_DETAIL_DISTANCE        = 4.0f;
+static constexpr char const *SHADER_DIR_PATH               = "bin/shaders";
+static constexpr char const *PIPELINE_CACHE_PATH           = "bin/pipeline_cache.bin";
+// The stages with pipelines, which we can build on worker threads, and
+// rebuild when their shaders change
+static constexpr u32 N_PIPELINE_STAGES                     = 3;
+// How many permutations of its specialization constants a stage keeps
+// pipelines for at once, see `RenderStage::variants`
+static constexpr u32 MAX_N_PIPELINE_VARIANTS               = 16;
+static constexpr u32 MAX_N_RETIRED_OBJECTS                 = 1024;
+static constexpr u32 MAX_N_DESCRIPTOR_POOLS                = 16;
+// Each pool a `DescriptorAllocator` makes holds twice as many sets as the one
+// before it, up to `MAX_N_SETS_PER_DESCRIPTOR_POOL`
+static constexpr u32 MIN_N_SETS_PER_DESCRIPTOR_POOL        = 16;
+static constexpr u32 MAX_N_SETS_PER_DESCRIPTOR_POOL        = 1024;
+static constexpr u32 MAX_N_CACHED_DESCRIPTOR_SETS          = 256;
+static constexpr u32 MAX_N_DESCRIPTOR_BINDINGS             = 8;
+// How many bindings, across all sets, a shader or several shaders together
+// can declare, see `ShaderReflection`
+static constexpr u32 MAX_N_REFLECTED_BINDINGS              = 16;
+static constexpr u32 MAX_N_CACHED_LAYOUTS                  = 32;
+static constexpr u32 MAX_N_MATERIALS                       = 256;
+// We might be able to have fewer than this, depending on the device's limits,
+// see `VkState::n_max_bindless_textures`
+static constexpr u32 MAX_N_BINDLESS_TEXTURES               = 1024;
+// Where the bindless texture table goes in the global descriptor set
+static constexpr u32 BINDLESS_TEXTURES_BINDING             = 1;
+// How many pieces we can split a stage's draws into, each recorded into its
+// own secondary command buffer on a worker thread, see `vulkan_recording.cpp`
+static constexpr u32 MAX_N_RECORDING_JOBS                  = 16;
+// Recording fewer batches than this on a worker costs more than it saves
+static constexpr u32 MIN_N_BATCHES_PER_RECORDING_JOB       = 128;
+static constexpr u32 MAX_N_FRAME_COMMAND_BUFFERS           = 16;
 
 static constexpr bool USE_VALIDATION = true;
+static constexpr bool USE_PARALLEL_RECORDING = true;
+static constexpr bool USE_TIMELINE_SEMAPHORES = true;
 static constexpr std::array VALIDATION_LAYERS = {
   "VK_LAYER_KHRONOS_validation"
 };
@@ -57,36 +152,110 @@ static constexpr u32 SCREENQUAD_INDICES[] = {
   0, 1, 2, 0, 2, 3,
 };
 
-static constexpr VkVertexInputBindingDescription VERTEX_BINDING_DESCRIPTION = {
-  .binding   = 0,
-  .stride    = sizeof(Vertex),
-  .inputRate = VK_VERTEX_INPUT_RATE_VERTEX,
+static constexpr u32 VERTEX_STRIDES[N_VERTEX_LAYOUTS] = {
+  sizeof(Vertex),
+  sizeof(QuantizedVertex),
 };
-static constexpr VkVertexInputAttributeDescription VERTEX_ATTRIBUTE_DESCRIPTIONS[] = {
+
+static constexpr VkVertexInputBindingDescription VERTEX_BINDING_DESCRIPTIONS[N_VERTEX_LAYOUTS][N_VERTEX_BINDINGS] = {
+  // VertexLayout::full
   {
-    .location = 0,
-    .binding  = 0,
-    .format   = VK_FORMAT_R32G32B32_SFLOAT,
-    .offset   = offsetof(Vertex, position),
+    {
+      .binding   = VERTEX_BINDING,
+      .stride    = sizeof(Vertex),
+      .inputRate = VK_VERTEX_INPUT_RATE_VERTEX,
+    },
+    {
+      .binding   = INSTANCE_BINDING,
+      .stride    = sizeof(InstanceData),
+      .inputRate = VK_VERTEX_INPUT_RATE_INSTANCE,
+    },
   },
+  // VertexLayout::quantized
   {
-    .location = 1,
-    .binding  = 0,
-    .format   = VK_FORMAT_R32G32B32_SFLOAT,
-    .offset   = offsetof(Vertex, normal),
+    {
+      .binding   = VERTEX_BINDING,
+      .stride    = sizeof(QuantizedVertex),
+      .inputRate = VK_VERTEX_INPUT_RATE_VERTEX,
+    },
+    {
+      .binding   = INSTANCE_BINDING,
+      .stride    = sizeof(InstanceData),
+      .inputRate = VK_VERTEX_INPUT_RATE_INSTANCE,
+    },
   },
-  {
-    .location = 2,
-    .binding  = 0,
-    .format   = VK_FORMAT_R32G32_SFLOAT,
-    .offset   = offsetof(Vertex, tex_coords),
+};
+
+#define INSTANCE_ATTRIBUTE_DESCRIPTIONS \
+  { \
+    .location = 3, \
+    .binding  = INSTANCE_BINDING, \
+    .format   = VK_FORMAT_R32G32B32_SFLOAT, \
+    .offset   = offsetof(InstanceData, position), \
+  }, \
+  { \
+    .location = 4, \
+    .binding  = INSTANCE_BINDING, \
+    .format   = VK_FORMAT_R32_UINT, \
+    .offset   = offsetof(InstanceData, idx_albedo_texture), \
   }
+
+static constexpr VkVertexInputAttributeDescription VERTEX_ATTRIBUTE_DESCRIPTIONS[N_VERTEX_LAYOUTS][N_VERTEX_ATTRIBUTES] = {
+  // VertexLayout::full
+  {
+    {
+      .location = 0,
+      .binding  = VERTEX_BINDING,
+      .format   = VK_FORMAT_R32G32B32_SFLOAT,
+      .offset   = offsetof(Vertex, position),
+    },
+    {
+      .location = 1,
+      .binding  = VERTEX_BINDING,
+      .format   = VK_FORMAT_R32G32B32_SFLOAT,
+      .offset   = offsetof(Vertex, normal),
+    },
+    {
+      .location = 2,
+      .binding  = VERTEX_BINDING,
+      .format   = VK_FORMAT_R32G32_SFLOAT,
+      .offset   = offsetof(Vertex, tex_coords),
+    },
+    INSTANCE_ATTRIBUTE_DESCRIPTIONS,
+  },
+  // VertexLayout::quantized
+  {
+    {
+      .location = 0,
+      .binding  = VERTEX_BINDING,
+      .format   = VK_FORMAT_R16G16B16A16_SNORM,
+      .offset   = offsetof(QuantizedVertex, position),
+    },
+    {
+      .location = 1,
+      .binding  = VERTEX_BINDING,
+      .format   = VK_FORMAT_R16G16_SNORM,
+      .offset   = offsetof(QuantizedVertex, normal),
+    },
+    {
+      .location = 2,
+      .binding  = VERTEX_BINDING,
+      .format   = VK_FORMAT_R16G16_SFLOAT,
+      .offset   = offsetof(QuantizedVertex, tex_coords),
+    },
+    INSTANCE_ATTRIBUTE_DESCRIPTIONS,
+  },
 };
 
+#undef INSTANCE_ATTRIBUTE_DESCRIPTIONS
+
+// The families we'd like our queues to come from, or `NO_QUEUE_FAMILY`. The
+// transfer and compute families can't do graphics, see `get_queue_families()`.
 struct QueueFamilyIndices {
   i64 graphics;
   i64 present;
   i64 transfer;
+  i64 compute;
 };
 
 struct SwapchainSupportDetails {
@@ -97,13 +266,101 @@ struct SwapchainSupportDetails {
   u32 n_present_modes;
 };
 
+// Hands out descriptor sets from a list of pools, making a new pool whenever
+// the ones we have run out. Sets are never freed one by one, only all at once
+// by resetting the whole allocator.
+struct DescriptorAllocator {
+  VkDescriptorPool pools[MAX_N_DESCRIPTOR_POOLS];
+  u32 n_pools;
+  u32 idx_current_pool;
+};
+
+// What goes into one binding of a descriptor set, see `descriptors::get_cached_set()`
+struct DescriptorBinding {
+  VkDescriptorType type;
+  VkDescriptorBufferInfo buffer_info;
+  VkDescriptorImageInfo image_info;
+};
+
+struct CachedDescriptorSet {
+  // Hash of the layout and everything written to the set
+  u64 hash;
+  VkDescriptorSet descriptor_set;
+};
+
+struct ReflectedBinding {
+  u32 idx_set;
+  u32 binding;
+  VkDescriptorType type;
+  // 0 for runtime arrays, like the bindless texture table
+  u32 n_descriptors;
+  VkShaderStageFlags stage_flags;
+};
+
+// What one or more shaders expect their pipeline layout and vertex input to
+// look like, as read from their SPIR-V, see `reflection::reflect()`
+struct ShaderReflection {
+  ReflectedBinding bindings[MAX_N_REFLECTED_BINDINGS];
+  u32 n_bindings;
+  VkShaderStageFlags push_constant_stage_flags;
+  u32 push_constant_size;
+  // One bit for each vertex input location the vertex shader reads
+  u32 vertex_input_locations;
+};
+
+struct CachedDescriptorSetLayout {
+  u64 hash;
+  VkDescriptorSetLayout layout;
+};
+
+struct CachedPipelineLayout {
+  u64 hash;
+  VkPipelineLayout layout;
+};
+
+// A command pool for buffers that only live for one frame. Rather than
+// resetting its buffers one by one, we reset the whole pool at once when its
+// frame comes round again, and then hand out the buffers it already has
+// before we allocate any new ones, see `recording::get_command_buffer()`.
+struct FrameCommandPool {
+  VkCommandPool pool;
+  VkCommandBufferLevel level;
+  VkCommandBuffer command_buffers[MAX_N_FRAME_COMMAND_BUFFERS];
+  u32 n_command_buffers;
+  // How many of `command_buffers` we've handed out since the last reset
+  u32 n_used_command_buffers;
+};
+
+// A timeline semaphore, and the last value we've asked a queue to signal on
+// it. Values only ever go up, so once the semaphore has reached a value, every
+// submission up to the one that signals it is done, see `vulkan_sync.cpp`.
+struct Timeline {
+  VkSemaphore semaphore;
+  u64 last_submitted_value;
+};
+
 struct FrameResources {
+  // Reset every time we start this frame, for sets that only live for a frame
+  DescriptorAllocator descriptor_allocator;
   VkSemaphore image_available_semaphore;
+  // Only used without timeline semaphores
   VkFence frame_rendered_fence;
+  // The graphics timeline value that this frame's last submission signals
+  u64 timeline_value;
   VkBuffer global_uniform_buffer;
   VkDeviceMemory global_uniform_buffer_memory;
   VkBuffer entity_uniform_buffer;
   VkDeviceMemory entity_uniform_buffer_memory;
+  VkBuffer instance_buffer;
+  VkDeviceMemory instance_buffer_memory;
+  // Persistently mapped, and refilled every frame when we build our draw lists
+  InstanceData *instance_data;
+  u32 n_instances;
+  // For the stages' primary command buffers
+  FrameCommandPool command_pool;
+  // For secondary command buffers, one for each recording job, so that jobs
+  // never share a pool, since pools can only be used by one thread at a time
+  FrameCommandPool recording_command_pools[MAX_N_RECORDING_JOBS];
 };
 
 enum class RenderStageName : u32 {
@@ -122,22 +379,130 @@ enum class RenderStageName : u32 {
 };
 inline bool has(RenderStageName s1, RenderStageName s2) { return ((u32)s1 & (u32)s2) != 0; }
 
-struct RenderStage {
-  VkRenderPass render_pass;
-  VkPipelineLayout pipeline_layout;
-  VkPipeline pipeline;
-  VkFramebuffer framebuffers[MAX_N_SWAPCHAIN_IMAGES];
-  VkSemaphore render_finished_semaphore;
-  VkDescriptorSetLayout stage_descriptor_set_layout;
-  VkDescriptorSet stage_descriptor_sets[N_PARALLEL_FRAMES];
-  VkCommandBuffer command_buffers[N_PARALLEL_FRAMES];
-};
-
 struct ImageResources {
   VkImage image;
   VkDeviceMemory memory;
   VkImageView view;
   VkSampler sampler;
+  u32 n_mip_levels;
+};
+
+// A texture that starts out with only its smallest levels on the GPU, and
+// gets its larger levels one at a time, as they're needed. Every time we get a
+// new level, we make a new image with one more level and swap it in, so we
+// only ever use as much memory as the levels we have.
+struct StreamingTexture {
+  // Always the current image, which holds levels `idx_resident_mip` and up
+  ImageResources *image_resources;
+  VkFormat format;
+  // The size and number of levels of the full texture
+  u32 width;
+  u32 height;
+  u32 n_mip_levels;
+  u32 idx_resident_mip;
+  // The level we'd like to have, based on how far away the texture is
+  u32 idx_wanted_mip;
+  f32 distance;
+  // Every level's data, which has to stay around until we've streamed it. This
+  // either points into the asset pack or into `view`, which we then own.
+  u8 const *level_data[MAX_N_MIP_LEVELS];
+  VkDeviceSize level_sizes[MAX_N_MIP_LEVELS];
+  files::FileView view;
+};
+
+// An upload of a larger version of a `StreamingTexture`, running on the asset
+// queue while we keep rendering with the old one
+struct StreamingUpload {
+  StreamingTexture *texture;
+  ImageResources image_resources;
+  u32 idx_mip;
+  VkCommandBuffer command_buffer;
+  // We wait for the upload on the asset timeline if we have one, and on
+  // `fence` otherwise
+  VkFence fence;
+  u64 timeline_value;
+  VkBuffer staging_buffer;
+  VkDeviceMemory staging_buffer_memory;
+};
+
+struct VkState;
+
+// A render stage's pipelines being created on a worker thread, while the
+// main thread gets on with other things, see `vulkan_pipelines.cpp`
+struct PipelineBuild {
+  VkState *vk_state;
+  u32 idx_stage;
+  u32 permutation_key;
+  VkExtent2D extent;
+  VkPipeline pipelines[N_VERTEX_LAYOUTS];
+  bool did_succeed;
+};
+
+struct PipelineBuilds {
+  tasks::WorkerPool *worker_pool;
+  // So we only wait for our builds, and not for anything else on the pool
+  tasks::TaskGroup task_group;
+  PipelineBuild builds[N_PIPELINE_STAGES];
+  bool are_running;
+};
+
+// A render stage's pipelines being rebuilt on a worker thread, after its
+// shaders have changed
+struct PipelineRebuild {
+  VkState *vk_state;
+  u32 idx_stage;
+  u32 permutation_key;
+  VkExtent2D extent;
+  VkPipeline pipelines[N_VERTEX_LAYOUTS];
+  bool did_succeed;
+  // Set by the worker once `pipelines` and `did_succeed` are filled in
+  std::atomic<bool> is_done;
+  // Only touched by the main thread
+  bool is_running;
+  bool should_rebuild;
+};
+
+struct ShaderHotReload {
+  files::FileWatcher watcher;
+  tasks::WorkerPool *worker_pool;
+  tasks::TaskGroup task_group;
+  PipelineRebuild rebuilds[N_PIPELINE_STAGES];
+};
+
+enum class RetiredObjectType : u32 {
+  buffer,
+  device_memory,
+  image,
+  image_view,
+  sampler,
+  pipeline,
+  pipeline_layout,
+  render_pass,
+  framebuffer,
+  descriptor_set,
+  command_buffer,
+  swapchain,
+  swapchain_image_view,
+};
+
+// A Vulkan object that we're done with, but that frames in flight might still
+// be using, see `vulkan_deletion.cpp`
+struct RetiredObject {
+  RetiredObjectType type;
+  u64 handle;
+  // The pool that descriptor sets and command buffers go back to
+  u64 pool;
+  u64 retired_frame_number;
+  // With timeline semaphores, we can destroy the object once the graphics
+  // timeline reaches this, rather than waiting a set number of frames
+  u64 retired_timeline_value;
+};
+
+// A ring buffer of retired objects, oldest first
+struct DeletionQueue {
+  RetiredObject objects[MAX_N_RETIRED_OBJECTS];
+  u32 idx_head;
+  u32 n_objects;
 };
 
 struct BufferResources {
@@ -146,20 +511,180 @@ struct BufferResources {
   u32 n_items;
 };
 
-struct DrawableComponent {
+// All vertex and index data lives in these two big buffers, and meshes are
+// just ranges inside them. This means that a stage can bind its geometry once
+// and then only issue draws, which is also what indirect drawing wants.
+struct GeometryBuffer {
   BufferResources vertex;
   BufferResources index;
+  VkDeviceSize vertex_bytes_used;
+  VkDeviceSize index_bytes_used;
+};
+
+// A piece of geometry uploaded to the GPU. Each unique mesh is only uploaded
+// once, and drawables refer to it by its index in `VkState::meshes`.
+struct Mesh {
+  VertexLayout layout;
+  // Meshes with fewer than 65536 vertices get 16-bit indices
+  VkIndexType index_type;
+  // Offsets into `GeometryBuffer`, in units of vertices and indices, as
+  // `vkCmdDrawIndexed()` wants them
+  u32 vertex_offset;
+  u32 n_vertices;
+  u32 first_index;
+  u32 n_indices;
+  v3 position_scale;
+  v3 position_offset;
+  // Hash of the vertex and index data, used to find meshes we already have
+  u64 hash;
+};
+
+// Textures are referred to by their index in `VkState::bindless_textures`
+struct Material {
+  u32 idx_albedo_texture;
+};
+
+struct DrawableComponent {
+  u32 idx_mesh;
   RenderStageName target_render_stages;
+  // An index into `VkState::materials`. Without bindless textures, all
+  // drawables use the single set in `material_descriptor_sets` for now.
+  u32 idx_material;
   // `position` will go into SpatialComponent
   v3 position;
 };
 
+enum class DrawOrder : u32 { front_to_back, back_to_front };
+
+struct DrawCall {
+  u64 sort_key;
+  DrawableComponent *drawable;
+};
+
+// Consecutive draws in a sorted draw list that share a mesh and material,
+// drawn with a single instanced `vkCmdDrawIndexed()`.
+struct DrawBatch {
+  Mesh *mesh;
+  u32 idx_material;
+  u32 first_instance;
+  u32 n_instances;
+};
+
+struct DrawList {
+  DrawCall *draws;
+  u32 n_draws;
+  DrawBatch *batches;
+  u32 n_batches;
+};
+
+// Tracks what is currently bound on a command buffer, so that we can skip
+// `vkCmdBind*` calls that would not change anything.
+struct CommandState {
+  VkCommandBuffer command_buffer;
+  VkPipelineLayout pipeline_layout;
+  VkPipeline pipeline;
+  VkDescriptorSet descriptor_sets[N_DESCRIPTOR_SET_INDICES];
+  VkBuffer vertex_buffers[N_VERTEX_BINDINGS];
+  VkBuffer index_buffer;
+  VkIndexType index_type;
+  // From the bound pipeline's stage, and empty if its shaders don't read
+  // `DrawConstants`
+  VkPushConstantRange draw_constants_range;
+  bool has_draw_constants;
+  DrawConstants draw_constants;
+};
+
+// A stage's command buffer for one frame and swapchain image, which we keep
+// and submit again for as long as nothing it depends on changes, see
+// `recording::get_stage_command_buffer()`
+struct CachedCommandBuffer {
+  VkCommandBuffer command_buffer;
+  // The `CommandBufferCache::version` we recorded this at, or 0 if we never
+  // have
+  u64 version;
+};
+
+// A stage's pipelines for one set of values of its specialization constants.
+// What the key means is up to the stage, see its `create_pipelines()`.
+struct PipelineVariant {
+  u32 permutation_key;
+  VkPipeline pipelines[N_VERTEX_LAYOUTS];
+};
+
+struct RenderStage {
+  // Everything the stage's shaders declare, which we make its layouts from
+  ShaderReflection reflection;
+  VkRenderPass render_pass;
+  // Shared with any other stage whose layout is identical
+  VkPipelineLayout pipeline_layout;
+  // Empty if the stage's shaders don't read `DrawConstants`
+  VkPushConstantRange draw_constants_range;
+  // One pipeline per `VertexLayout`, or `VK_NULL_HANDLE` if the stage doesn't
+  // support that layout. These are the current variant's, and belong to it.
+  VkPipeline pipelines[N_VERTEX_LAYOUTS];
+  // The variant we want, which `pipelines::update_variants()` switches to
+  u32 permutation_key;
+  // Every variant we've built since the stage's pipelines were last rebuilt,
+  // so that switching back to one doesn't mean compiling it again
+  PipelineVariant variants[MAX_N_PIPELINE_VARIANTS];
+  u32 n_variants;
+  u32 idx_current_variant;
+  VkFramebuffer framebuffers[MAX_N_SWAPCHAIN_IMAGES];
+  VkSemaphore render_finished_semaphore;
+  // The graphics timeline value that the stage's last submission signals
+  u64 timeline_value;
+  VkDescriptorSetLayout stage_descriptor_set_layout;
+  // How many bindings the stage's shaders use from its descriptor set
+  u32 n_stage_descriptors;
+  // Allocated anew every frame from that frame's `descriptor_allocator`
+  VkDescriptorSet stage_descriptor_sets[N_PARALLEL_FRAMES];
+  CachedCommandBuffer cached_command_buffers[N_PARALLEL_FRAMES][MAX_N_SWAPCHAIN_IMAGES];
+  DrawList draw_list;
+};
+
+// Some of a stage's draw batches, along with everything we bind before them.
+// When recording in parallel, each job gets recorded into its own secondary
+// command buffer on a worker thread.
+struct RecordingJob {
+  RenderStage *render_stage;
+  GeometryBuffer *geometry_buffer;
+  VkBuffer instance_buffer;
+  VkDescriptorSet descriptor_sets[N_DESCRIPTOR_SET_INDICES];
+  VkCommandBuffer command_buffer;
+  // Only used for secondary command buffers
+  VkCommandBufferInheritanceInfo inheritance_info;
+  u32 idx_first_batch;
+  u32 n_batches;
+};
+
+struct CommandBufferCache {
+  bool is_enabled;
+  // Goes up every time something changes that recorded command buffers
+  // depend on, which makes every cached one dirty
+  u64 version;
+  // The version each frame's descriptor sets were made at. Cached command
+  // buffers use them, so we can't make new ones until we record again.
+  u64 descriptor_versions[N_PARALLEL_FRAMES];
+  // The view we recorded with, since our draw order depends on it
+  m4 view;
+};
+
+struct ParallelRecording {
+  tasks::WorkerPool *worker_pool;
+  tasks::TaskGroup task_group;
+  // At most `MAX_N_RECORDING_JOBS`, and 1 if we record everything on the main
+  // thread
+  u32 n_max_jobs;
+  RecordingJob jobs[MAX_N_RECORDING_JOBS];
+};
+
 struct VkState {
   // General Vulkan stuff
   VkInstance instance;
   VkDebugUtilsMessengerEXT debug_messenger;
   VkPhysicalDevice physical_device;
   VkPhysicalDeviceProperties physical_device_properties;
+  VkPhysicalDeviceFeatures physical_device_features;
   QueueFamilyIndices queue_family_indices;
   u32 n_queue_families;
   VkQueueFamilyProperties queue_families[MAX_N_QUEUE_FAMILIES];
@@ -167,17 +692,42 @@ struct VkState {
   VkDevice device;
   VkQueue graphics_queue;
   VkQueue present_queue;
+  // Uploads that run while we render go here. This comes from the transfer
+  // family if there is one, in which case images we upload have to be handed
+  // over to the graphics family.
   VkQueue asset_queue;
+  u32 asset_queue_family;
+  // Nothing runs on this yet, but it comes from a compute family without
+  // graphics if there is one, so compute work can overlap rendering
+  VkQueue compute_queue;
+  u32 compute_queue_family;
   VkSurfaceKHR surface;
-  VkDescriptorPool descriptor_pool;
+  // For sets that live as long as we do, which we get through the cache
+  DescriptorAllocator descriptor_allocator;
+  u32 n_cached_descriptor_sets;
+  CachedDescriptorSet cached_descriptor_sets[MAX_N_CACHED_DESCRIPTOR_SETS];
+  // Layouts we've made from shader reflection, shared by everything that
+  // needs an identical one, see `layouts::get_descriptor_set_layout()`
+  u32 n_cached_descriptor_set_layouts;
+  CachedDescriptorSetLayout cached_descriptor_set_layouts[MAX_N_CACHED_LAYOUTS];
+  u32 n_cached_pipeline_layouts;
+  CachedPipelineLayout cached_pipeline_layouts[MAX_N_CACHED_LAYOUTS];
+  // How many bindings our shaders use from the global and entity sets
+  u32 n_global_descriptors;
+  u32 n_entity_descriptors;
   VkDescriptorSetLayout global_descriptor_set_layout;
   VkDescriptorSet global_descriptor_sets[N_PARALLEL_FRAMES];
   VkDescriptorSetLayout material_descriptor_set_layout;
   VkDescriptorSet material_descriptor_sets[N_PARALLEL_FRAMES];
   VkDescriptorSetLayout entity_descriptor_set_layout;
   VkDescriptorSet entity_descriptor_sets[N_PARALLEL_FRAMES];
+  // For one-off commands, like uploads. Frames get their command buffers from
+  // their own pools, see `FrameResources::command_pool`.
   VkCommandPool command_pool;
   VkCommandPool asset_command_pool;
+  // Shared by every pipeline we create, and saved to `PIPELINE_CACHE_PATH`
+  // between runs
+  VkPipelineCache pipeline_cache;
 
   // Swapchain stuff
   VkSwapchainKHR swapchain;
@@ -190,13 +740,50 @@ struct VkState {
   FrameResources frame_resources[N_PARALLEL_FRAMES];
 
   // Scene resources
+  // Cooked assets, if we have them, see `pack.hpp`
+  pack::Pack asset_pack;
+  GeometryBuffer geometry_buffer;
+  u32 n_meshes;
+  Mesh meshes[MAX_N_MESHES];
   u32 n_entities;
   DrawableComponent drawable_components[MAX_N_ENTITIES];
   ImageResources dummy_image;
   ImageResources alpaca;
+  u32 n_materials;
+  Material materials[MAX_N_MATERIALS];
+
+  // Bindless textures
+  // Set if the device can index into an array of textures with a per-instance
+  // index, in which case every texture in `bindless_textures` is in the global
+  // descriptor set, and draws don't need a different set per material
+  bool is_bindless_enabled;
+  // How many textures fit in the global set within the device's limits
+  u32 n_max_bindless_textures;
+  u32 n_bindless_textures;
+  // Pointers, so that we pick up texture views that change as they stream in
+  ImageResources *bindless_textures[MAX_N_BINDLESS_TEXTURES];
+
+  // Texture streaming
+  u32 n_streaming_textures;
+  StreamingTexture streaming_textures[MAX_N_STREAMING_TEXTURES];
+  bool is_streaming_upload_running;
+  StreamingUpload streaming_upload;
+
+  // Timeline semaphores
+  // Set if the device has timeline semaphores, in which case we track how far
+  // the GPU has got with these rather than with fences
+  bool is_timeline_semaphore_enabled;
+  Timeline graphics_timeline;
+  Timeline asset_timeline;
 
   // Rendering resources and information
   u32 idx_frame;
+  // Counts every frame we've started, unlike `idx_frame`, which wraps around
+  u64 frame_number;
+  // Objects we're done with, which we destroy once no frame is using them
+  DeletionQueue deletion_queue;
+  // Reset at the start of every frame, used for draw lists and such
+  MemoryPool frame_memory_pool;
   ImageResources depthbuffer;
   ImageResources g_position;
   ImageResources g_normal;
@@ -207,6 +794,24 @@ struct VkState {
   RenderStage geometry_stage;
   RenderStage lighting_stage;
   RenderStage forward_stage;
+
+  // Splits stages' draws across worker threads
+  ParallelRecording parallel_recording;
+  // Keeps stages' command buffers around for static scenes
+  CommandBufferCache command_buffer_cache;
+
+  // Pipelines for all stages, built in parallel when we make the swapchain
+  PipelineBuilds pipeline_builds;
+  // The last debug view we were asked for. We only change the lighting
+  // stage's permutation key when this changes, so that if we can't build a
+  // variant, we don't try again every frame.
+  LightingDebugView lighting_debug_view;
+
+  // Shader hot reloading
+  ShaderHotReload shader_hot_reload;
+  // Set once we've reloaded a shader, after which the loose shader files are
+  // newer than the ones in the asset pack
+  bool should_skip_packed_shaders;
 };
 
 namespace vulkan {
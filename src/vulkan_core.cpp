@@ -83,7 +83,7 @@ namespace vulkan::core {
   }
 
 
-  static void init_swapchain(VkState *vk_state, GLFWwindow *window, VkExtent2D *extent) {
+  static void init_swapchain(VkState *vk_state, GLFWwindow *window, VkExtent2D *extent, VkSwapchainKHR old_swapchain) {
     // Create the swapchain itself
     SwapchainSupportDetails *details       = &vk_state->swapchain_support_details;
     VkSurfaceCapabilitiesKHR *capabilities = &details->capabilities;
@@ -115,8 +115,9 @@ namespace vulkan::core {
       .presentMode      = present_mode,
       // We don't care about the colors of pixels obscured by other windows.
       .clipped          = VK_TRUE,
-      // We're not recreating an old swapchain.
-      .oldSwapchain     = VK_NULL_HANDLE,
+      // If we're recreating the swapchain, the old one can hand over its
+      // resources. We still have to destroy it ourselves.
+      .oldSwapchain     = old_swapchain,
     };
 
     u32 const queue_family_indices[] = {(u32)indices->graphics, (u32)indices->present};
@@ -281,7 +282,9 @@ namespace vulkan::core {
       .applicationVersion = VK_MAKE_VERSION(1, 0, 0),
       .pEngineName        = "peony",
       .engineVersion      = VK_MAKE_VERSION(1, 0, 0),
-      .apiVersion         = VK_API_VERSION_1_0,
+      // We need 1.2 for descriptor indexing, but we still run on devices that
+      // only have 1.0, just without bindless textures
+      .apiVersion         = VK_API_VERSION_1_2,
     };
 
     // Initialise other creation parameters such as required extensions
@@ -320,44 +323,60 @@ namespace vulkan::core {
     VkQueueFamilyProperties *queue_families,
     VkSurfaceKHR surface
   ) {
+    // We take the first family that fits each role, except that we'd rather
+    // present from the graphics family, so that it can all be one queue. The
+    // transfer and compute families are only for ones without graphics, which
+    // can run alongside rendering, and we'd rather have a transfer family
+    // that can only do transfers, since that's usually a dedicated DMA engine.
     QueueFamilyIndices indices = {
       .graphics = NO_QUEUE_FAMILY,
       .present  = NO_QUEUE_FAMILY,
       .transfer = NO_QUEUE_FAMILY,
+      .compute  = NO_QUEUE_FAMILY,
     };
     vkGetPhysicalDeviceQueueFamilyProperties(physical_device, n_queue_families, nullptr);
     assert(*n_queue_families <= MAX_N_QUEUE_FAMILIES);
     vkGetPhysicalDeviceQueueFamilyProperties(physical_device, n_queue_families, queue_families);
 
+    i64 transfer_with_compute = NO_QUEUE_FAMILY;
     range (0, *n_queue_families) {
-      VkQueueFamilyProperties *family = &queue_families[idx];
+      VkQueueFlags const flags = queue_families[idx].queueFlags;
       VkBool32 supports_present = false;
       vkGetPhysicalDeviceSurfaceSupportKHR(physical_device, idx, surface, &supports_present);
+      bool const is_graphics = flags & VK_QUEUE_GRAPHICS_BIT;
+      bool const is_compute = flags & VK_QUEUE_COMPUTE_BIT;
       // Graphics queue
-      if (family->queueFlags & VK_QUEUE_GRAPHICS_BIT) {
+      if (is_graphics && indices.graphics == NO_QUEUE_FAMILY) {
         indices.graphics = idx;
       }
       // Present queue
-      if (supports_present) {
+      if (supports_present && (indices.present == NO_QUEUE_FAMILY || (is_graphics && idx == indices.graphics))) {
         indices.present = idx;
       }
       // Transfer queue
-      // NOTE: This check might be too restrictive
-      if (
-        family->queueFlags & VK_QUEUE_TRANSFER_BIT &&
-        !(family->queueFlags & VK_QUEUE_GRAPHICS_BIT) &&
-        !(supports_present)
-      ) {
-        indices.transfer = idx;
+      if (flags & VK_QUEUE_TRANSFER_BIT && !is_graphics) {
+        if (!is_compute && indices.transfer == NO_QUEUE_FAMILY) {
+          indices.transfer = idx;
+        } else if (is_compute && transfer_with_compute == NO_QUEUE_FAMILY) {
+          transfer_with_compute = idx;
+        }
+      }
+      // Compute queue
+      if (is_compute && !is_graphics && indices.compute == NO_QUEUE_FAMILY) {
+        indices.compute = idx;
       }
     }
+    if (indices.transfer == NO_QUEUE_FAMILY) {
+      indices.transfer = transfer_with_compute;
+    }
 
     return indices;
   }
 
 
   static bool are_queue_family_indices_complete(QueueFamilyIndices indices) {
-    // We don't need the transfer family right now!
+    // We can do without the transfer and compute families, by taking those
+    // queues from the graphics family instead
     return indices.graphics != NO_QUEUE_FAMILY &&
       indices.present != NO_QUEUE_FAMILY;
   }
@@ -400,6 +419,7 @@ namespace vulkan::core {
     logs::info("    graphics: %d", queue_family_indices.graphics);
     logs::info("    present: %d", queue_family_indices.present);
     logs::info("    transfer: %d", queue_family_indices.transfer);
+    logs::info("    compute: %d", queue_family_indices.compute);
     logs::info("  Swap chain support");
     logs::info("    Capabilities");
     logs::info("      minImageCount: %d", swapchain_support_details->capabilities.minImageCount);
@@ -425,13 +445,15 @@ namespace vulkan::core {
   static void print_logical_device_info(
     VkQueue graphics_queue,
     VkQueue present_queue,
-    VkQueue asset_queue
+    VkQueue asset_queue,
+    VkQueue compute_queue
   ) {
     logs::info("Logical device:");
     logs::info("  Queues");
     logs::info("    graphics_queue: %d", graphics_queue);
     logs::info("    present_queue: %d", present_queue);
     logs::info("    asset_queue: %d", asset_queue);
+    logs::info("    compute_queue: %d", compute_queue);
   }
 
 
@@ -473,6 +495,112 @@ namespace vulkan::core {
   }
 
 
+  static VkPhysicalDeviceDescriptorIndexingFeatures get_bindless_descriptor_indexing_features() {
+    // What we need to put all our textures in one array that shaders index
+    // with a per-instance index, leaving the slots we don't use empty
+    return {
+      .sType                                     = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_DESCRIPTOR_INDEXING_FEATURES,
+      .shaderSampledImageArrayNonUniformIndexing = VK_TRUE,
+      .descriptorBindingPartiallyBound           = VK_TRUE,
+      .descriptorBindingVariableDescriptorCount  = VK_TRUE,
+      .runtimeDescriptorArray                    = VK_TRUE,
+    };
+  }
+
+
+  static bool is_bindless_supported(VkPhysicalDevice physical_device, VkPhysicalDeviceProperties const *properties) {
+    if (properties->apiVersion < VK_API_VERSION_1_2) {
+      logs::info("Bindless textures not supported, the device only has Vulkan %d.%d",
+        VK_VERSION_MAJOR(properties->apiVersion), VK_VERSION_MINOR(properties->apiVersion));
+      return false;
+    }
+    VkPhysicalDeviceDescriptorIndexingFeatures descriptor_indexing_features = {
+      .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_DESCRIPTOR_INDEXING_FEATURES,
+    };
+    VkPhysicalDeviceFeatures2 features = {
+      .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_FEATURES_2,
+      .pNext = &descriptor_indexing_features,
+    };
+    vkGetPhysicalDeviceFeatures2(physical_device, &features);
+    bool const is_supported =
+      descriptor_indexing_features.shaderSampledImageArrayNonUniformIndexing &&
+      descriptor_indexing_features.descriptorBindingPartiallyBound &&
+      descriptor_indexing_features.descriptorBindingVariableDescriptorCount &&
+      descriptor_indexing_features.runtimeDescriptorArray;
+    if (!is_supported) {
+      logs::info("Bindless textures not supported, the device is missing descriptor indexing features");
+    }
+    return is_supported;
+  }
+
+
+  static bool is_timeline_semaphore_supported(
+    VkPhysicalDevice physical_device, VkPhysicalDeviceProperties const *properties
+  ) {
+    // Timeline semaphores are core from Vulkan 1.2, which is all we ask for
+    // when making our instance, so we don't bother with the extension
+    if (properties->apiVersion < VK_API_VERSION_1_2) {
+      logs::info("Timeline semaphores not supported, the device only has Vulkan %d.%d",
+        VK_VERSION_MAJOR(properties->apiVersion), VK_VERSION_MINOR(properties->apiVersion));
+      return false;
+    }
+    VkPhysicalDeviceTimelineSemaphoreFeatures timeline_semaphore_features = {
+      .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_TIMELINE_SEMAPHORE_FEATURES,
+    };
+    VkPhysicalDeviceFeatures2 features = {
+      .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_FEATURES_2,
+      .pNext = &timeline_semaphore_features,
+    };
+    vkGetPhysicalDeviceFeatures2(physical_device, &features);
+    if (!timeline_semaphore_features.timelineSemaphore) {
+      logs::info("Timeline semaphores not supported by the device");
+    }
+    return timeline_semaphore_features.timelineSemaphore;
+  }
+
+
+  // The features we turn on beyond `VkPhysicalDeviceFeatures`, if we've found
+  // the device has them, which go into `VkDeviceCreateInfo::pNext`
+  struct DeviceFeatureChain {
+    VkPhysicalDeviceDescriptorIndexingFeatures descriptor_indexing;
+    VkPhysicalDeviceTimelineSemaphoreFeatures timeline_semaphore;
+  };
+
+
+  static void* init_device_feature_chain(VkState *vk_state, DeviceFeatureChain *chain) {
+    void *next = nullptr;
+    if (vk_state->is_timeline_semaphore_enabled) {
+      chain->timeline_semaphore = {
+        .sType             = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_TIMELINE_SEMAPHORE_FEATURES,
+        .pNext             = next,
+        .timelineSemaphore = VK_TRUE,
+      };
+      next = &chain->timeline_semaphore;
+    }
+    if (vk_state->is_bindless_enabled) {
+      chain->descriptor_indexing = get_bindless_descriptor_indexing_features();
+      chain->descriptor_indexing.pNext = next;
+      next = &chain->descriptor_indexing;
+    }
+    return next;
+  }
+
+
+  static u32 get_max_bindless_textures(VkPhysicalDeviceProperties const *properties) {
+    // The texture table shares the fragment stage with the stage sets' own
+    // textures, so we leave room for those
+    VkPhysicalDeviceLimits const *limits = &properties->limits;
+    u32 const max_stage_textures = min(limits->maxPerStageDescriptorSamplers,
+      limits->maxPerStageDescriptorSampledImages);
+    u32 const max_set_textures = min(limits->maxDescriptorSetSamplers, limits->maxDescriptorSetSampledImages);
+    u32 const max_textures = min(max_stage_textures, max_set_textures);
+    if (max_textures <= MAX_N_DESCRIPTOR_BINDINGS) {
+      return 0;
+    }
+    return min(max_textures - MAX_N_DESCRIPTOR_BINDINGS, MAX_N_BINDLESS_TEXTURES);
+  }
+
+
   static void init_physical_device(VkState *vk_state) {
     vk_state->physical_device = VK_NULL_HANDLE;
 
@@ -513,134 +641,118 @@ namespace vulkan::core {
 
     vkGetPhysicalDeviceProperties(vk_state->physical_device,
       &vk_state->physical_device_properties);
+    vkGetPhysicalDeviceFeatures(vk_state->physical_device,
+      &vk_state->physical_device_features);
+    logs::info("Texture compression support: BC %d, ASTC LDR %d, ETC2 %d",
+      vk_state->physical_device_features.textureCompressionBC,
+      vk_state->physical_device_features.textureCompressionASTC_LDR,
+      vk_state->physical_device_features.textureCompressionETC2);
+
+    vk_state->n_max_bindless_textures = get_max_bindless_textures(&vk_state->physical_device_properties);
+    vk_state->is_bindless_enabled = vk_state->n_max_bindless_textures > 0 &&
+      is_bindless_supported(vk_state->physical_device, &vk_state->physical_device_properties);
+    if (vk_state->is_bindless_enabled) {
+      logs::info("Using bindless textures, with up to %d textures", vk_state->n_max_bindless_textures);
+    }
+
+    vk_state->is_timeline_semaphore_enabled = USE_TIMELINE_SEMAPHORES &&
+      is_timeline_semaphore_supported(vk_state->physical_device, &vk_state->physical_device_properties);
+    if (vk_state->is_timeline_semaphore_enabled) {
+      logs::info("Using timeline semaphores");
+    }
   }
 
 
-  static void init_logical_device(VkState *vk_state) {
-    f32 const queue_priorities[3] = {1.0f, 1.0f, 1.0f};
-
-    if (vk_state->n_queue_families == 1) {
-      // If we only have a single queue family, we need to take all of our queues out of that family
-      if (vk_state->queue_families[0].queueCount == 1) {
-        // If we have a single queue family and only a single queue in it, we're in a super annoying situation :(
-        // This happens on Intel integrated GPUs
-        // In this case, all our queues are just the same one single queue that we can make
-        // This means we can't submit to queues from multiple threads...oof!!!
-        VkDeviceQueueCreateInfo queue_infos[1] = {
-          {
-            .sType            = VK_STRUCTURE_TYPE_DEVICE_QUEUE_CREATE_INFO,
-            .queueFamilyIndex = (u32)vk_state->queue_family_indices.graphics,
-            .queueCount       = 1,
-            .pQueuePriorities = queue_priorities,
-          },
-        };
-        VkPhysicalDeviceFeatures const device_features = {.samplerAnisotropy = VK_TRUE};
-        VkDeviceCreateInfo const device_info = {
-          .sType                   = VK_STRUCTURE_TYPE_DEVICE_CREATE_INFO,
-          .queueCreateInfoCount    = 1,
-          .pQueueCreateInfos       = queue_infos,
-          .enabledExtensionCount   = (u32)REQUIRED_DEVICE_EXTENSIONS.size(),
-          .ppEnabledExtensionNames = REQUIRED_DEVICE_EXTENSIONS.data(),
-          .pEnabledFeatures        = &device_features,
-        };
-
-        vkutils::check(vkCreateDevice(vk_state->physical_device, &device_info, nullptr, &vk_state->device));
-
-        VkQueue our_only_queue_oof;
-        // A single queue, from the graphics queue family
-        vkGetDeviceQueue(vk_state->device, (u32)vk_state->queue_family_indices.graphics, 0, &our_only_queue_oof);
-        vk_state->graphics_queue = our_only_queue_oof;
-        vk_state->present_queue = our_only_queue_oof;
-        vk_state->asset_queue = our_only_queue_oof;
-      } else {
-        // If we have a single queue family but we can make multiple queues out of it, just make all of our queues here
-        VkDeviceQueueCreateInfo queue_infos[1] = {
-          {
-            .sType            = VK_STRUCTURE_TYPE_DEVICE_QUEUE_CREATE_INFO,
-            .queueFamilyIndex = (u32)vk_state->queue_family_indices.graphics,
-            .queueCount       = 3,
-            .pQueuePriorities = queue_priorities,
-          },
-        };
-        VkPhysicalDeviceFeatures const device_features = {.samplerAnisotropy = VK_TRUE};
-        VkDeviceCreateInfo const device_info = {
-          .sType                   = VK_STRUCTURE_TYPE_DEVICE_CREATE_INFO,
-          .queueCreateInfoCount    = 1,
-          .pQueueCreateInfos       = queue_infos,
-          .enabledExtensionCount   = (u32)REQUIRED_DEVICE_EXTENSIONS.size(),
-          .ppEnabledExtensionNames = REQUIRED_DEVICE_EXTENSIONS.data(),
-          .pEnabledFeatures        = &device_features,
-        };
-
-        vkutils::check(vkCreateDevice(vk_state->physical_device, &device_info, nullptr, &vk_state->device));
-        // Graphics queue from the graphics queue family
-        vkGetDeviceQueue(vk_state->device, (u32)vk_state->queue_family_indices.graphics, 0, &vk_state->graphics_queue);
-        // Present queue, also from the graphics queue family
-        vkGetDeviceQueue(vk_state->device, (u32)vk_state->queue_family_indices.graphics, 0, &vk_state->present_queue);
-        // Asset queue, also from the graphics queue family
-        vkGetDeviceQueue(vk_state->device, (u32)vk_state->queue_family_indices.graphics, 0, &vk_state->asset_queue);
-      }
-    } else {
-      // If we support multiple queue families, we can just get all of our queues out of the respective family
+  static VkPhysicalDeviceFeatures get_enabled_device_features(VkState *vk_state) {
+    // Anisotropy is required, but we turn on whatever texture compression
+    // the device has, and pick texture formats based on that later
+    VkPhysicalDeviceFeatures const *supported_features = &vk_state->physical_device_features;
+    return {
+      .samplerAnisotropy          = VK_TRUE,
+      .textureCompressionETC2     = supported_features->textureCompressionETC2,
+      .textureCompressionASTC_LDR = supported_features->textureCompressionASTC_LDR,
+      .textureCompressionBC       = supported_features->textureCompressionBC,
+    };
+  }
 
-      // We don't currently handle the case if somehow the graphics family and the present family is the same
-      if ((u32)vk_state->queue_family_indices.graphics == (u32)vk_state->queue_family_indices.present) {
-        logs::error("We have an as of yet unsupported queue arrangement, this should be fixed in the code here");
-      }
 
-      VkDeviceQueueCreateInfo queue_infos[2] = {
-        // Graphics and asset queues
-        {
-          .sType            = VK_STRUCTURE_TYPE_DEVICE_QUEUE_CREATE_INFO,
-          .queueFamilyIndex = (u32)vk_state->queue_family_indices.graphics,
-          .queueCount       = 2,
-          .pQueuePriorities = queue_priorities,
-        },
-        // Present queue
-        {
-          .sType            = VK_STRUCTURE_TYPE_DEVICE_QUEUE_CREATE_INFO,
-          .queueFamilyIndex = (u32)vk_state->queue_family_indices.present,
-          .queueCount       = 1,
-          .pQueuePriorities = queue_priorities,
-        },
-      };
-      VkPhysicalDeviceFeatures const device_features = {.samplerAnisotropy = VK_TRUE};
-      VkDeviceCreateInfo const device_info = {
-        .sType                   = VK_STRUCTURE_TYPE_DEVICE_CREATE_INFO,
-        .queueCreateInfoCount    = 2,
-        .pQueueCreateInfos       = queue_infos,
-        .enabledExtensionCount   = (u32)REQUIRED_DEVICE_EXTENSIONS.size(),
-        .ppEnabledExtensionNames = REQUIRED_DEVICE_EXTENSIONS.data(),
-        .pEnabledFeatures        = &device_features,
-      };
+  // Gets the index of a new queue out of `family`, counting it in
+  // `n_family_queues`. If we've already taken as many queues out of the family
+  // as it has, we share the last one instead.
+  static u32 take_queue(VkState *vk_state, u32 family, u32 *n_family_queues) {
+    u32 const n_available_queues = vk_state->queue_families[family].queueCount;
+    u32 const idx_queue = min(n_family_queues[family], n_available_queues - 1);
+    n_family_queues[family] = min(n_family_queues[family] + 1, n_available_queues);
+    return idx_queue;
+  }
 
-      vkutils::check(vkCreateDevice(vk_state->physical_device, &device_info, nullptr, &vk_state->device));
-      // Graphics queue from the graphics queue family
-      vkGetDeviceQueue(vk_state->device, (u32)vk_state->queue_family_indices.graphics, 0, &vk_state->graphics_queue);
-      // Present queue from the present queue family
-      vkGetDeviceQueue(vk_state->device, (u32)vk_state->queue_family_indices.present, 0, &vk_state->present_queue);
-      // Asset queue from the graphics queue family (because the graphics queue family can do everything)
-      vkGetDeviceQueue(vk_state->device, (u32)vk_state->queue_family_indices.graphics, 1, &vk_state->asset_queue);
+
+  static void init_logical_device(VkState *vk_state) {
+    // We want our own queue for rendering, for uploads and for compute, so
+    // that uploads and compute can overlap rendering. Uploads and compute get
+    // their own families if the device has them, which is what lets them
+    // really run at the same time. Otherwise they get their own queues from
+    // the graphics family, and if there aren't enough of those, like on
+    // Intel integrated GPUs, which have a single queue, they all share one.
+    // We present from the graphics queue if the graphics family can present.
+    // When queues end up being the same one, submitting to it has to be
+    // externally synchronized, which holds because we only ever submit from
+    // the main thread. A shared queue then just runs uploads and rendering in
+    // the order we submit them, which our barriers and waits already handle.
+    QueueFamilyIndices const *indices = &vk_state->queue_family_indices;
+    u32 const graphics_family = (u32)indices->graphics;
+    u32 const present_family = (u32)indices->present;
+    vk_state->asset_queue_family = indices->transfer != NO_QUEUE_FAMILY ? (u32)indices->transfer : graphics_family;
+    vk_state->compute_queue_family = indices->compute != NO_QUEUE_FAMILY ? (u32)indices->compute : graphics_family;
+
+    u32 n_family_queues[MAX_N_QUEUE_FAMILIES] = {};
+    u32 const idx_graphics_queue = take_queue(vk_state, graphics_family, n_family_queues);
+    u32 const idx_present_queue = present_family == graphics_family ?
+      idx_graphics_queue : take_queue(vk_state, present_family, n_family_queues);
+    u32 const idx_asset_queue = take_queue(vk_state, vk_state->asset_queue_family, n_family_queues);
+    u32 const idx_compute_queue = take_queue(vk_state, vk_state->compute_queue_family, n_family_queues);
+
+    f32 const queue_priorities[N_DEVICE_QUEUES] = {1.0f, 1.0f, 1.0f, 1.0f};
+    VkDeviceQueueCreateInfo queue_infos[N_DEVICE_QUEUES];
+    u32 n_queue_infos = 0;
+    range (0, vk_state->n_queue_families) {
+      if (n_family_queues[idx] == 0) {
+        continue;
+      }
+      assert(n_family_queues[idx] <= LEN(queue_priorities));
+      queue_infos[n_queue_infos++] = {
+        .sType            = VK_STRUCTURE_TYPE_DEVICE_QUEUE_CREATE_INFO,
+        .queueFamilyIndex = idx,
+        .queueCount       = n_family_queues[idx],
+        .pQueuePriorities = queue_priorities,
+      };
     }
 
-    print_logical_device_info(vk_state->graphics_queue, vk_state->present_queue, vk_state->asset_queue);
-  }
+    VkPhysicalDeviceFeatures const device_features = get_enabled_device_features(vk_state);
+    DeviceFeatureChain feature_chain;
+    VkDeviceCreateInfo const device_info = {
+      .sType                   = VK_STRUCTURE_TYPE_DEVICE_CREATE_INFO,
+      .pNext                   = init_device_feature_chain(vk_state, &feature_chain),
+      .queueCreateInfoCount    = n_queue_infos,
+      .pQueueCreateInfos       = queue_infos,
+      .enabledExtensionCount   = (u32)REQUIRED_DEVICE_EXTENSIONS.size(),
+      .ppEnabledExtensionNames = REQUIRED_DEVICE_EXTENSIONS.data(),
+      .pEnabledFeatures        = &device_features,
+    };
+    vkutils::check(vkCreateDevice(vk_state->physical_device, &device_info, nullptr, &vk_state->device));
 
+    vkGetDeviceQueue(vk_state->device, graphics_family, idx_graphics_queue, &vk_state->graphics_queue);
+    vkGetDeviceQueue(vk_state->device, present_family, idx_present_queue, &vk_state->present_queue);
+    vkGetDeviceQueue(vk_state->device, vk_state->asset_queue_family, idx_asset_queue, &vk_state->asset_queue);
+    vkGetDeviceQueue(vk_state->device, vk_state->compute_queue_family, idx_compute_queue, &vk_state->compute_queue);
 
-  static void init_surface(VkState *vk_state, GLFWwindow *window) {
-    vkutils::check(glfwCreateWindowSurface(vk_state->instance, window, nullptr, &vk_state->surface));
+    print_logical_device_info(vk_state->graphics_queue, vk_state->present_queue, vk_state->asset_queue,
+      vk_state->compute_queue);
   }
 
 
-  static void init_descriptor_pool(VkState *vk_state) {
-    constexpr u32 n_max_sets = 1000;
-    constexpr VkDescriptorPoolSize descriptor_pool_sizes[] = {
-      vkutils::descriptor_pool_size(VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, 100),
-      vkutils::descriptor_pool_size(VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, 100),
-    };
-    auto const pool_info = vkutils::descriptor_pool_create_info(n_max_sets, LEN(descriptor_pool_sizes),
-      descriptor_pool_sizes);
-    vkutils::check(vkCreateDescriptorPool(vk_state->device, &pool_info, nullptr, &vk_state->descriptor_pool));
+  static void init_surface(VkState *vk_state, GLFWwindow *window) {
+    vkutils::check(glfwCreateWindowSurface(vk_state->instance, window, nullptr, &vk_state->surface));
   }
 
 
@@ -649,13 +761,11 @@ namespace vulkan::core {
     init_surface(vk_state, window);
     init_physical_device(vk_state);
     init_logical_device(vk_state);
-    init_descriptor_pool(vk_state);
-    init_swapchain(vk_state, window, extent);
+    init_swapchain(vk_state, window, extent, VK_NULL_HANDLE);
   }
 
 
   static void destroy(VkState *vk_state) {
-    vkDestroyDescriptorPool(vk_state->device, vk_state->descriptor_pool, nullptr);
     vkDestroyDevice(vk_state->device, nullptr);
     if (USE_VALIDATION) {
       core::DestroyDebugUtilsMessengerEXT(vk_state->instance, vk_state->debug_messenger, nullptr);
@@ -0,0 +1,224 @@
+/*
+  Destroys Vulkan objects once the GPU is done with them, rather than waiting
+  for the whole device to go idle.
+
+  An object that's retired during frame N might still be used by that frame
+  and the ones before it that are still in flight. By the time we start frame
+  N + N_PARALLEL_FRAMES, we've waited on frame N's fence, so nothing can be
+  using it anymore.
+
+  With timeline semaphores, we can do better. Anything we submit after
+  retiring an object uses whatever replaced it, so once the graphics timeline
+  reaches the last value we'd submitted when we retired it, it's free to go.
+
+  That doesn't work for the swapchain and its image views, though, because
+  the presentation engine can still be using them after the last frame that
+  rendered to them is done, and it doesn't signal our timeline. We keep those
+  until a frame that presented to the new swapchain has completed, which is
+  the frame after the one we retired them in, at the latest.
+*/
+
+#include "vulkan.hpp"
+#include "vkutils.hpp"
+#include "logs.hpp"
+
+
+namespace vulkan::deletion {
+  static void destroy_object(VkState *vk_state, RetiredObject const *object) {
+    VkDevice const device = vk_state->device;
+    switch (object->type) {
+      case RetiredObjectType::buffer:
+        vkDestroyBuffer(device, (VkBuffer)object->handle, nullptr);
+        break;
+      case RetiredObjectType::device_memory:
+        vkFreeMemory(device, (VkDeviceMemory)object->handle, nullptr);
+        break;
+      case RetiredObjectType::image:
+        vkDestroyImage(device, (VkImage)object->handle, nullptr);
+        break;
+      case RetiredObjectType::image_view:
+      case RetiredObjectType::swapchain_image_view:
+        vkDestroyImageView(device, (VkImageView)object->handle, nullptr);
+        break;
+      case RetiredObjectType::sampler:
+        vkDestroySampler(device, (VkSampler)object->handle, nullptr);
+        break;
+      case RetiredObjectType::pipeline:
+        vkDestroyPipeline(device, (VkPipeline)object->handle, nullptr);
+        break;
+      case RetiredObjectType::pipeline_layout:
+        vkDestroyPipelineLayout(device, (VkPipelineLayout)object->handle, nullptr);
+        break;
+      case RetiredObjectType::render_pass:
+        vkDestroyRenderPass(device, (VkRenderPass)object->handle, nullptr);
+        break;
+      case RetiredObjectType::framebuffer:
+        vkDestroyFramebuffer(device, (VkFramebuffer)object->handle, nullptr);
+        break;
+      case RetiredObjectType::descriptor_set: {
+        VkDescriptorSet const descriptor_set = (VkDescriptorSet)object->handle;
+        vkFreeDescriptorSets(device, (VkDescriptorPool)object->pool, 1, &descriptor_set);
+        break;
+      }
+      case RetiredObjectType::command_buffer: {
+        VkCommandBuffer const command_buffer = (VkCommandBuffer)(uintptr_t)object->handle;
+        vkFreeCommandBuffers(device, (VkCommandPool)object->pool, 1, &command_buffer);
+        break;
+      }
+      case RetiredObjectType::swapchain:
+        vkDestroySwapchainKHR(device, (VkSwapchainKHR)object->handle, nullptr);
+        break;
+    }
+  }
+
+
+  static bool is_used_for_presenting(RetiredObject const *object) {
+    return object->type == RetiredObjectType::swapchain || object->type == RetiredObjectType::swapchain_image_view;
+  }
+
+
+  static bool is_unused(VkState *vk_state, RetiredObject const *object, u64 completed_timeline_value) {
+    if (is_used_for_presenting(object)) {
+      return vk_state->frame_number >= object->retired_frame_number + 1 + N_PARALLEL_FRAMES;
+    }
+    if (vk_state->is_timeline_semaphore_enabled) {
+      return completed_timeline_value >= object->retired_timeline_value;
+    }
+    return vk_state->frame_number >= object->retired_frame_number + N_PARALLEL_FRAMES;
+  }
+
+
+  static void destroy_oldest(VkState *vk_state) {
+    DeletionQueue *queue = &vk_state->deletion_queue;
+    destroy_object(vk_state, &queue->objects[queue->idx_head]);
+    queue->idx_head = (queue->idx_head + 1) % MAX_N_RETIRED_OBJECTS;
+    queue->n_objects--;
+  }
+
+
+  // Destroys everything, so only call this once the device is idle
+  static void flush(VkState *vk_state) {
+    while (vk_state->deletion_queue.n_objects > 0) {
+      destroy_oldest(vk_state);
+    }
+  }
+
+
+  // Destroys everything that no frame in flight can be using anymore. Call
+  // this after waiting on the current frame. We stop at the first object we
+  // can't destroy yet, so anything retired after it waits a bit longer.
+  static void collect(VkState *vk_state) {
+    DeletionQueue *queue = &vk_state->deletion_queue;
+    u64 const completed_timeline_value = vk_state->is_timeline_semaphore_enabled ?
+      sync::get_completed_value(vk_state, &vk_state->graphics_timeline) : 0;
+    while (queue->n_objects > 0 && is_unused(vk_state, &queue->objects[queue->idx_head], completed_timeline_value)) {
+      destroy_oldest(vk_state);
+    }
+  }
+
+
+  static void retire(VkState *vk_state, RetiredObjectType type, u64 handle, u64 pool) {
+    if (handle == 0) {
+      return;
+    }
+    DeletionQueue *queue = &vk_state->deletion_queue;
+    if (queue->n_objects == MAX_N_RETIRED_OBJECTS) {
+      // This shouldn't really happen, but if it does, we can still get out of
+      // it by stalling
+      logs::warning("Deletion queue is full, waiting for the device to go idle");
+      vkDeviceWaitIdle(vk_state->device);
+      flush(vk_state);
+    }
+    u32 const idx_tail = (queue->idx_head + queue->n_objects) % MAX_N_RETIRED_OBJECTS;
+    queue->objects[idx_tail] = {
+      .type                   = type,
+      .handle                 = handle,
+      .pool                   = pool,
+      .retired_frame_number   = vk_state->frame_number,
+      .retired_timeline_value = vk_state->graphics_timeline.last_submitted_value,
+    };
+    queue->n_objects++;
+  }
+
+
+  static void retire_buffer(VkState *vk_state, VkBuffer buffer) {
+    retire(vk_state, RetiredObjectType::buffer, (u64)buffer, 0);
+  }
+
+
+  static void retire_device_memory(VkState *vk_state, VkDeviceMemory memory) {
+    retire(vk_state, RetiredObjectType::device_memory, (u64)memory, 0);
+  }
+
+
+  static void retire_image(VkState *vk_state, VkImage image) {
+    retire(vk_state, RetiredObjectType::image, (u64)image, 0);
+  }
+
+
+  static void retire_image_view(VkState *vk_state, VkImageView image_view) {
+    retire(vk_state, RetiredObjectType::image_view, (u64)image_view, 0);
+  }
+
+
+  static void retire_sampler(VkState *vk_state, VkSampler sampler) {
+    retire(vk_state, RetiredObjectType::sampler, (u64)sampler, 0);
+  }
+
+
+  static void retire_pipeline(VkState *vk_state, VkPipeline pipeline) {
+    retire(vk_state, RetiredObjectType::pipeline, (u64)pipeline, 0);
+  }
+
+
+  static void retire_pipeline_layout(VkState *vk_state, VkPipelineLayout pipeline_layout) {
+    retire(vk_state, RetiredObjectType::pipeline_layout, (u64)pipeline_layout, 0);
+  }
+
+
+  static void retire_render_pass(VkState *vk_state, VkRenderPass render_pass) {
+    retire(vk_state, RetiredObjectType::render_pass, (u64)render_pass, 0);
+  }
+
+
+  static void retire_framebuffer(VkState *vk_state, VkFramebuffer framebuffer) {
+    retire(vk_state, RetiredObjectType::framebuffer, (u64)framebuffer, 0);
+  }
+
+
+  static void retire_descriptor_set(VkState *vk_state, VkDescriptorPool pool, VkDescriptorSet descriptor_set) {
+    retire(vk_state, RetiredObjectType::descriptor_set, (u64)descriptor_set, (u64)pool);
+  }
+
+
+  static void retire_command_buffer(VkState *vk_state, VkCommandPool pool, VkCommandBuffer command_buffer) {
+    retire(vk_state, RetiredObjectType::command_buffer, (u64)(uintptr_t)command_buffer, (u64)pool);
+  }
+
+
+  static void retire_swapchain(VkState *vk_state, VkSwapchainKHR swapchain) {
+    retire(vk_state, RetiredObjectType::swapchain, (u64)swapchain, 0);
+  }
+
+
+  static void retire_swapchain_image_view(VkState *vk_state, VkImageView image_view) {
+    retire(vk_state, RetiredObjectType::swapchain_image_view, (u64)image_view, 0);
+  }
+
+
+  static void retire_image_resources(VkState *vk_state, ImageResources *image_resources) {
+    retire_image_view(vk_state, image_resources->view);
+    retire_image(vk_state, image_resources->image);
+    retire_device_memory(vk_state, image_resources->memory);
+    image_resources->view = VK_NULL_HANDLE;
+    image_resources->image = VK_NULL_HANDLE;
+    image_resources->memory = VK_NULL_HANDLE;
+  }
+
+
+  static void retire_image_resources_with_sampler(VkState *vk_state, ImageResources *image_resources) {
+    retire_image_resources(vk_state, image_resources);
+    retire_sampler(vk_state, image_resources->sampler);
+    image_resources->sampler = VK_NULL_HANDLE;
+  }
+}
@@ -0,0 +1,183 @@
+/*
+  Allocates descriptor sets, either for a single frame, or for good through a
+  cache, so that we never allocate the same set twice.
+*/
+
+#include "vulkan.hpp"
+#include "vkutils.hpp"
+#include "util.hpp"
+#include "logs.hpp"
+
+
+namespace vulkan::descriptors {
+  // How many descriptors of each type we expect a set to need, on average.
+  // The lighting stage's set has the most images, with four.
+  static constexpr VkDescriptorPoolSize DESCRIPTORS_PER_SET[] = {
+    vkutils::descriptor_pool_size(VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, 1),
+    vkutils::descriptor_pool_size(VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, 4),
+  };
+
+
+  // `n_variable_descriptors` is how many textures the set that made us add
+  // this pool wants in a variable count binding, which can be far more than
+  // sets usually have, so we make room for them on top of the usual amount
+  static void add_pool(VkState *vk_state, DescriptorAllocator *allocator, u32 n_variable_descriptors) {
+    if (allocator->n_pools == MAX_N_DESCRIPTOR_POOLS) {
+      logs::fatal("Could not add descriptor pool, we already have %d", MAX_N_DESCRIPTOR_POOLS);
+    }
+    u32 const n_max_sets = min(MIN_N_SETS_PER_DESCRIPTOR_POOL << allocator->n_pools, MAX_N_SETS_PER_DESCRIPTOR_POOL);
+    VkDescriptorPoolSize pool_sizes[LEN(DESCRIPTORS_PER_SET)];
+    range (0, LEN(DESCRIPTORS_PER_SET)) {
+      u32 const n_extra_descriptors =
+        DESCRIPTORS_PER_SET[idx].type == VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER ? n_variable_descriptors : 0;
+      pool_sizes[idx] = vkutils::descriptor_pool_size(DESCRIPTORS_PER_SET[idx].type,
+        DESCRIPTORS_PER_SET[idx].descriptorCount * n_max_sets + n_extra_descriptors);
+    }
+    auto const pool_info = vkutils::descriptor_pool_create_info(n_max_sets, LEN(pool_sizes), pool_sizes);
+    vkutils::check(vkCreateDescriptorPool(vk_state->device, &pool_info, nullptr,
+      &allocator->pools[allocator->n_pools]));
+    allocator->n_pools++;
+  }
+
+
+  // If the layout's last binding has a variable descriptor count, like the
+  // bindless texture table, `n_variable_descriptors` is how many we want in it
+  static VkDescriptorSet allocate(
+    VkState *vk_state, DescriptorAllocator *allocator, VkDescriptorSetLayout layout, u32 n_variable_descriptors
+  ) {
+    VkDescriptorSetVariableDescriptorCountAllocateInfo const variable_count_info = {
+      .sType              = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_VARIABLE_DESCRIPTOR_COUNT_ALLOCATE_INFO,
+      .descriptorSetCount = 1,
+      .pDescriptorCounts  = &n_variable_descriptors,
+    };
+
+    // Pools that ran out stay full until we reset, so we only ever try the
+    // current one, then move on to the next one, making it if we have to
+    while (true) {
+      bool const is_new_pool = allocator->idx_current_pool == allocator->n_pools;
+      if (is_new_pool) {
+        add_pool(vk_state, allocator, n_variable_descriptors);
+      }
+      auto alloc_info = vkutils::descriptor_set_allocate_info(allocator->pools[allocator->idx_current_pool], &layout);
+      if (n_variable_descriptors > 0) {
+        alloc_info.pNext = &variable_count_info;
+      }
+      VkDescriptorSet descriptor_set;
+      VkResult const alloc_res = vkAllocateDescriptorSets(vk_state->device, &alloc_info, &descriptor_set);
+      if (alloc_res == VK_SUCCESS) {
+        return descriptor_set;
+      }
+      if (alloc_res != VK_ERROR_OUT_OF_POOL_MEMORY && alloc_res != VK_ERROR_FRAGMENTED_POOL) {
+        logs::fatal("Could not allocate descriptor set (%d)", alloc_res);
+      }
+      if (is_new_pool) {
+        logs::fatal("Could not allocate descriptor set, it doesn't even fit in an empty pool");
+      }
+      allocator->idx_current_pool++;
+    }
+  }
+
+
+  // Gives back every set we've allocated at once. Only call this once nothing
+  // is using any of them anymore.
+  static void reset_allocator(VkState *vk_state, DescriptorAllocator *allocator) {
+    range (0, allocator->n_pools) {
+      vkutils::check(vkResetDescriptorPool(vk_state->device, allocator->pools[idx], 0));
+    }
+    allocator->idx_current_pool = 0;
+  }
+
+
+  static void destroy_allocator(VkState *vk_state, DescriptorAllocator *allocator) {
+    range (0, allocator->n_pools) {
+      vkDestroyDescriptorPool(vk_state->device, allocator->pools[idx], nullptr);
+    }
+    *allocator = {};
+  }
+
+
+  // Writes `bindings` to bindings 0 to `n_bindings - 1` of `descriptor_set`
+  static void write_set(
+    VkState *vk_state, VkDescriptorSet descriptor_set, DescriptorBinding const *bindings, u32 n_bindings
+  ) {
+    assert(n_bindings <= MAX_N_DESCRIPTOR_BINDINGS);
+    VkWriteDescriptorSet descriptor_writes[MAX_N_DESCRIPTOR_BINDINGS];
+    range (0, n_bindings) {
+      if (bindings[idx].type == VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER) {
+        descriptor_writes[idx] = vkutils::write_descriptor_set_buffer(descriptor_set, idx, &bindings[idx].buffer_info);
+      } else {
+        descriptor_writes[idx] = vkutils::write_descriptor_set_image(descriptor_set, idx, &bindings[idx].image_info);
+      }
+    }
+    vkUpdateDescriptorSets(vk_state->device, n_bindings, descriptor_writes, 0, nullptr);
+  }
+
+
+  // Allocates a set from the frame's allocator and writes `bindings` to it.
+  // The set is only good until we start this frame again.
+  static VkDescriptorSet get_frame_set(
+    VkState *vk_state, u32 idx_frame, VkDescriptorSetLayout layout, DescriptorBinding const *bindings, u32 n_bindings
+  ) {
+    VkDescriptorSet const descriptor_set = allocate(vk_state,
+      &vk_state->frame_resources[idx_frame].descriptor_allocator, layout, 0);
+    write_set(vk_state, descriptor_set, bindings, n_bindings);
+    return descriptor_set;
+  }
+
+
+  static u64 hash_set(VkDescriptorSetLayout layout, DescriptorBinding const *bindings, u32 n_bindings) {
+    // We hash field by field, since the Vulkan structs have padding in them
+    u64 hash = util::hash_fnv1a(&layout, sizeof(layout), util::FNV_OFFSET_BASIS);
+    range (0, n_bindings) {
+      DescriptorBinding const *binding = &bindings[idx];
+      hash = util::hash_fnv1a(&binding->type, sizeof(binding->type), hash);
+      if (binding->type == VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER) {
+        hash = util::hash_fnv1a(&binding->buffer_info.buffer, sizeof(binding->buffer_info.buffer), hash);
+        hash = util::hash_fnv1a(&binding->buffer_info.offset, sizeof(binding->buffer_info.offset), hash);
+        hash = util::hash_fnv1a(&binding->buffer_info.range, sizeof(binding->buffer_info.range), hash);
+      } else {
+        hash = util::hash_fnv1a(&binding->image_info.sampler, sizeof(binding->image_info.sampler), hash);
+        hash = util::hash_fnv1a(&binding->image_info.imageView, sizeof(binding->image_info.imageView), hash);
+        hash = util::hash_fnv1a(&binding->image_info.imageLayout, sizeof(binding->image_info.imageLayout), hash);
+      }
+    }
+    return hash;
+  }
+
+
+  // Gets a set with this layout and these bindings, which lives until we're
+  // destroyed. If we've already made an identical one, we give back that one.
+  // This means the same set can end up used by several frames at once, so
+  // never write to a set you got from here.
+  static VkDescriptorSet get_cached_set(
+    VkState *vk_state, VkDescriptorSetLayout layout, DescriptorBinding const *bindings, u32 n_bindings
+  ) {
+    u64 const hash = hash_set(layout, bindings, n_bindings);
+    range (0, vk_state->n_cached_descriptor_sets) {
+      if (vk_state->cached_descriptor_sets[idx].hash == hash) {
+        return vk_state->cached_descriptor_sets[idx].descriptor_set;
+      }
+    }
+
+    VkDescriptorSet const descriptor_set = allocate(vk_state, &vk_state->descriptor_allocator, layout, 0);
+    write_set(vk_state, descriptor_set, bindings, n_bindings);
+    if (vk_state->n_cached_descriptor_sets < MAX_N_CACHED_DESCRIPTOR_SETS) {
+      vk_state->cached_descriptor_sets[vk_state->n_cached_descriptor_sets++] = {
+        .hash           = hash,
+        .descriptor_set = descriptor_set,
+      };
+    } else {
+      logs::warning("Descriptor set cache is full, so this set won't be reused");
+    }
+    return descriptor_set;
+  }
+
+
+  static void destroy(VkState *vk_state) {
+    range (0, N_PARALLEL_FRAMES) {
+      destroy_allocator(vk_state, &vk_state->frame_resources[idx].descriptor_allocator);
+    }
+    destroy_allocator(vk_state, &vk_state->descriptor_allocator);
+    vk_state->n_cached_descriptor_sets = 0;
+  }
+}
@@ -0,0 +1,139 @@
+/*
+  Rebuilds render stage pipelines when their shaders change on disk, so that
+  we can see shader changes without restarting.
+*/
+
+#include <string.h>
+#include "vulkan.hpp"
+#include "vkutils.hpp"
+#include "files.hpp"
+#include "tasks.hpp"
+#include "logs.hpp"
+
+
+namespace vulkan::hot_reload {
+  // A stage's shaders are the files whose names start with its name, like
+  // `geometry.frag.spv` and `geometry_quantized.vert.spv`
+  static bool is_stage_shader(pipelines::PipelineStage const *stage, char const *file_name) {
+    size_t const prefix_length = strlen(stage->name);
+    size_t const file_name_length = strlen(file_name);
+    if (strncmp(file_name, stage->name, prefix_length) != 0) {
+      return false;
+    }
+    if (file_name[prefix_length] != '.' && file_name[prefix_length] != '_') {
+      return false;
+    }
+    return file_name_length > 4 && strcmp(&file_name[file_name_length - 4], ".spv") == 0;
+  }
+
+
+  static void rebuild_pipelines(void *data) {
+    PipelineRebuild *rebuild = (PipelineRebuild*)data;
+    pipelines::PipelineStage const *stage = &pipelines::PIPELINE_STAGES[rebuild->idx_stage];
+    rebuild->did_succeed = stage->create_pipelines(rebuild->vk_state, rebuild->extent, rebuild->permutation_key,
+      rebuild->pipelines);
+    rebuild->is_done.store(true, std::memory_order_release);
+  }
+
+
+  static void swap_in_pipelines(VkState *vk_state, PipelineRebuild *rebuild) {
+    // Every variant we had was built from the old shaders, so we throw them
+    // all away, and rebuild the others if we ever switch back to them
+    RenderStage *stage = pipelines::get_stage(vk_state, rebuild->idx_stage);
+    stage_common::retire_pipeline_variants(vk_state, stage);
+    stage_common::use_pipeline_variant(vk_state, stage,
+      stage_common::add_pipeline_variant(vk_state, stage, rebuild->permutation_key, rebuild->pipelines));
+  }
+
+
+  static void start_rebuild(VkState *vk_state, u32 idx_stage, VkExtent2D extent) {
+    ShaderHotReload *hot_reload = &vk_state->shader_hot_reload;
+    PipelineRebuild *rebuild = &hot_reload->rebuilds[idx_stage];
+    rebuild->vk_state = vk_state;
+    rebuild->idx_stage = idx_stage;
+    rebuild->permutation_key = pipelines::get_stage(vk_state, idx_stage)->permutation_key;
+    rebuild->extent = extent;
+    rebuild->did_succeed = false;
+    rebuild->is_done.store(false, std::memory_order_relaxed);
+    rebuild->is_running = true;
+    rebuild->should_rebuild = false;
+    // From now on, the loose shader files are the ones we want
+    vk_state->should_skip_packed_shaders = true;
+    tasks::push_group_task(hot_reload->worker_pool, &hot_reload->task_group, rebuild_pipelines, rebuild);
+  }
+
+
+  static void init(VkState *vk_state, tasks::WorkerPool *worker_pool) {
+    ShaderHotReload *hot_reload = &vk_state->shader_hot_reload;
+    hot_reload->worker_pool = worker_pool;
+    if (files::init_file_watcher(&hot_reload->watcher, SHADER_DIR_PATH)) {
+      logs::info("Watching %s for shader changes", SHADER_DIR_PATH);
+    }
+  }
+
+
+  static void update(VkState *vk_state, CommonState *common_state) {
+    // Runs at the start of a frame, before we've recorded anything, so any
+    // pipelines we swap in are used from this frame on
+    ShaderHotReload *hot_reload = &vk_state->shader_hot_reload;
+
+    char changed_file_name[MAX_PATH];
+    while (files::poll_file_watcher(&hot_reload->watcher, changed_file_name, sizeof(changed_file_name))) {
+      range (0, N_PIPELINE_STAGES) {
+        if (is_stage_shader(&pipelines::PIPELINE_STAGES[idx], changed_file_name)) {
+          logs::info("Shader %s changed, rebuilding %s pipelines", changed_file_name,
+            pipelines::PIPELINE_STAGES[idx].name);
+          hot_reload->rebuilds[idx].should_rebuild = true;
+        }
+      }
+    }
+
+    range (0, N_PIPELINE_STAGES) {
+      PipelineRebuild *rebuild = &hot_reload->rebuilds[idx];
+      if (rebuild->is_running && rebuild->is_done.load(std::memory_order_acquire)) {
+        rebuild->is_running = false;
+        if (rebuild->did_succeed) {
+          swap_in_pipelines(vk_state, rebuild);
+          logs::info("Reloaded %s pipelines", pipelines::PIPELINE_STAGES[idx].name);
+        } else {
+          logs::error("Could not rebuild %s pipelines, keeping the old ones", pipelines::PIPELINE_STAGES[idx].name);
+        }
+      }
+      // If the shaders changed again while we were rebuilding, we go again
+      if (rebuild->should_rebuild && !rebuild->is_running) {
+        start_rebuild(vk_state, idx, common_state->extent);
+      }
+    }
+  }
+
+
+  static void cancel_rebuilds(VkState *vk_state) {
+    // Rebuilds use the stages' render passes, so we need them to finish
+    // before we destroy those. Whatever they built is for the
+    // old swapchain, so we throw it away, and the stages will make new
+    // pipelines from the same files anyway.
+    ShaderHotReload *hot_reload = &vk_state->shader_hot_reload;
+    bool is_any_rebuild_running = false;
+    range (0, N_PIPELINE_STAGES) {
+      is_any_rebuild_running = is_any_rebuild_running || hot_reload->rebuilds[idx].is_running;
+    }
+    if (!is_any_rebuild_running) {
+      return;
+    }
+    tasks::wait_for_group(hot_reload->worker_pool, &hot_reload->task_group);
+    range (0, N_PIPELINE_STAGES) {
+      PipelineRebuild *rebuild = &hot_reload->rebuilds[idx];
+      if (rebuild->is_running) {
+        stage_common::destroy_pipelines(vk_state, rebuild->pipelines);
+        rebuild->is_running = false;
+      }
+    }
+  }
+
+
+  static void destroy(VkState *vk_state) {
+    ShaderHotReload *hot_reload = &vk_state->shader_hot_reload;
+    cancel_rebuilds(vk_state);
+    files::destroy_file_watcher(&hot_reload->watcher);
+  }
+}
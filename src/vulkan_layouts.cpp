@@ -0,0 +1,124 @@
+/*
+  Makes descriptor set layouts and pipeline layouts out of shader reflection,
+  and keeps them for as long as we're around, so that everything that needs an
+  identical layout shares the same object.
+*/
+
+#include "vulkan.hpp"
+#include "vkutils.hpp"
+#include "util.hpp"
+#include "logs.hpp"
+
+
+namespace vulkan::layouts {
+  // Gets a layout for set `idx_set` with the bindings `reflection` has in it.
+  // A runtime array, like the bindless texture table, gets as many
+  // descriptors as we can have bindless textures, and only takes up as many
+  // slots as we ask for when we allocate the set.
+  static VkDescriptorSetLayout get_descriptor_set_layout(
+    VkState *vk_state, ShaderReflection const *reflection, u32 idx_set
+  ) {
+    // These are bindings 0 to n - 1, so putting them in that order means
+    // identical sets always hash the same
+    u32 const n_bindings = reflection::count_set_bindings(reflection, idx_set);
+    VkDescriptorSetLayoutBinding bindings[MAX_N_REFLECTED_BINDINGS];
+    VkDescriptorBindingFlags binding_flags[MAX_N_REFLECTED_BINDINGS];
+    bool has_binding_flags = false;
+    range (0, n_bindings) {
+      ReflectedBinding const *binding = reflection::find_binding(reflection, idx_set, idx);
+      bool const is_runtime_array = binding->n_descriptors == 0;
+      if (is_runtime_array && (!vk_state->is_bindless_enabled || idx != n_bindings - 1)) {
+        logs::fatal("Set %d binding %d is a runtime array, which we only support as the last binding in bindless mode",
+          idx_set, idx);
+      }
+      bindings[idx] = {
+        .binding         = idx,
+        .descriptorType  = binding->type,
+        .descriptorCount = is_runtime_array ? vk_state->n_max_bindless_textures : binding->n_descriptors,
+        .stageFlags      = binding->stage_flags,
+      };
+      binding_flags[idx] = is_runtime_array ?
+        VK_DESCRIPTOR_BINDING_PARTIALLY_BOUND_BIT | VK_DESCRIPTOR_BINDING_VARIABLE_DESCRIPTOR_COUNT_BIT : 0;
+      has_binding_flags = has_binding_flags || is_runtime_array;
+    }
+
+    // We hash field by field, since the Vulkan structs have padding in them
+    u64 hash = util::FNV_OFFSET_BASIS;
+    range (0, n_bindings) {
+      hash = util::hash_fnv1a(&bindings[idx].descriptorType, sizeof(bindings[idx].descriptorType), hash);
+      hash = util::hash_fnv1a(&bindings[idx].descriptorCount, sizeof(bindings[idx].descriptorCount), hash);
+      hash = util::hash_fnv1a(&bindings[idx].stageFlags, sizeof(bindings[idx].stageFlags), hash);
+      hash = util::hash_fnv1a(&binding_flags[idx], sizeof(binding_flags[idx]), hash);
+    }
+    range (0, vk_state->n_cached_descriptor_set_layouts) {
+      if (vk_state->cached_descriptor_set_layouts[idx].hash == hash) {
+        return vk_state->cached_descriptor_set_layouts[idx].layout;
+      }
+    }
+    if (vk_state->n_cached_descriptor_set_layouts == MAX_N_CACHED_LAYOUTS) {
+      logs::fatal("Could not make descriptor set layout, we already have %d", MAX_N_CACHED_LAYOUTS);
+    }
+
+    VkDescriptorSetLayoutBindingFlagsCreateInfo const binding_flags_info = {
+      .sType         = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_BINDING_FLAGS_CREATE_INFO,
+      .bindingCount  = n_bindings,
+      .pBindingFlags = binding_flags,
+    };
+    auto layout_info = vkutils::descriptor_set_layout_create_info(n_bindings, bindings);
+    if (has_binding_flags) {
+      layout_info.pNext = &binding_flags_info;
+    }
+    VkDescriptorSetLayout layout;
+    vkutils::check(vkCreateDescriptorSetLayout(vk_state->device, &layout_info, nullptr, &layout));
+    vk_state->cached_descriptor_set_layouts[vk_state->n_cached_descriptor_set_layouts++] = {
+      .hash   = hash,
+      .layout = layout,
+    };
+    return layout;
+  }
+
+
+  // `push_constant_range` can be null if the pipelines have no push constants
+  static VkPipelineLayout get_pipeline_layout(
+    VkState *vk_state, VkDescriptorSetLayout const *set_layouts, u32 n_set_layouts,
+    VkPushConstantRange const *push_constant_range
+  ) {
+    u64 hash = util::hash_fnv1a(set_layouts, sizeof(VkDescriptorSetLayout) * n_set_layouts,
+      util::FNV_OFFSET_BASIS);
+    if (push_constant_range) {
+      hash = util::hash_fnv1a(&push_constant_range->stageFlags, sizeof(push_constant_range->stageFlags), hash);
+      hash = util::hash_fnv1a(&push_constant_range->offset, sizeof(push_constant_range->offset), hash);
+      hash = util::hash_fnv1a(&push_constant_range->size, sizeof(push_constant_range->size), hash);
+    }
+    range (0, vk_state->n_cached_pipeline_layouts) {
+      if (vk_state->cached_pipeline_layouts[idx].hash == hash) {
+        return vk_state->cached_pipeline_layouts[idx].layout;
+      }
+    }
+    if (vk_state->n_cached_pipeline_layouts == MAX_N_CACHED_LAYOUTS) {
+      logs::fatal("Could not make pipeline layout, we already have %d", MAX_N_CACHED_LAYOUTS);
+    }
+
+    auto const pipeline_layout_info = vkutils::pipeline_layout_create_info(n_set_layouts, set_layouts,
+      push_constant_range ? 1 : 0, push_constant_range);
+    VkPipelineLayout layout;
+    vkutils::check(vkCreatePipelineLayout(vk_state->device, &pipeline_layout_info, nullptr, &layout));
+    vk_state->cached_pipeline_layouts[vk_state->n_cached_pipeline_layouts++] = {
+      .hash   = hash,
+      .layout = layout,
+    };
+    return layout;
+  }
+
+
+  static void destroy(VkState *vk_state) {
+    range (0, vk_state->n_cached_pipeline_layouts) {
+      vkDestroyPipelineLayout(vk_state->device, vk_state->cached_pipeline_layouts[idx].layout, nullptr);
+    }
+    vk_state->n_cached_pipeline_layouts = 0;
+    range (0, vk_state->n_cached_descriptor_set_layouts) {
+      vkDestroyDescriptorSetLayout(vk_state->device, vk_state->cached_descriptor_set_layouts[idx].layout, nullptr);
+    }
+    vk_state->n_cached_descriptor_set_layouts = 0;
+  }
+}
@@ -0,0 +1,139 @@
+/*
+  Creates render stages' pipelines on worker threads, so that each stage reads
+  and compiles its shaders at the same time as the others, rather than one
+  after another on the main thread.
+
+  All builds share `VkState::pipeline_cache`, which Vulkan lets us use from
+  several threads at once.
+
+  Stages can also have several variants of their pipelines, one for each
+  permutation of their shaders' specialization constants. We only ever build
+  the variants that are actually asked for, see `update_variants()`.
+*/
+
+#include "vulkan.hpp"
+#include "vkutils.hpp"
+#include "tasks.hpp"
+#include "logs.hpp"
+
+
+namespace vulkan::pipelines {
+  typedef bool (*CreatePipelinesFunction)(
+    VkState *vk_state, VkExtent2D extent, u32 permutation_key, VkPipeline *pipelines);
+
+  struct PipelineStage {
+    char const *name;
+    CreatePipelinesFunction create_pipelines;
+  };
+
+  static constexpr PipelineStage PIPELINE_STAGES[] = {
+    {"geometry", geometry_stage::create_pipelines},
+    {"lighting", lighting_stage::create_pipelines},
+    {"forward", forward_stage::create_pipelines},
+  };
+  static_assert(LEN(PIPELINE_STAGES) == N_PIPELINE_STAGES);
+
+
+  static RenderStage* get_stage(VkState *vk_state, u32 idx_stage) {
+    RenderStage *stages[] = {&vk_state->geometry_stage, &vk_state->lighting_stage, &vk_state->forward_stage};
+    return stages[idx_stage];
+  }
+
+
+  static void build_pipelines(void *data) {
+    PipelineBuild *build = (PipelineBuild*)data;
+    PipelineStage const *stage = &PIPELINE_STAGES[build->idx_stage];
+    build->did_succeed = stage->create_pipelines(build->vk_state, build->extent, build->permutation_key,
+      build->pipelines);
+  }
+
+
+  // Builds every stage's pipelines in the background. The stages' render
+  // passes have to exist already, and have to stay around until we've called
+  // `finish_builds()` or `cancel_builds()`.
+  static void start_builds(VkState *vk_state, tasks::WorkerPool *worker_pool, VkExtent2D extent) {
+    PipelineBuilds *builds = &vk_state->pipeline_builds;
+    assert(!builds->are_running);
+    builds->worker_pool = worker_pool;
+    range (0, N_PIPELINE_STAGES) {
+      builds->builds[idx] = {
+        .vk_state        = vk_state,
+        .idx_stage       = idx,
+        .permutation_key = get_stage(vk_state, idx)->permutation_key,
+        .extent          = extent,
+      };
+      tasks::push_group_task(worker_pool, &builds->task_group, build_pipelines, &builds->builds[idx]);
+    }
+    builds->are_running = true;
+  }
+
+
+  // Waits for the pipelines from `start_builds()` and hands them to their
+  // stages. This has to happen before we record anything with them.
+  static void finish_builds(VkState *vk_state) {
+    PipelineBuilds *builds = &vk_state->pipeline_builds;
+    if (!builds->are_running) {
+      return;
+    }
+    tasks::wait_for_group(builds->worker_pool, &builds->task_group);
+    builds->are_running = false;
+    range (0, N_PIPELINE_STAGES) {
+      PipelineBuild *build = &builds->builds[idx];
+      if (!build->did_succeed) {
+        logs::fatal("Could not create %s stage pipelines.", PIPELINE_STAGES[idx].name);
+      }
+      RenderStage *stage = get_stage(vk_state, idx);
+      stage_common::use_pipeline_variant(vk_state, stage,
+        stage_common::add_pipeline_variant(vk_state, stage, build->permutation_key, build->pipelines));
+    }
+  }
+
+
+  // Waits for the pipelines from `start_builds()` and throws them away, for
+  // when the stages they were for are going away
+  static void cancel_builds(VkState *vk_state) {
+    PipelineBuilds *builds = &vk_state->pipeline_builds;
+    if (!builds->are_running) {
+      return;
+    }
+    tasks::wait_for_group(builds->worker_pool, &builds->task_group);
+    builds->are_running = false;
+    range (0, N_PIPELINE_STAGES) {
+      stage_common::destroy_pipelines(vk_state, builds->builds[idx].pipelines);
+    }
+  }
+
+
+  // Switches each stage to the variant for its `permutation_key`, building it
+  // first if we've never needed it before. This happens at the start of a
+  // frame, so the build stalls that one frame, but only the first time we ask
+  // for each variant.
+  static void update_variants(VkState *vk_state, VkExtent2D extent) {
+    assert(!vk_state->pipeline_builds.are_running);
+    range (0, N_PIPELINE_STAGES) {
+      RenderStage *stage = get_stage(vk_state, idx);
+      u32 const current_key = stage->variants[stage->idx_current_variant].permutation_key;
+      if (stage->permutation_key == current_key) {
+        continue;
+      }
+
+      i64 const idx_variant = stage_common::find_pipeline_variant(stage, stage->permutation_key);
+      if (idx_variant != -1) {
+        stage_common::use_pipeline_variant(vk_state, stage, (u32)idx_variant);
+        continue;
+      }
+
+      VkPipeline new_pipelines[N_VERTEX_LAYOUTS];
+      if (!PIPELINE_STAGES[idx].create_pipelines(vk_state, extent, stage->permutation_key, new_pipelines)) {
+        // Go back to what we have, so that we don't try again every frame
+        logs::error("Could not build %s pipeline variant %d, keeping variant %d", PIPELINE_STAGES[idx].name,
+          stage->permutation_key, current_key);
+        stage->permutation_key = current_key;
+        continue;
+      }
+      logs::info("Built %s pipeline variant %d", PIPELINE_STAGES[idx].name, stage->permutation_key);
+      stage_common::use_pipeline_variant(vk_state, stage,
+        stage_common::add_pipeline_variant(vk_state, stage, stage->permutation_key, new_pipelines));
+    }
+  }
+}
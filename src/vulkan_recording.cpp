@@ -0,0 +1,296 @@
+/*
+  Records stages' render passes, splitting their draws across worker threads
+  when there are enough of them. Each worker records its share into its own
+  secondary command buffer, which the stage's primary command buffer then
+  executes, so recording lots of draws takes time in proportion to how many
+  cores we have, rather than all of it landing on the main thread.
+
+  Command pools can only be used by one thread at a time, so every job has its
+  own pool. Each frame in flight has its own set of them too, since we record
+  one frame while the GPU might still be running the others. This also means
+  that once a frame's fence has signalled, none of its command buffers are in
+  use anymore, so we can reset each of its pools with a single call, which is
+  much cheaper for the driver than resetting every buffer on its own.
+
+  For scenes where nothing changes from one frame to the next but uniform
+  data, we can also keep each stage's command buffers, one for each frame and
+  swapchain image, and just submit them again, see `CommandBufferCache`. These
+  come from `VkState::command_pool` instead, since they have to outlive the
+  frame. Anything that changes what we'd record has to call `mark_dirty()`.
+*/
+
+#include <string.h>
+#include "vulkan.hpp"
+#include "vkutils.hpp"
+#include "vulkan_rendering.hpp"
+#include "tasks.hpp"
+#include "logs.hpp"
+
+
+namespace vulkan::recording {
+  static void init_frame_command_pool(VkState *vk_state, FrameCommandPool *pool, VkCommandBufferLevel level) {
+    *pool = {.level = level};
+    vkutils::create_transient_command_pool(vk_state->device, &pool->pool,
+      (u32)vk_state->queue_family_indices.graphics);
+  }
+
+
+  static void reset_frame_command_pool(VkState *vk_state, FrameCommandPool *pool) {
+    if (pool->n_used_command_buffers == 0) {
+      return;
+    }
+    vkutils::check(vkResetCommandPool(vk_state->device, pool->pool, 0));
+    pool->n_used_command_buffers = 0;
+  }
+
+
+  // Hands out a command buffer that's ready to begin, and that we can use
+  // until its frame comes round again
+  static VkCommandBuffer get_command_buffer(VkState *vk_state, FrameCommandPool *pool) {
+    if (pool->n_used_command_buffers == pool->n_command_buffers) {
+      if (pool->n_command_buffers == MAX_N_FRAME_COMMAND_BUFFERS) {
+        logs::fatal("Could not get command buffer, we already have %d in this frame", MAX_N_FRAME_COMMAND_BUFFERS);
+      }
+      auto alloc_info = vkutils::command_buffer_allocate_info(pool->pool);
+      alloc_info.level = pool->level;
+      vkutils::check(vkAllocateCommandBuffers(vk_state->device, &alloc_info,
+        &pool->command_buffers[pool->n_command_buffers]));
+      pool->n_command_buffers++;
+    }
+    return pool->command_buffers[pool->n_used_command_buffers++];
+  }
+
+
+  // Makes every cached command buffer get recorded again before we submit it.
+  // Call this whenever anything they depend on changes, like drawables,
+  // pipelines, descriptor sets or the swapchain.
+  static void mark_dirty(VkState *vk_state) {
+    vk_state->command_buffer_cache.version++;
+  }
+
+
+  // Turns caching on or off, and makes everything dirty if the camera moved,
+  // since that changes the order we draw in
+  static void update_cache(VkState *vk_state, bool should_cache, m4 const *view) {
+    CommandBufferCache *cache = &vk_state->command_buffer_cache;
+    if (should_cache != cache->is_enabled) {
+      cache->is_enabled = should_cache;
+      mark_dirty(vk_state);
+      logs::info("%s command buffer caching", should_cache ? "Enabled" : "Disabled");
+    }
+    if (cache->is_enabled && memcmp(view, &cache->view, sizeof(m4)) != 0) {
+      cache->view = *view;
+      mark_dirty(vk_state);
+    }
+  }
+
+
+  // Whether we have to make the frame's descriptor sets again. If it returns
+  // false, the frame's cached command buffers still use the ones we made
+  // last time, so we have to leave those alone.
+  static bool should_update_descriptors(VkState *vk_state, u32 idx_frame) {
+    CommandBufferCache *cache = &vk_state->command_buffer_cache;
+    if (cache->is_enabled && cache->descriptor_versions[idx_frame] == cache->version) {
+      return false;
+    }
+    cache->descriptor_versions[idx_frame] = cache->version;
+    return true;
+  }
+
+
+  // Whether every stage has an up-to-date command buffer for this frame and
+  // swapchain image, in which case we can skip building draw lists and
+  // recording altogether
+  static bool is_frame_cached(VkState *vk_state, u32 idx_image) {
+    CommandBufferCache *cache = &vk_state->command_buffer_cache;
+    if (!cache->is_enabled) {
+      return false;
+    }
+    RenderStage const *stages[] = {&vk_state->geometry_stage, &vk_state->lighting_stage, &vk_state->forward_stage};
+    range (0, LEN(stages)) {
+      if (stages[idx]->cached_command_buffers[vk_state->idx_frame][idx_image].version != cache->version) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+
+  // Gets the command buffer the stage submits this frame. Without caching,
+  // that's a new one from the frame's pool. With caching, it's the one we keep
+  // for this frame and swapchain image, which we only have to record again if
+  // `is_frame_cached()` said so.
+  static VkCommandBuffer get_stage_command_buffer(VkState *vk_state, RenderStage *stage, u32 idx_image) {
+    CommandBufferCache *cache = &vk_state->command_buffer_cache;
+    if (!cache->is_enabled) {
+      return get_command_buffer(vk_state, &vk_state->frame_resources[vk_state->idx_frame].command_pool);
+    }
+    CachedCommandBuffer *cached = &stage->cached_command_buffers[vk_state->idx_frame][idx_image];
+    if (cached->command_buffer == VK_NULL_HANDLE) {
+      vkutils::create_command_buffer(vk_state->device, &cached->command_buffer, vk_state->command_pool);
+    }
+    cached->version = cache->version;
+    return cached->command_buffer;
+  }
+
+
+  // Earlier frames might still be using these, so they go to the deletion queue
+  static void retire_cached_command_buffers(VkState *vk_state, RenderStage *stage) {
+    range_named (idx_frame, 0, N_PARALLEL_FRAMES) {
+      range (0, MAX_N_SWAPCHAIN_IMAGES) {
+        CachedCommandBuffer *cached = &stage->cached_command_buffers[idx_frame][idx];
+        deletion::retire_command_buffer(vk_state, vk_state->command_pool, cached->command_buffer);
+        *cached = {};
+      }
+    }
+  }
+
+
+  static void record_batches(RecordingJob const *job, CommandState *command_state) {
+    RenderStage *stage = job->render_stage;
+    rendering::bind_pipeline(command_state, stage->pipelines[(u32)VertexLayout::full], stage);
+    rendering::bind_descriptor_sets(command_state, 0, N_DESCRIPTOR_SET_INDICES, job->descriptor_sets);
+    rendering::bind_geometry_buffer(command_state, job->geometry_buffer);
+    rendering::bind_vertex_buffer(command_state, INSTANCE_BINDING, job->instance_buffer);
+    range (job->idx_first_batch, job->idx_first_batch + job->n_batches) {
+      rendering::render_draw_batch(&stage->draw_list.batches[idx], stage, job->geometry_buffer, command_state);
+    }
+  }
+
+
+  static void record_secondary_command_buffer(void *data) {
+    RecordingJob const *job = (RecordingJob*)data;
+    // A secondary command buffer doesn't inherit anything we've bound on the
+    // primary, so every job binds everything again
+    VkCommandBufferBeginInfo const begin_info = {
+      .sType            = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO,
+      .flags            = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT |
+        VK_COMMAND_BUFFER_USAGE_RENDER_PASS_CONTINUE_BIT,
+      .pInheritanceInfo = &job->inheritance_info,
+    };
+    vkutils::check(vkBeginCommandBuffer(job->command_buffer, &begin_info));
+    CommandState command_state;
+    rendering::begin_command_state(&command_state, job->command_buffer);
+    record_batches(job, &command_state);
+    vkutils::check(vkEndCommandBuffer(job->command_buffer));
+  }
+
+
+  // Records the stage's whole render pass into `command_buffer`, which we
+  // have to have begun already
+  static void record_render_pass(
+    VkState *vk_state,
+    RenderStage *stage,
+    VkCommandBuffer command_buffer,
+    VkRenderPassBeginInfo const *render_pass_info,
+    VkDescriptorSet const *descriptor_sets
+  ) {
+    ParallelRecording *recording = &vk_state->parallel_recording;
+    u32 const idx_frame = vk_state->idx_frame;
+    u32 const n_batches = stage->draw_list.n_batches;
+    RecordingJob job_template = {
+      .render_stage    = stage,
+      .geometry_buffer = &vk_state->geometry_buffer,
+      .instance_buffer = vk_state->frame_resources[idx_frame].instance_buffer,
+    };
+    range (0, N_DESCRIPTOR_SET_INDICES) {
+      job_template.descriptor_sets[idx] = descriptor_sets[idx];
+    }
+
+    // If there isn't enough to be worth splitting up, we just record it all
+    // here, like any other command buffer. We also do that when caching, since
+    // secondary command buffers come from pools we reset every frame, and we
+    // hardly ever record then anyway.
+    u32 n_jobs = min(recording->n_max_jobs, n_batches / MIN_N_BATCHES_PER_RECORDING_JOB);
+    if (vk_state->command_buffer_cache.is_enabled) {
+      n_jobs = 1;
+    }
+    if (n_jobs <= 1) {
+      vkCmdBeginRenderPass(command_buffer, render_pass_info, VK_SUBPASS_CONTENTS_INLINE);
+      RecordingJob job = job_template;
+      job.command_buffer = command_buffer;
+      job.n_batches = n_batches;
+      CommandState command_state;
+      rendering::begin_command_state(&command_state, command_buffer);
+      record_batches(&job, &command_state);
+      vkCmdEndRenderPass(command_buffer);
+      return;
+    }
+
+    // Each job gets a contiguous range of batches, so that the draws still
+    // happen in the order given by the sorted draw list
+    u32 const n_batches_per_job = (n_batches + n_jobs - 1) / n_jobs;
+    FrameResources *frame_resources = &vk_state->frame_resources[idx_frame];
+    VkCommandBuffer secondary_command_buffers[MAX_N_RECORDING_JOBS];
+    range (0, n_jobs) {
+      RecordingJob *job = &recording->jobs[idx];
+      *job = job_template;
+      // Each job's pool is only ever used by that job, so it's fine for us to
+      // get a buffer from this one while earlier jobs are already recording
+      job->command_buffer = get_command_buffer(vk_state, &frame_resources->recording_command_pools[idx]);
+      job->inheritance_info = {
+        .sType       = VK_STRUCTURE_TYPE_COMMAND_BUFFER_INHERITANCE_INFO,
+        .renderPass  = render_pass_info->renderPass,
+        .subpass     = 0,
+        .framebuffer = render_pass_info->framebuffer,
+      };
+      job->idx_first_batch = idx * n_batches_per_job;
+      job->n_batches = min(n_batches_per_job, n_batches - job->idx_first_batch);
+      secondary_command_buffers[idx] = job->command_buffer;
+      tasks::push_group_task(recording->worker_pool, &recording->task_group, record_secondary_command_buffer, job);
+    }
+
+    vkCmdBeginRenderPass(command_buffer, render_pass_info, VK_SUBPASS_CONTENTS_SECONDARY_COMMAND_BUFFERS);
+    tasks::wait_for_group(recording->worker_pool, &recording->task_group);
+    vkCmdExecuteCommands(command_buffer, n_jobs, secondary_command_buffers);
+    vkCmdEndRenderPass(command_buffer);
+  }
+
+
+  static void init(VkState *vk_state, tasks::WorkerPool *worker_pool) {
+    ParallelRecording *recording = &vk_state->parallel_recording;
+    recording->worker_pool = worker_pool;
+    // The main thread records too while it waits, so we can have one more job
+    // than we have workers
+    recording->n_max_jobs = USE_PARALLEL_RECORDING ? min(worker_pool->n_workers + 1, MAX_N_RECORDING_JOBS) : 1;
+    range_named (idx_frame, 0, N_PARALLEL_FRAMES) {
+      FrameResources *frame_resources = &vk_state->frame_resources[idx_frame];
+      init_frame_command_pool(vk_state, &frame_resources->command_pool, VK_COMMAND_BUFFER_LEVEL_PRIMARY);
+      if (recording->n_max_jobs == 1) {
+        continue;
+      }
+      range (0, recording->n_max_jobs) {
+        init_frame_command_pool(vk_state, &frame_resources->recording_command_pools[idx],
+          VK_COMMAND_BUFFER_LEVEL_SECONDARY);
+      }
+    }
+    if (recording->n_max_jobs > 1) {
+      logs::info("Recording draws on up to %d threads", recording->n_max_jobs);
+    }
+    // Version 0 means a cached command buffer was never recorded
+    vk_state->command_buffer_cache.version = 1;
+  }
+
+
+  // Called once the frame's fence has signalled, so none of its command
+  // buffers are in use anymore
+  static void reset_frame_command_pools(VkState *vk_state, u32 idx_frame) {
+    FrameResources *frame_resources = &vk_state->frame_resources[idx_frame];
+    reset_frame_command_pool(vk_state, &frame_resources->command_pool);
+    range (0, vk_state->parallel_recording.n_max_jobs) {
+      reset_frame_command_pool(vk_state, &frame_resources->recording_command_pools[idx]);
+    }
+  }
+
+
+  // Destroying the pools frees their command buffers too
+  static void destroy(VkState *vk_state) {
+    range_named (idx_frame, 0, N_PARALLEL_FRAMES) {
+      FrameResources *frame_resources = &vk_state->frame_resources[idx_frame];
+      vkDestroyCommandPool(vk_state->device, frame_resources->command_pool.pool, nullptr);
+      range (0, MAX_N_RECORDING_JOBS) {
+        vkDestroyCommandPool(vk_state->device, frame_resources->recording_command_pools[idx].pool, nullptr);
+      }
+    }
+  }
+}
@@ -0,0 +1,503 @@
+/*
+  Reads what a shader expects from its pipeline layout and vertex input
+  straight out of its SPIR-V, so that we never have to keep a copy of that by
+  hand in sync with the GLSL.
+
+  We only understand as much SPIR-V as we need for that: descriptor bindings,
+  push constant blocks and vertex inputs.
+*/
+
+#include "vulkan.hpp"
+#include "memory.hpp"
+#include "logs.hpp"
+
+
+namespace vulkan::reflection {
+  static constexpr u32 SPIRV_MAGIC           = 0x07230203;
+  static constexpr u32 SPIRV_HEADER_N_WORDS  = 5;
+
+  // Opcodes
+  static constexpr u32 OP_ENTRY_POINT        = 15;
+  static constexpr u32 OP_TYPE_INT           = 21;
+  static constexpr u32 OP_TYPE_FLOAT         = 22;
+  static constexpr u32 OP_TYPE_VECTOR        = 23;
+  static constexpr u32 OP_TYPE_MATRIX        = 24;
+  static constexpr u32 OP_TYPE_IMAGE         = 25;
+  static constexpr u32 OP_TYPE_SAMPLER       = 26;
+  static constexpr u32 OP_TYPE_SAMPLED_IMAGE = 27;
+  static constexpr u32 OP_TYPE_ARRAY         = 28;
+  static constexpr u32 OP_TYPE_RUNTIME_ARRAY = 29;
+  static constexpr u32 OP_TYPE_STRUCT        = 30;
+  static constexpr u32 OP_TYPE_POINTER       = 32;
+  static constexpr u32 OP_CONSTANT           = 43;
+  static constexpr u32 OP_SPEC_CONSTANT      = 50;
+  static constexpr u32 OP_VARIABLE           = 59;
+  static constexpr u32 OP_DECORATE           = 71;
+  static constexpr u32 OP_MEMBER_DECORATE    = 72;
+
+  // Decorations
+  static constexpr u32 DECORATION_BUFFER_BLOCK   = 3;
+  static constexpr u32 DECORATION_ARRAY_STRIDE   = 6;
+  static constexpr u32 DECORATION_BUILT_IN       = 11;
+  static constexpr u32 DECORATION_LOCATION       = 30;
+  static constexpr u32 DECORATION_BINDING        = 33;
+  static constexpr u32 DECORATION_DESCRIPTOR_SET = 34;
+  static constexpr u32 DECORATION_OFFSET         = 35;
+
+  // Storage classes
+  static constexpr u32 STORAGE_CLASS_UNIFORM_CONSTANT = 0;
+  static constexpr u32 STORAGE_CLASS_INPUT            = 1;
+  static constexpr u32 STORAGE_CLASS_UNIFORM          = 2;
+  static constexpr u32 STORAGE_CLASS_PUSH_CONSTANT    = 9;
+  static constexpr u32 STORAGE_CLASS_STORAGE_BUFFER   = 12;
+
+  // Image dimensions
+  static constexpr u32 DIM_BUFFER       = 5;
+  static constexpr u32 DIM_SUBPASS_DATA = 6;
+
+  // Execution models, in the same order as `VkShaderStageFlagBits`
+  static constexpr VkShaderStageFlagBits EXECUTION_MODEL_STAGES[] = {
+    VK_SHADER_STAGE_VERTEX_BIT,
+    VK_SHADER_STAGE_TESSELLATION_CONTROL_BIT,
+    VK_SHADER_STAGE_TESSELLATION_EVALUATION_BIT,
+    VK_SHADER_STAGE_GEOMETRY_BIT,
+    VK_SHADER_STAGE_FRAGMENT_BIT,
+    VK_SHADER_STAGE_COMPUTE_BIT,
+  };
+
+  // What we know about each result id. Which fields mean something depends on
+  // the opcode that made it.
+  struct SpirvId {
+    u32 opcode;
+    // The pointee type for pointers, the element type for arrays and the
+    // pointer type for variables
+    u32 idx_type;
+    u32 storage_class;
+    // The value of constants, the width of scalars, the component count of
+    // vectors, the column count of matrices and the length id of arrays
+    u32 value;
+    // For images
+    u32 dim;
+    u32 sampled;
+    // Where the instruction that made this id starts, for structs, whose
+    // member types we read from there
+    u32 idx_word;
+    u32 idx_set;
+    u32 binding;
+    u32 location;
+    u32 array_stride;
+    bool has_binding;
+    bool has_location;
+    bool is_buffer_block;
+    bool is_built_in;
+  };
+
+  struct Spirv {
+    u32 const *words;
+    u32 n_words;
+    SpirvId *ids;
+    u32 n_ids;
+  };
+
+
+  static bool add_binding(ShaderReflection *reflection, ReflectedBinding const *new_binding) {
+    range (0, reflection->n_bindings) {
+      ReflectedBinding *binding = &reflection->bindings[idx];
+      if (binding->idx_set != new_binding->idx_set || binding->binding != new_binding->binding) {
+        continue;
+      }
+      if (binding->type != new_binding->type || binding->n_descriptors != new_binding->n_descriptors) {
+        logs::error("Shaders disagree on what set %d binding %d is", binding->idx_set, binding->binding);
+        return false;
+      }
+      binding->stage_flags |= new_binding->stage_flags;
+      return true;
+    }
+    if (reflection->n_bindings == MAX_N_REFLECTED_BINDINGS) {
+      logs::error("Shaders have more than %d bindings", MAX_N_REFLECTED_BINDINGS);
+      return false;
+    }
+    reflection->bindings[reflection->n_bindings++] = *new_binding;
+    return true;
+  }
+
+
+  // Adds everything in `from` to `reflection`
+  static bool merge(ShaderReflection *reflection, ShaderReflection const *from) {
+    range (0, from->n_bindings) {
+      if (!add_binding(reflection, &from->bindings[idx])) {
+        return false;
+      }
+    }
+    reflection->push_constant_stage_flags |= from->push_constant_stage_flags;
+    reflection->push_constant_size = max(reflection->push_constant_size, from->push_constant_size);
+    reflection->vertex_input_locations |= from->vertex_input_locations;
+    return true;
+  }
+
+
+  static ReflectedBinding const* find_binding(ShaderReflection const *reflection, u32 idx_set, u32 binding) {
+    range (0, reflection->n_bindings) {
+      if (reflection->bindings[idx].idx_set == idx_set && reflection->bindings[idx].binding == binding) {
+        return &reflection->bindings[idx];
+      }
+    }
+    return nullptr;
+  }
+
+
+  // Returns how many bindings `reflection` has in set `idx_set`. We write sets
+  // with `descriptors::write_set()`, which expects them to be bindings 0 to
+  // n - 1, so we complain if there are any gaps.
+  static u32 count_set_bindings(ShaderReflection const *reflection, u32 idx_set) {
+    u32 n_bindings = 0;
+    range (0, reflection->n_bindings) {
+      if (reflection->bindings[idx].idx_set == idx_set) {
+        n_bindings++;
+      }
+    }
+    range (0, n_bindings) {
+      if (!find_binding(reflection, idx_set, idx)) {
+        logs::fatal("Set %d has %d bindings, but no binding %d", idx_set, n_bindings, idx);
+      }
+    }
+    return n_bindings;
+  }
+
+
+  // Whether `shader` only uses what's in `layout`, which is what we made a
+  // pipeline layout from. Bindings that `layout` doesn't have, or has for
+  // different stages, mean we'd need a new pipeline layout.
+  static bool is_compatible(ShaderReflection const *shader, ShaderReflection const *layout) {
+    range (0, shader->n_bindings) {
+      ReflectedBinding const *shader_binding = &shader->bindings[idx];
+      ReflectedBinding const *layout_binding = find_binding(layout, shader_binding->idx_set, shader_binding->binding);
+      if (
+        !layout_binding ||
+        layout_binding->type != shader_binding->type ||
+        layout_binding->n_descriptors != shader_binding->n_descriptors ||
+        (layout_binding->stage_flags & shader_binding->stage_flags) != shader_binding->stage_flags
+      ) {
+        return false;
+      }
+    }
+    return shader->push_constant_size <= layout->push_constant_size &&
+      (layout->push_constant_stage_flags & shader->push_constant_stage_flags) == shader->push_constant_stage_flags;
+  }
+
+
+  static SpirvId* get_id(Spirv *spirv, u32 id) {
+    if (id >= spirv->n_ids) {
+      return nullptr;
+    }
+    return &spirv->ids[id];
+  }
+
+
+  static bool get_type_size(Spirv *spirv, u32 idx_type, u32 *size);
+
+
+  // The size of a struct is the end of its furthest member, which depends on
+  // the members' `Offset` decorations
+  static bool get_struct_size(Spirv *spirv, u32 idx_struct, u32 *size) {
+    SpirvId const *struct_type = get_id(spirv, idx_struct);
+    u32 const n_struct_words = spirv->words[struct_type->idx_word] >> 16;
+    u32 const *member_types = &spirv->words[struct_type->idx_word + 2];
+    u32 const n_members = n_struct_words - 2;
+
+    *size = 0;
+    u32 idx_word = SPIRV_HEADER_N_WORDS;
+    while (idx_word < spirv->n_words) {
+      u32 const *instruction = &spirv->words[idx_word];
+      u32 const n_words = instruction[0] >> 16;
+      u32 const opcode = instruction[0] & 0xffff;
+      idx_word += n_words;
+      if (
+        opcode != OP_MEMBER_DECORATE || n_words < 5 ||
+        instruction[1] != idx_struct || instruction[3] != DECORATION_OFFSET || instruction[2] >= n_members
+      ) {
+        continue;
+      }
+      u32 member_size;
+      if (!get_type_size(spirv, member_types[instruction[2]], &member_size)) {
+        return false;
+      }
+      *size = max(*size, instruction[4] + member_size);
+    }
+    return true;
+  }
+
+
+  // Only needs to work for the types that can go in push constant blocks
+  static bool get_type_size(Spirv *spirv, u32 idx_type, u32 *size) {
+    SpirvId const *type = get_id(spirv, idx_type);
+    if (!type) {
+      return false;
+    }
+    switch (type->opcode) {
+      case OP_TYPE_INT:
+      case OP_TYPE_FLOAT:
+        *size = type->value / 8;
+        return true;
+      case OP_TYPE_VECTOR:
+      case OP_TYPE_MATRIX: {
+        // Columns are vectors, and we assume they're packed, which is true
+        // for everything but matrices of vec3s
+        u32 component_size;
+        if (!get_type_size(spirv, type->idx_type, &component_size)) {
+          return false;
+        }
+        *size = component_size * type->value;
+        return true;
+      }
+      case OP_TYPE_ARRAY: {
+        SpirvId const *length = get_id(spirv, type->value);
+        if (!length || type->array_stride == 0) {
+          return false;
+        }
+        *size = type->array_stride * length->value;
+        return true;
+      }
+      case OP_TYPE_STRUCT:
+        return get_struct_size(spirv, idx_type, size);
+      default:
+        return false;
+    }
+  }
+
+
+  static bool get_descriptor_type(Spirv *spirv, SpirvId const *type, u32 storage_class, VkDescriptorType *result) {
+    switch (type->opcode) {
+      case OP_TYPE_SAMPLED_IMAGE:
+        *result = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+        return true;
+      case OP_TYPE_SAMPLER:
+        *result = VK_DESCRIPTOR_TYPE_SAMPLER;
+        return true;
+      case OP_TYPE_IMAGE:
+        if (type->dim == DIM_BUFFER) {
+          *result = type->sampled == 2 ?
+            VK_DESCRIPTOR_TYPE_STORAGE_TEXEL_BUFFER : VK_DESCRIPTOR_TYPE_UNIFORM_TEXEL_BUFFER;
+        } else if (type->dim == DIM_SUBPASS_DATA) {
+          *result = VK_DESCRIPTOR_TYPE_INPUT_ATTACHMENT;
+        } else {
+          *result = type->sampled == 2 ? VK_DESCRIPTOR_TYPE_STORAGE_IMAGE : VK_DESCRIPTOR_TYPE_SAMPLED_IMAGE;
+        }
+        return true;
+      case OP_TYPE_STRUCT:
+        if (storage_class == STORAGE_CLASS_STORAGE_BUFFER || type->is_buffer_block) {
+          *result = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+        } else {
+          *result = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
+        }
+        return true;
+      default:
+        return false;
+    }
+  }
+
+
+  static bool reflect_descriptor(
+    Spirv *spirv, SpirvId const *variable, VkShaderStageFlags stage_flags, ShaderReflection *reflection
+  ) {
+    SpirvId const *pointer = get_id(spirv, variable->idx_type);
+    SpirvId const *type = pointer ? get_id(spirv, pointer->idx_type) : nullptr;
+    if (!type) {
+      return false;
+    }
+
+    // Arrays of descriptors, where runtime arrays have 0 descriptors
+    u32 n_descriptors = 1;
+    if (type->opcode == OP_TYPE_ARRAY) {
+      SpirvId const *length = get_id(spirv, type->value);
+      if (!length) {
+        return false;
+      }
+      n_descriptors = length->value;
+      type = get_id(spirv, type->idx_type);
+    } else if (type->opcode == OP_TYPE_RUNTIME_ARRAY) {
+      n_descriptors = 0;
+      type = get_id(spirv, type->idx_type);
+    }
+    if (!type) {
+      return false;
+    }
+
+    ReflectedBinding binding = {
+      .idx_set       = variable->idx_set,
+      .binding       = variable->binding,
+      .n_descriptors = n_descriptors,
+      .stage_flags   = stage_flags,
+    };
+    if (!get_descriptor_type(spirv, type, variable->storage_class, &binding.type)) {
+      logs::error("Set %d binding %d has a type we don't understand", binding.idx_set, binding.binding);
+      return false;
+    }
+    return add_binding(reflection, &binding);
+  }
+
+
+  // Adds everything the shader in `code` declares to `reflection`, so calling
+  // this for several shaders gives us what all of them need together
+  static bool reflect(u8 const *code, size_t size, ShaderReflection *reflection) {
+    Spirv spirv = {
+      .words   = (u32 const*)code,
+      .n_words = (u32)(size / 4),
+    };
+    if (spirv.n_words < SPIRV_HEADER_N_WORDS || spirv.words[0] != SPIRV_MAGIC) {
+      logs::error("Shader is not valid SPIR-V");
+      return false;
+    }
+    spirv.n_ids = spirv.words[3];
+    if (spirv.n_ids == 0) {
+      logs::error("Shader is not valid SPIR-V");
+      return false;
+    }
+    // The pool zeroes its memory, so every id starts out knowing nothing
+    MemoryPool pool = {.size = sizeof(SpirvId) * spirv.n_ids};
+    defer { memory::destroy_memory_pool(&pool); };
+    spirv.ids = (SpirvId*)memory::push(&pool, sizeof(SpirvId) * spirv.n_ids, "spirv_ids");
+
+    // First, find out what every id is
+    VkShaderStageFlags stage_flags = 0;
+    u32 idx_word = SPIRV_HEADER_N_WORDS;
+    while (idx_word < spirv.n_words) {
+      u32 const *instruction = &spirv.words[idx_word];
+      u32 const n_words = instruction[0] >> 16;
+      u32 const opcode = instruction[0] & 0xffff;
+      if (n_words == 0 || idx_word + n_words > spirv.n_words) {
+        logs::error("Shader has a malformed instruction at word %d", idx_word);
+        return false;
+      }
+      idx_word += n_words;
+
+      if (opcode == OP_ENTRY_POINT) {
+        if (instruction[1] < LEN(EXECUTION_MODEL_STAGES)) {
+          stage_flags |= EXECUTION_MODEL_STAGES[instruction[1]];
+        }
+        continue;
+      }
+      if (opcode == OP_DECORATE) {
+        // Member offsets only matter for push constant blocks, and we look
+        // those up when we need them, see `get_struct_size()`
+        SpirvId *target = get_id(&spirv, instruction[1]);
+        if (!target) {
+          continue;
+        }
+        u32 const decoration = instruction[2];
+        u32 const operand = n_words >= 4 ? instruction[3] : 0;
+        switch (decoration) {
+          case DECORATION_BUFFER_BLOCK:   target->is_buffer_block = true; break;
+          case DECORATION_ARRAY_STRIDE:   target->array_stride = operand; break;
+          case DECORATION_BUILT_IN:       target->is_built_in = true; break;
+          case DECORATION_LOCATION:       target->location = operand; target->has_location = true; break;
+          case DECORATION_BINDING:        target->binding = operand; target->has_binding = true; break;
+          case DECORATION_DESCRIPTOR_SET: target->idx_set = operand; break;
+        }
+        continue;
+      }
+
+      // Everything else we care about makes a result id, which is the first
+      // operand for types, and the second one otherwise
+      bool const is_type = opcode >= OP_TYPE_INT && opcode <= OP_TYPE_POINTER;
+      bool const is_value = opcode == OP_CONSTANT || opcode == OP_SPEC_CONSTANT || opcode == OP_VARIABLE;
+      if ((!is_type && !is_value) || n_words < 3) {
+        continue;
+      }
+      SpirvId *id = get_id(&spirv, is_type ? instruction[1] : instruction[2]);
+      if (!id) {
+        continue;
+      }
+      id->opcode = opcode;
+      id->idx_word = idx_word - n_words;
+      switch (opcode) {
+        case OP_TYPE_INT:
+        case OP_TYPE_FLOAT:
+          id->value = instruction[2];
+          break;
+        case OP_TYPE_VECTOR:
+        case OP_TYPE_MATRIX:
+          if (n_words >= 4) {
+            id->idx_type = instruction[2];
+            id->value = instruction[3];
+          }
+          break;
+        case OP_TYPE_IMAGE:
+          if (n_words >= 9) {
+            id->dim = instruction[3];
+            id->sampled = instruction[7];
+          }
+          break;
+        case OP_TYPE_SAMPLED_IMAGE:
+        case OP_TYPE_RUNTIME_ARRAY:
+          id->idx_type = instruction[2];
+          break;
+        case OP_TYPE_ARRAY:
+          if (n_words >= 4) {
+            id->idx_type = instruction[2];
+            id->value = instruction[3];
+          }
+          break;
+        case OP_TYPE_POINTER:
+          if (n_words >= 4) {
+            id->storage_class = instruction[2];
+            id->idx_type = instruction[3];
+          }
+          break;
+        case OP_CONSTANT:
+        case OP_SPEC_CONSTANT:
+          // Arrays are never longer than 32 bits' worth, so the low word is
+          // enough. Spec constants give us their default value.
+          if (n_words >= 4) {
+            id->value = instruction[3];
+          }
+          break;
+        case OP_VARIABLE:
+          if (n_words >= 4) {
+            id->idx_type = instruction[1];
+            id->storage_class = instruction[3];
+          }
+          break;
+      }
+    }
+
+    // Then go through the variables, which are what the shader actually uses
+    // from the outside
+    range (0, spirv.n_ids) {
+      SpirvId const *variable = &spirv.ids[idx];
+      if (variable->opcode != OP_VARIABLE) {
+        continue;
+      }
+      switch (variable->storage_class) {
+        case STORAGE_CLASS_UNIFORM_CONSTANT:
+        case STORAGE_CLASS_UNIFORM:
+        case STORAGE_CLASS_STORAGE_BUFFER:
+          if (variable->has_binding && !reflect_descriptor(&spirv, variable, stage_flags, reflection)) {
+            return false;
+          }
+          break;
+        case STORAGE_CLASS_PUSH_CONSTANT: {
+          SpirvId const *pointer = get_id(&spirv, variable->idx_type);
+          u32 push_constant_size;
+          if (!pointer || !get_type_size(&spirv, pointer->idx_type, &push_constant_size)) {
+            logs::error("Could not work out the size of the shader's push constant block");
+            return false;
+          }
+          reflection->push_constant_stage_flags |= stage_flags;
+          reflection->push_constant_size = max(reflection->push_constant_size, push_constant_size);
+          break;
+        }
+        case STORAGE_CLASS_INPUT:
+          if (
+            (stage_flags & VK_SHADER_STAGE_VERTEX_BIT) &&
+            variable->has_location && !variable->is_built_in && variable->location < 32
+          ) {
+            reflection->vertex_input_locations |= 1u << variable->location;
+          }
+          break;
+      }
+    }
+
+    return true;
+  }
+}
@@ -1,12 +1,293 @@
+#include <string.h>
 #include "vulkan.hpp"
 #include "vulkan_rendering.hpp"
 
 
-void vulkan::rendering::render_drawable_component(DrawableComponent *drawable, VkCommandBuffer *command_buffer) {
-  VkBuffer const vertex_buffers[] = {drawable->vertex.buffer};
+namespace vulkan::rendering {
+  // Opaque sort keys look like this, so that we change state as rarely as
+  // possible and draw front-to-back within each state bucket:
+  //   [63..56] pipeline [55..40] material [39..24] mesh [23..0] depth
+  // Transparent sort keys must respect depth above all else, and go back-to-front:
+  //   [63..40] inverted depth [39..32] pipeline [31..16] material [15..0] mesh
+  static constexpr u32 SORT_KEY_PIPELINE_BITS = 8;
+  static constexpr u32 SORT_KEY_MATERIAL_BITS = 16;
+  static constexpr u32 SORT_KEY_MESH_BITS     = 16;
+  static constexpr u32 SORT_KEY_DEPTH_BITS    = 24;
+  static constexpr u32 N_RADIX_BUCKETS        = 256;
+
+
+  static u64 mask_bits(u64 value, u32 n_bits) {
+    return value & ((1ull << n_bits) - 1);
+  }
+
+
+  static u32 get_depth_bucket(f32 view_depth) {
+    // The bit patterns of non-negative floats sort the same way as the floats
+    // themselves, so the top bits make a decent logarithmic depth bucket.
+    f32 const clamped_depth = max(view_depth, 0.0f);
+    u32 depth_bits;
+    memcpy(&depth_bits, &clamped_depth, sizeof(depth_bits));
+    return depth_bits >> (32 - SORT_KEY_DEPTH_BITS);
+  }
+}
+
+
+void vulkan::rendering::begin_command_state(CommandState *command_state, VkCommandBuffer command_buffer) {
+  *command_state = {
+    .command_buffer = command_buffer,
+  };
+}
+
+
+void vulkan::rendering::bind_pipeline(
+  CommandState *command_state, VkPipeline pipeline, RenderStage const *render_stage
+) {
+  if (command_state->pipeline_layout != render_stage->pipeline_layout) {
+    // We don't try to be clever about layout compatibility, so a new layout
+    // means we have to bind all our descriptor sets and push our constants
+    // again.
+    command_state->pipeline_layout = render_stage->pipeline_layout;
+    command_state->draw_constants_range = render_stage->draw_constants_range;
+    range (0, N_DESCRIPTOR_SET_INDICES) {
+      command_state->descriptor_sets[idx] = VK_NULL_HANDLE;
+    }
+    command_state->has_draw_constants = false;
+  }
+  if (command_state->pipeline == pipeline) {
+    return;
+  }
+  vkCmdBindPipeline(command_state->command_buffer, VK_PIPELINE_BIND_POINT_GRAPHICS, pipeline);
+  command_state->pipeline = pipeline;
+}
+
+
+void vulkan::rendering::bind_descriptor_sets(
+  CommandState *command_state, u32 first_set, u32 n_sets, VkDescriptorSet const *descriptor_sets
+) {
+  assert(first_set + n_sets <= N_DESCRIPTOR_SET_INDICES);
+
+  // Only bind the range of sets that actually changed
+  u32 idx_first_changed = n_sets;
+  u32 idx_last_changed = 0;
+  range (0, n_sets) {
+    if (command_state->descriptor_sets[first_set + idx] != descriptor_sets[idx]) {
+      idx_first_changed = min(idx_first_changed, idx);
+      idx_last_changed = idx;
+      command_state->descriptor_sets[first_set + idx] = descriptor_sets[idx];
+    }
+  }
+  if (idx_first_changed == n_sets) {
+    return;
+  }
+
+  vkCmdBindDescriptorSets(command_state->command_buffer, VK_PIPELINE_BIND_POINT_GRAPHICS,
+    command_state->pipeline_layout, first_set + idx_first_changed, idx_last_changed - idx_first_changed + 1,
+    &descriptor_sets[idx_first_changed], 0, nullptr);
+}
+
+
+void vulkan::rendering::bind_vertex_buffer(CommandState *command_state, u32 binding, VkBuffer buffer) {
+  assert(binding < N_VERTEX_BINDINGS);
+  if (command_state->vertex_buffers[binding] == buffer) {
+    return;
+  }
+  VkBuffer const vertex_buffers[] = {buffer};
   VkDeviceSize const offsets[] = {0};
+  vkCmdBindVertexBuffers(command_state->command_buffer, binding, 1, vertex_buffers, offsets);
+  command_state->vertex_buffers[binding] = buffer;
+}
+
+
+void vulkan::rendering::bind_index_buffer(CommandState *command_state, VkBuffer buffer, VkIndexType index_type) {
+  if (command_state->index_buffer == buffer && command_state->index_type == index_type) {
+    return;
+  }
+  vkCmdBindIndexBuffer(command_state->command_buffer, buffer, 0, index_type);
+  command_state->index_buffer = buffer;
+  command_state->index_type = index_type;
+}
+
+
+void vulkan::rendering::push_draw_constants(CommandState *command_state, DrawConstants const *draw_constants) {
+  if (
+    command_state->has_draw_constants &&
+    memcmp(&command_state->draw_constants, draw_constants, sizeof(DrawConstants)) == 0
+  ) {
+    return;
+  }
+  // We only push as much as the shaders read, which might be nothing at all
+  VkPushConstantRange const *push_range = &command_state->draw_constants_range;
+  if (push_range->size > 0) {
+    vkCmdPushConstants(command_state->command_buffer, command_state->pipeline_layout, push_range->stageFlags,
+      push_range->offset, push_range->size, draw_constants);
+  }
+  command_state->draw_constants = *draw_constants;
+  command_state->has_draw_constants = true;
+}
+
+
+void vulkan::rendering::bind_geometry_buffer(CommandState *command_state, GeometryBuffer *geometry_buffer) {
+  // The index type depends on the mesh, so the index buffer gets bound for
+  // each batch instead.
+  bind_vertex_buffer(command_state, VERTEX_BINDING, geometry_buffer->vertex.buffer);
+}
+
+
+u64 vulkan::rendering::make_sort_key(
+  DrawOrder order, u32 idx_pipeline, u32 idx_material, u32 idx_mesh, f32 view_depth
+) {
+  u64 const pipeline = mask_bits(idx_pipeline, SORT_KEY_PIPELINE_BITS);
+  u64 const material = mask_bits(idx_material, SORT_KEY_MATERIAL_BITS);
+  u64 const mesh = mask_bits(idx_mesh, SORT_KEY_MESH_BITS);
+  u64 const depth = get_depth_bucket(view_depth);
+
+  if (order == DrawOrder::front_to_back) {
+    return (pipeline << (SORT_KEY_MATERIAL_BITS + SORT_KEY_MESH_BITS + SORT_KEY_DEPTH_BITS)) |
+      (material << (SORT_KEY_MESH_BITS + SORT_KEY_DEPTH_BITS)) |
+      (mesh << SORT_KEY_DEPTH_BITS) |
+      depth;
+  } else {
+    u64 const inverted_depth = mask_bits(~depth, SORT_KEY_DEPTH_BITS);
+    return (inverted_depth << (SORT_KEY_PIPELINE_BITS + SORT_KEY_MATERIAL_BITS + SORT_KEY_MESH_BITS)) |
+      (pipeline << (SORT_KEY_MATERIAL_BITS + SORT_KEY_MESH_BITS)) |
+      (material << SORT_KEY_MESH_BITS) |
+      mesh;
+  }
+}
+
+
+void vulkan::rendering::sort_draw_list(DrawList *draw_list, MemoryPool *memory_pool) {
+  // LSD radix sort, one byte at a time. This is stable, so draws with equal
+  // keys keep their insertion order.
+  if (draw_list->n_draws < 2) {
+    return;
+  }
+
+  DrawCall *src = draw_list->draws;
+  DrawCall *dest = (DrawCall*)memory::push(memory_pool, sizeof(DrawCall) * draw_list->n_draws,
+    "draw_list_sort_scratch");
+
+  for (u32 shift = 0; shift < 64; shift += 8) {
+    u32 counts[N_RADIX_BUCKETS] = {};
+    range (0, draw_list->n_draws) {
+      counts[(src[idx].sort_key >> shift) & 0xFF]++;
+    }
+
+    // If every key has the same byte here, this pass wouldn't move anything
+    if (counts[(src[0].sort_key >> shift) & 0xFF] == draw_list->n_draws) {
+      continue;
+    }
+
+    u32 offsets[N_RADIX_BUCKETS];
+    u32 offset = 0;
+    range (0, N_RADIX_BUCKETS) {
+      offsets[idx] = offset;
+      offset += counts[idx];
+    }
+
+    range (0, draw_list->n_draws) {
+      dest[offsets[(src[idx].sort_key >> shift) & 0xFF]++] = src[idx];
+    }
+
+    DrawCall *tmp = src;
+    src = dest;
+    dest = tmp;
+  }
+
+  // After an odd number of passes, the sorted data lives in the scratch array
+  if (src != draw_list->draws) {
+    memcpy(draw_list->draws, src, sizeof(DrawCall) * draw_list->n_draws);
+  }
+}
+
+
+void vulkan::rendering::build_draw_list(
+  DrawList *draw_list,
+  VkState *vk_state,
+  FrameResources *frame_resources,
+  RenderStageName render_stage,
+  DrawOrder order,
+  m4 const *view,
+  MemoryPool *memory_pool
+) {
+  draw_list->draws = (DrawCall*)memory::push(memory_pool, sizeof(DrawCall) * vk_state->n_entities, "draw_list");
+  draw_list->n_draws = 0;
+
+  range (0, vk_state->n_entities) {
+    DrawableComponent *drawable = &vk_state->drawable_components[idx];
+    if (!has(drawable->target_render_stages, render_stage)) {
+      continue;
+    }
+    f32 const view_depth = -((*view) * v4(drawable->position, 1.0f)).z;
+    // Each stage has one pipeline per vertex layout. With bindless textures,
+    // the material doesn't change any binds, so we leave it out of the key,
+    // which puts draws of the same mesh next to each other to be merged.
+    Mesh *mesh = &vk_state->meshes[drawable->idx_mesh];
+    u32 const idx_sort_material = vk_state->is_bindless_enabled ? 0 : drawable->idx_material;
+    draw_list->draws[draw_list->n_draws++] = {
+      .sort_key = make_sort_key(order, (u32)mesh->layout, idx_sort_material, drawable->idx_mesh, view_depth),
+      .drawable = drawable,
+    };
+  }
+
+  sort_draw_list(draw_list, memory_pool);
+
+  // Write out per-instance data, and merge consecutive draws that share a
+  // mesh and material into a single instanced batch. The sort key puts these
+  // next to each other for opaque draws. Transparent draws only get merged
+  // when they happen to be adjacent in depth order, which keeps them correct.
+  // With bindless textures, the material comes from the instance data, so
+  // draws only need to share a mesh.
+  draw_list->batches = (DrawBatch*)memory::push(memory_pool, sizeof(DrawBatch) * draw_list->n_draws,
+    "draw_list_batches");
+  draw_list->n_batches = 0;
+
+  range (0, draw_list->n_draws) {
+    DrawableComponent *drawable = draw_list->draws[idx].drawable;
+    Mesh *mesh = &vk_state->meshes[drawable->idx_mesh];
+
+    assert(frame_resources->n_instances < MAX_N_INSTANCES);
+    u32 idx_instance = frame_resources->n_instances++;
+    frame_resources->instance_data[idx_instance] = {
+      .position           = drawable->position,
+      .idx_albedo_texture = vk_state->materials[drawable->idx_material].idx_albedo_texture,
+    };
+
+    DrawBatch *last_batch = draw_list->n_batches > 0 ? &draw_list->batches[draw_list->n_batches - 1] : nullptr;
+    if (
+      last_batch && last_batch->mesh == mesh &&
+      (vk_state->is_bindless_enabled || last_batch->idx_material == drawable->idx_material)
+    ) {
+      last_batch->n_instances++;
+    } else {
+      draw_list->batches[draw_list->n_batches++] = {
+        .mesh           = mesh,
+        .idx_material   = drawable->idx_material,
+        .first_instance = idx_instance,
+        .n_instances    = 1,
+      };
+    }
+  }
+}
+
 
-  vkCmdBindVertexBuffers(*command_buffer, 0, 1, vertex_buffers, offsets);
-  vkCmdBindIndexBuffer(*command_buffer, drawable->index.buffer, 0, VK_INDEX_TYPE_UINT32);
-  vkCmdDrawIndexed(*command_buffer, drawable->index.n_items, 1, 0, 0, 0);
+void vulkan::rendering::render_draw_batch(
+  DrawBatch *batch, RenderStage *render_stage, GeometryBuffer *geometry_buffer, CommandState *command_state
+) {
+  // The vertex buffer has already been bound for the whole stage, so we only
+  // have to pick the pipeline and index type for this mesh's layout and push
+  // the draw's constants, which are no-ops if the previous batch used the
+  // same ones, and then point the draw at the right range.
+  Mesh *mesh = batch->mesh;
+  VkPipeline pipeline = render_stage->pipelines[(u32)mesh->layout];
+  assert(pipeline != VK_NULL_HANDLE);
+  bind_pipeline(command_state, pipeline, render_stage);
+  bind_index_buffer(command_state, geometry_buffer->index.buffer, mesh->index_type);
+  DrawConstants const draw_constants = {
+    .position_scale  = mesh->position_scale,
+    .position_offset = mesh->position_offset,
+  };
+  push_draw_constants(command_state, &draw_constants);
+  vkCmdDrawIndexed(command_state->command_buffer, mesh->n_indices, batch->n_instances, mesh->first_index,
+    (i32)mesh->vertex_offset, batch->first_instance);
 }
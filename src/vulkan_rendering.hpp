@@ -2,5 +2,27 @@
 
 
 namespace vulkan::rendering {
-  void render_drawable_component(DrawableComponent *drawable, VkCommandBuffer *command_buffer);
+  void begin_command_state(CommandState *command_state, VkCommandBuffer command_buffer);
+  void bind_pipeline(CommandState *command_state, VkPipeline pipeline, RenderStage const *render_stage);
+  void bind_descriptor_sets(
+    CommandState *command_state, u32 first_set, u32 n_sets, VkDescriptorSet const *descriptor_sets
+  );
+  void bind_vertex_buffer(CommandState *command_state, u32 binding, VkBuffer buffer);
+  void bind_index_buffer(CommandState *command_state, VkBuffer buffer, VkIndexType index_type);
+  void push_draw_constants(CommandState *command_state, DrawConstants const *draw_constants);
+  void bind_geometry_buffer(CommandState *command_state, GeometryBuffer *geometry_buffer);
+  u64 make_sort_key(DrawOrder order, u32 idx_pipeline, u32 idx_material, u32 idx_mesh, f32 view_depth);
+  void sort_draw_list(DrawList *draw_list, MemoryPool *memory_pool);
+  void build_draw_list(
+    DrawList *draw_list,
+    VkState *vk_state,
+    FrameResources *frame_resources,
+    RenderStageName render_stage,
+    DrawOrder order,
+    m4 const *view,
+    MemoryPool *memory_pool
+  );
+  void render_draw_batch(
+    DrawBatch *batch, RenderStage *render_stage, GeometryBuffer *geometry_buffer, CommandState *command_state
+  );
 }
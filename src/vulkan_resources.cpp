@@ -6,12 +6,148 @@
 #include <chrono>
 #include <filesystem>
 #include <iostream>
+#include <string.h>
 #include "stb.hpp"
 #include "vulkan.hpp"
 #include "vkutils.hpp"
+#include "util.hpp"
+#include "logs.hpp"
+#include "meshopt.hpp"
+#include "ktx.hpp"
+#include "pack.hpp"
+#include "tasks.hpp"
+#include "constants.hpp"
+#include "../src_external/pstr.h"
 
 
 namespace vulkan::resources {
+  static constexpr u32 MAX_N_IMAGE_TEXTURE_LOADS = 64;
+
+  enum class TextureCompressionFamily { bc, astc, etc2 };
+
+  struct CompressedTextureVariant {
+    char const *extension;
+    TextureCompressionFamily family;
+  };
+
+  // Compressed versions of a texture live next to it, with these extensions.
+  // We take the first one that the device supports and that exists. These are
+  // all for color textures, so there's no BC5, which only has red and green.
+  static constexpr CompressedTextureVariant COMPRESSED_TEXTURE_VARIANTS[] = {
+    {".bc7.ktx2", TextureCompressionFamily::bc},
+    {".bc3.ktx2", TextureCompressionFamily::bc},
+    {".bc1.ktx2", TextureCompressionFamily::bc},
+    {".astc.ktx2", TextureCompressionFamily::astc},
+    {".etc2.ktx2", TextureCompressionFamily::etc2},
+  };
+
+
+  static bool is_texture_compression_family_supported(VkState *vk_state, TextureCompressionFamily family) {
+    switch (family) {
+      case TextureCompressionFamily::bc:
+        return vk_state->physical_device_features.textureCompressionBC;
+      case TextureCompressionFamily::astc:
+        return vk_state->physical_device_features.textureCompressionASTC_LDR;
+      case TextureCompressionFamily::etc2:
+        return vk_state->physical_device_features.textureCompressionETC2;
+    }
+    return false;
+  }
+
+
+  static bool init_texture_from_levels(
+    VkState *vk_state, ImageResources *image_resources, char const *name,
+    VkFormat format, u32 width, u32 height, u32 n_mip_levels,
+    u8 const * const *level_data, VkDeviceSize const *level_sizes,
+    files::FileView *view
+  ) {
+    if (n_mip_levels == 0 || n_mip_levels > MAX_N_MIP_LEVELS) {
+      logs::warning("Texture %s has an unsupported number of mip levels (%d)", name, n_mip_levels);
+      return false;
+    }
+
+    // For compressed textures, the feature bits tell us about whole families,
+    // but let's make sure this particular format is actually usable
+    VkFormatProperties format_properties;
+    vkGetPhysicalDeviceFormatProperties(vk_state->physical_device, format, &format_properties);
+    if (!(format_properties.optimalTilingFeatures & VK_FORMAT_FEATURE_SAMPLED_IMAGE_BIT)) {
+      logs::warning("Texture %s has a format that can't be sampled on this device", name);
+      return false;
+    }
+
+    // We have every level on the CPU already, so we only upload the smallest
+    // ones now, and stream in the rest as we need them
+    streaming::init_streaming_texture(vk_state, image_resources, format, width, height, n_mip_levels,
+      level_data, level_sizes, view);
+
+    return true;
+  }
+
+
+  // Cooked textures are already in their final layout with all their levels,
+  // so we upload them straight out of the mapped asset pack.
+  static bool init_packed_texture(VkState *vk_state, ImageResources *image_resources, char const *entry_name) {
+    pack::Texture texture;
+    if (!pack::get_texture(&vk_state->asset_pack, entry_name, &texture)) {
+      return false;
+    }
+    if (!init_texture_from_levels(vk_state, image_resources, entry_name,
+      (VkFormat)texture.vk_format, texture.width, texture.height, texture.n_mip_levels,
+      texture.level_data, texture.level_sizes, nullptr)
+    ) {
+      return false;
+    }
+    logs::info("Loaded texture %s from asset pack", entry_name);
+    return true;
+  }
+
+
+  static bool init_compressed_texture(VkState *vk_state, ImageResources *image_resources, char const *base_path) {
+    range (0, LEN(COMPRESSED_TEXTURE_VARIANTS)) {
+      CompressedTextureVariant const *variant = &COMPRESSED_TEXTURE_VARIANTS[idx];
+      if (!is_texture_compression_family_supported(vk_state, variant->family)) {
+        continue;
+      }
+
+      char path[MAX_PATH] = {};
+      pstr_vcat(path, sizeof(path), base_path, variant->extension, nullptr);
+
+      char entry_name[pack::MAX_ENTRY_NAME_LENGTH];
+      pack::get_entry_name(entry_name, sizeof(entry_name), path);
+      if (init_packed_texture(vk_state, image_resources, entry_name)) {
+        return true;
+      }
+
+      // KTX2 levels are already laid out the way we want, so map the file
+      // and upload straight out of it. The streaming texture keeps the mapping
+      // around if we succeed, which leaves nothing for us to unmap.
+      files::FileView view;
+      if (!files::map_file(&view, path)) {
+        continue;
+      }
+      defer { files::unmap_file(&view); };
+
+      ktx::Texture texture;
+      if (!ktx::parse_ktx2(&texture, view.data, view.size)) {
+        logs::warning("Could not parse compressed texture %s", path);
+        continue;
+      }
+
+      if (!init_texture_from_levels(vk_state, image_resources, path,
+        texture.format, texture.width, texture.height, texture.n_mip_levels,
+        texture.level_data, texture.level_sizes, &view)
+      ) {
+        continue;
+      }
+
+      logs::info("Loaded compressed texture %s", path);
+      return true;
+    }
+
+    return false;
+  }
+
+
   static void init_static_textures(VkState *vk_state) {
     // Load dummy
     {
@@ -25,6 +161,7 @@ namespace vulkan::resources {
         &vk_state->dummy_image,
         vk_state->physical_device,
         width, height,
+        1,
         VK_FORMAT_R8G8B8A8_SRGB,
         VK_IMAGE_TILING_OPTIMAL,
         VK_IMAGE_USAGE_TRANSFER_DST_BIT | VK_IMAGE_USAGE_SAMPLED_BIT,
@@ -32,15 +169,17 @@ namespace vulkan::resources {
         VK_IMAGE_ASPECT_COLOR_BIT,
         vk_state->physical_device_properties);
 
-      vkutils::upload_image(
-        vk_state->device,
-        &vk_state->dummy_image,
-        vk_state->physical_device,
-        image,
-        width, height,
-        VK_FORMAT_R8G8B8A8_SRGB,
-        vk_state->graphics_queue,
-        vk_state->command_pool);
+      u8 const *level_data[] = {image};
+      VkDeviceSize const level_sizes[] = {sizeof(image)};
+      VkBuffer staging_buffer;
+      VkDeviceMemory staging_buffer_memory;
+      VkCommandBuffer const command_buffer = vkutils::begin_command_buffer(vk_state->device, vk_state->command_pool);
+      vkutils::record_image_levels_upload(vk_state->device, vk_state->physical_device, command_buffer,
+        &vk_state->dummy_image, level_data, level_sizes, width, height, &staging_buffer, &staging_buffer_memory);
+      sync::submit_one_off_and_wait(vk_state, vk_state->graphics_queue, &vk_state->graphics_timeline,
+        vk_state->command_pool, command_buffer);
+      vkDestroyBuffer(vk_state->device, staging_buffer, nullptr);
+      vkFreeMemory(vk_state->device, staging_buffer_memory, nullptr);
     }
   }
 
@@ -50,37 +189,153 @@ namespace vulkan::resources {
   }
 
 
-  static void init_textures(VkState *vk_state) {
-    // Load alpaca
-    {
-      int width, height, n_channels;
-      unsigned char *image = files::load_image("../peony/resources/textures/alpaca.jpg", &width, &height, &n_channels,
-        STBI_rgb_alpha, false);
-      defer { files::free_image(image); };
+  struct ImageTextureLoad {
+    ImageResources *image_resources;
+    char const *path;
+  };
 
-      /* std::this_thread::sleep_for(std::chrono::milliseconds(2500)); */
+
+  static void init_image_textures(
+    VkState *vk_state, tasks::WorkerPool *worker_pool, ImageTextureLoad const *loads, u32 n_loads
+  ) {
+    // We read all the files in one batch, then decode all the images in
+    // parallel, straight into one shared staging buffer, and then upload each
+    // one from its place in there. The headers tell us how big each image is,
+    // so we can lay the staging buffer out before decoding anything.
+    size_t encoded_size = 0;
+    range (0, n_loads) {
+      encoded_size += (files::get_file_size(loads[idx].path) + 15) & ~(size_t)15;
+    }
+    // The reader goes first, so that it's aligned for its lock
+    MemoryPool temp_memory_pool = {
+      .size = sizeof(files::FileReader) +
+        (sizeof(files::FileReadRequest) + sizeof(files::ImageDecodeRequest) + sizeof(VkDeviceSize)) * n_loads +
+        encoded_size,
+    };
+    defer { memory::destroy_memory_pool(&temp_memory_pool); };
+    files::FileReader *reader = (files::FileReader*)memory::push(&temp_memory_pool,
+      sizeof(files::FileReader), "image_file_reader");
+    files::FileReadRequest *reads = (files::FileReadRequest*)memory::push(&temp_memory_pool,
+      sizeof(files::FileReadRequest) * n_loads, "image_file_reads");
+    files::ImageDecodeRequest *requests = (files::ImageDecodeRequest*)memory::push(&temp_memory_pool,
+      sizeof(files::ImageDecodeRequest) * n_loads, "image_decode_requests");
+    VkDeviceSize *staging_offsets = (VkDeviceSize*)memory::push(&temp_memory_pool,
+      sizeof(VkDeviceSize) * n_loads, "image_staging_offsets");
+
+    range (0, n_loads) {
+      size_t const file_size = files::get_file_size(loads[idx].path);
+      reads[idx] = {
+        .path      = loads[idx].path,
+        .dest      = (u8*)memory::push(&temp_memory_pool, (file_size + 15) & ~(size_t)15, loads[idx].path),
+        .dest_size = file_size,
+      };
+    }
+    files::init_file_reader(reader, worker_pool);
+    files::submit_reads(reader, reads, n_loads);
+    while (files::FileReadRequest *read = files::wait_for_read(reader)) {
+      if (!read->did_succeed || read->n_bytes_read != read->dest_size) {
+        logs::fatal("Could not read image %s", read->path);
+      }
+    }
+    files::destroy_file_reader(reader);
+
+    VkDeviceSize staging_size = 0;
+    range (0, n_loads) {
+      i32 width, height, n_channels;
+      if (!files::get_image_info_from_memory(reads[idx].dest, reads[idx].n_bytes_read, &width, &height, &n_channels)) {
+        logs::fatal("Could not read image header for %s: %s", loads[idx].path, stbi_failure_reason());
+      }
+      staging_offsets[idx] = staging_size;
+      requests[idx] = {
+        .path         = loads[idx].path,
+        .encoded_data = reads[idx].dest,
+        .encoded_size = reads[idx].n_bytes_read,
+        .should_flip  = false,
+        .dest_size    = (size_t)width * height * 4,
+      };
+      staging_size = (staging_size + requests[idx].dest_size + 15) & ~(VkDeviceSize)15;
+    }
+
+    VkBuffer staging_buffer;
+    VkDeviceMemory staging_buffer_memory;
+    vkutils::create_buffer(vk_state->device, vk_state->physical_device,
+      staging_size,
+      VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
+      VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+      &staging_buffer,
+      &staging_buffer_memory);
+    defer {
+      vkDestroyBuffer(vk_state->device, staging_buffer, nullptr);
+      vkFreeMemory(vk_state->device, staging_buffer_memory, nullptr);
+    };
+    void *staging_memory;
+    vkMapMemory(vk_state->device, staging_buffer_memory, 0, staging_size, 0, &staging_memory);
+    defer { vkUnmapMemory(vk_state->device, staging_buffer_memory); };
+
+    range (0, n_loads) {
+      requests[idx].dest = (u8*)staging_memory + staging_offsets[idx];
+    }
+    files::decode_images(worker_pool, requests, n_loads);
+
+    range (0, n_loads) {
+      files::ImageDecodeRequest const *request = &requests[idx];
+      if (!request->did_succeed) {
+        logs::fatal("Could not load image %s", request->path);
+      }
+      u32 const width = (u32)request->width;
+      u32 const height = (u32)request->height;
 
       vkutils::create_image_resources_with_sampler(
         vk_state->device,
-        &vk_state->alpaca,
+        loads[idx].image_resources,
         vk_state->physical_device,
         width, height,
+        images::get_n_mip_levels(width, height),
         VK_FORMAT_R8G8B8A8_SRGB,
         VK_IMAGE_TILING_OPTIMAL,
-        VK_IMAGE_USAGE_TRANSFER_DST_BIT | VK_IMAGE_USAGE_SAMPLED_BIT,
+        VK_IMAGE_USAGE_TRANSFER_SRC_BIT | VK_IMAGE_USAGE_TRANSFER_DST_BIT | VK_IMAGE_USAGE_SAMPLED_BIT,
         VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
         VK_IMAGE_ASPECT_COLOR_BIT,
         vk_state->physical_device_properties);
 
-      vkutils::upload_image(
+      VkBuffer mip_staging_buffer;
+      VkDeviceMemory mip_staging_buffer_memory;
+      VkCommandBuffer const command_buffer = vkutils::begin_command_buffer(vk_state->device, vk_state->command_pool);
+      vkutils::record_image_upload_from_staging(
         vk_state->device,
-        &vk_state->alpaca,
         vk_state->physical_device,
-        image,
+        command_buffer,
+        loads[idx].image_resources,
+        staging_buffer,
+        staging_offsets[idx],
+        request->dest,
         width, height,
         VK_FORMAT_R8G8B8A8_SRGB,
-        vk_state->asset_queue,
-        vk_state->asset_command_pool);
+        &mip_staging_buffer,
+        &mip_staging_buffer_memory);
+      sync::submit_one_off_and_wait(vk_state, vk_state->graphics_queue, &vk_state->graphics_timeline,
+        vk_state->command_pool, command_buffer);
+      vkDestroyBuffer(vk_state->device, mip_staging_buffer, nullptr);
+      vkFreeMemory(vk_state->device, mip_staging_buffer_memory, nullptr);
+    }
+  }
+
+
+  static void init_textures(VkState *vk_state, tasks::WorkerPool *worker_pool) {
+    ImageTextureLoad image_loads[MAX_N_IMAGE_TEXTURE_LOADS];
+    u32 n_image_loads = 0;
+
+    // Load alpaca, preferring a compressed version if we have one, then a
+    // cooked one from the asset pack, then the original image
+    if (
+      !init_compressed_texture(vk_state, &vk_state->alpaca, "../peony/resources/textures/alpaca") &&
+      !init_packed_texture(vk_state, &vk_state->alpaca, "alpaca")
+    ) {
+      image_loads[n_image_loads++] = {&vk_state->alpaca, "../peony/resources/textures/alpaca.jpg"};
+    }
+
+    if (n_image_loads > 0) {
+      init_image_textures(vk_state, worker_pool, image_loads, n_image_loads);
     }
   }
 
@@ -90,6 +345,30 @@ namespace vulkan::resources {
   }
 
 
+  // Puts a texture in the bindless texture table, and gives back its index
+  static u32 add_bindless_texture(VkState *vk_state, ImageResources *image_resources) {
+    u32 const n_max_textures = vk_state->is_bindless_enabled ?
+      vk_state->n_max_bindless_textures : MAX_N_BINDLESS_TEXTURES;
+    if (vk_state->n_bindless_textures == n_max_textures) {
+      logs::fatal("Could not add bindless texture, we already have %d", n_max_textures);
+    }
+    u32 const idx_texture = vk_state->n_bindless_textures++;
+    vk_state->bindless_textures[idx_texture] = image_resources;
+    return idx_texture;
+  }
+
+
+  static void init_materials(VkState *vk_state) {
+    // The dummy goes first, so that it's what an index of 0 gets us
+    add_bindless_texture(vk_state, &vk_state->dummy_image);
+    u32 const idx_alpaca = add_bindless_texture(vk_state, &vk_state->alpaca);
+
+    vk_state->materials[vk_state->n_materials++] = {
+      .idx_albedo_texture = idx_alpaca,
+    };
+  }
+
+
   static void init_uniform_buffers(VkState *vk_state) {
     range (0, N_PARALLEL_FRAMES) {
       FrameResources *frame_resources = &vk_state->frame_resources[idx];
@@ -107,101 +386,296 @@ namespace vulkan::resources {
           VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
         &frame_resources->entity_uniform_buffer,
         &frame_resources->entity_uniform_buffer_memory);
+      vkutils::create_buffer(vk_state->device, vk_state->physical_device,
+        sizeof(InstanceData) * MAX_N_INSTANCES,
+        VK_BUFFER_USAGE_VERTEX_BUFFER_BIT,
+        VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
+          VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+        &frame_resources->instance_buffer,
+        &frame_resources->instance_buffer_memory);
+      vkMapMemory(vk_state->device, frame_resources->instance_buffer_memory, 0, VK_WHOLE_SIZE, 0,
+        (void**)&frame_resources->instance_data);
     }
   }
 
 
-  static void init_entities(VkState *vk_state) {
-    // TODO: #slow Allocate memory only once, and split that up ourselves into the
-    // two buffers using the memory offsets in e.g. `vkCmdBindVertexBuffers()`.
-    // vulkan-tutorial.com/Vertex_buffers/Index_buffer.html
+  static void init_geometry_buffer(VkState *vk_state) {
+    GeometryBuffer *geometry_buffer = &vk_state->geometry_buffer;
+    *geometry_buffer = {};
+    vkutils::create_buffer(vk_state->device, vk_state->physical_device,
+      GEOMETRY_VERTEX_BUFFER_SIZE,
+      VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_VERTEX_BUFFER_BIT,
+      VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+      &geometry_buffer->vertex.buffer,
+      &geometry_buffer->vertex.memory);
+    vkutils::create_buffer(vk_state->device, vk_state->physical_device,
+      GEOMETRY_INDEX_BUFFER_SIZE,
+      VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_INDEX_BUFFER_BIT,
+      VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+      &geometry_buffer->index.buffer,
+      &geometry_buffer->index.memory);
+  }
+
+
+  static void destroy_geometry_buffer(VkState *vk_state) {
+    vkutils::destroy_buffer_resources(vk_state->device, &vk_state->geometry_buffer.vertex);
+    vkutils::destroy_buffer_resources(vk_state->device, &vk_state->geometry_buffer.index);
+  }
+
+
+  static VkDeviceSize alloc_geometry_range(
+    VkDeviceSize *bytes_used, VkDeviceSize buffer_size, VkDeviceSize size, VkDeviceSize alignment
+  ) {
+    VkDeviceSize offset = ((*bytes_used + alignment - 1) / alignment) * alignment;
+    if (offset + size > buffer_size) {
+      logs::fatal("Ran out of space in the geometry buffer.");
+    }
+    *bytes_used = offset + size;
+    return offset;
+  }
+
+
+  static i16 f32_to_snorm16(f32 value) {
+    return (i16)glm::round(clamp(value, -1.0f, 1.0f) * 32767.0f);
+  }
+
+
+  static v2 encode_octahedral(v3 normal) {
+    // Project onto the octahedron |x| + |y| + |z| = 1, then fold the lower
+    // half over the diagonals so that everything fits in [-1, 1]^2.
+    v3 n = normal / (glm::abs(normal.x) + glm::abs(normal.y) + glm::abs(normal.z));
+    v2 encoded = v2(n.x, n.y);
+    if (n.z < 0.0f) {
+      v2 const sign_not_zero = v2(encoded.x >= 0.0f ? 1.0f : -1.0f, encoded.y >= 0.0f ? 1.0f : -1.0f);
+      encoded = (v2(1.0f) - glm::abs(v2(encoded.y, encoded.x))) * sign_not_zero;
+    }
+    return encoded;
+  }
+
+
+  static void quantize_vertices(
+    QuantizedVertex *quantized_vertices,
+    v3 *position_scale,
+    v3 *position_offset,
+    Vertex const *vertices,
+    u32 n_vertices
+  ) {
+    v3 bounds_min = vertices[0].position;
+    v3 bounds_max = vertices[0].position;
+    range (1, n_vertices) {
+      bounds_min = min(bounds_min, vertices[idx].position);
+      bounds_max = max(bounds_max, vertices[idx].position);
+    }
+
+    // Map the bounding box onto [-1, 1] on each axis. Flat axes get a scale of
+    // 1 so that we don't divide by zero.
+    *position_offset = (bounds_min + bounds_max) * 0.5f;
+    *position_scale = (bounds_max - bounds_min) * 0.5f;
+    range_named (idx_axis, 0, 3) {
+      if ((*position_scale)[idx_axis] <= 0.0f) {
+        (*position_scale)[idx_axis] = 1.0f;
+      }
+    }
+
+    range (0, n_vertices) {
+      Vertex const *vertex = &vertices[idx];
+      v3 const position = (vertex->position - *position_offset) / *position_scale;
+      v3 const normal = length(vertex->normal) > 0.0f ? normalize(vertex->normal) : v3(0.0f, 0.0f, 1.0f);
+      v2 const octahedral_normal = encode_octahedral(normal);
+      quantized_vertices[idx] = {
+        .position = {
+          f32_to_snorm16(position.x), f32_to_snorm16(position.y), f32_to_snorm16(position.z), 0,
+        },
+        .normal = {f32_to_snorm16(octahedral_normal.x), f32_to_snorm16(octahedral_normal.y)},
+        .tex_coords = {
+          (u16)glm::packHalf1x16(vertex->tex_coords.x), (u16)glm::packHalf1x16(vertex->tex_coords.y),
+        },
+      };
+    }
+  }
+
+
+  static u32 optimize_mesh(
+    Vertex *dest_vertices,
+    u32 *dest_indices,
+    Vertex const *vertices,
+    u32 n_vertices,
+    u32 const *indices,
+    u32 n_indices,
+    MemoryPool *memory_pool
+  ) {
+    // The meshopt functions can't work in place, so we ping-pong between the
+    // destination arrays and some scratch space
+    Vertex *scratch_vertices = (Vertex*)memory::push(memory_pool, sizeof(Vertex) * n_vertices, "scratch_vertices");
+    u32 *scratch_indices = (u32*)memory::push(memory_pool, sizeof(u32) * n_indices, "scratch_indices");
+    memcpy(scratch_vertices, vertices, sizeof(Vertex) * n_vertices);
+    memcpy(scratch_indices, indices, sizeof(u32) * n_indices);
+
+    meshopt::VertexCacheStats const stats_before = meshopt::analyze_vertex_cache(indices, n_indices, n_vertices);
 
+    u32 const n_unique_vertices = meshopt::deduplicate_vertices(scratch_indices, n_indices,
+      scratch_vertices, n_vertices, sizeof(Vertex));
+    meshopt::optimize_vertex_cache(dest_indices, scratch_indices, n_indices, n_unique_vertices);
+    meshopt::optimize_overdraw(scratch_indices, dest_indices, n_indices,
+      scratch_vertices, n_unique_vertices, sizeof(Vertex), offsetof(Vertex, position));
+    u32 const n_dest_vertices = meshopt::optimize_vertex_fetch(dest_vertices, scratch_indices, n_indices,
+      scratch_vertices, n_unique_vertices, sizeof(Vertex));
+    memcpy(dest_indices, scratch_indices, sizeof(u32) * n_indices);
+
+    meshopt::VertexCacheStats const stats_after = meshopt::analyze_vertex_cache(dest_indices, n_indices,
+      n_dest_vertices);
+    logs::info("Optimized mesh: %d -> %d vertices, ACMR %.3f -> %.3f, ATVR %.3f -> %.3f",
+      n_vertices, n_dest_vertices, stats_before.acmr, stats_after.acmr, stats_before.atvr, stats_after.atvr);
+
+    return n_dest_vertices;
+  }
+
+
+  static u32 get_or_create_mesh(
+    VkState *vk_state,
+    VertexLayout layout,
+    Vertex const *source_vertices,
+    u32 n_source_vertices,
+    u32 const *source_indices,
+    u32 n_indices
+  ) {
+    u64 hash = util::hash_fnv1a(&layout, sizeof(layout), util::FNV_OFFSET_BASIS);
+    hash = util::hash_fnv1a(source_vertices, sizeof(Vertex) * n_source_vertices, hash);
+    hash = util::hash_fnv1a(source_indices, sizeof(u32) * n_indices, hash);
+
+    // If we've already uploaded this exact geometry, just reuse it. The hash
+    // is of the source data, since the optimised mesh can have fewer vertices.
+    range (0, vk_state->n_meshes) {
+      Mesh *mesh = &vk_state->meshes[idx];
+      if (mesh->hash == hash && mesh->n_indices == n_indices) {
+        return idx;
+      }
+    }
+
+    MemoryPool temp_memory_pool = {
+      .size = (sizeof(Vertex) * 3 + sizeof(QuantizedVertex)) * n_source_vertices + (sizeof(u32) * 3) * n_indices,
+    };
+    defer { memory::destroy_memory_pool(&temp_memory_pool); };
+
+    // Reorder the mesh for the post-transform cache, overdraw and vertex fetch
+    Vertex *vertices = (Vertex*)memory::push(&temp_memory_pool, sizeof(Vertex) * n_source_vertices, "vertices");
+    u32 *indices = (u32*)memory::push(&temp_memory_pool, sizeof(u32) * n_indices, "indices");
+    u32 const n_vertices = optimize_mesh(vertices, indices,
+      source_vertices, n_source_vertices, source_indices, n_indices, &temp_memory_pool);
+
+    VkIndexType const index_type = n_vertices < 65536 ? VK_INDEX_TYPE_UINT16 : VK_INDEX_TYPE_UINT32;
+    VkDeviceSize const index_size = index_type == VK_INDEX_TYPE_UINT16 ? sizeof(u16) : sizeof(u32);
+    VkDeviceSize const vertex_stride = VERTEX_STRIDES[(u32)layout];
+    VkDeviceSize const vertices_size = vertex_stride * n_vertices;
+    VkDeviceSize const indices_size = index_size * n_indices;
+
+    // Convert our data to the layout we're going to store it in
+    void const *vertex_data = vertices;
+    v3 position_scale = v3(1.0f);
+    v3 position_offset = v3(0.0f);
+    if (layout == VertexLayout::quantized) {
+      QuantizedVertex *quantized_vertices = (QuantizedVertex*)memory::push(&temp_memory_pool, vertices_size,
+        "quantized_vertices");
+      quantize_vertices(quantized_vertices, &position_scale, &position_offset, vertices, n_vertices);
+      vertex_data = quantized_vertices;
+    }
+
+    void const *index_data = indices;
+    if (index_type == VK_INDEX_TYPE_UINT16) {
+      u16 *short_indices = (u16*)memory::push(&temp_memory_pool, indices_size, "short_indices");
+      range (0, n_indices) {
+        short_indices[idx] = (u16)indices[idx];
+      }
+      index_data = short_indices;
+    }
+
+    // Carve out some space for it in the geometry buffer and upload it there.
+    // We align each range to its own element size, so that the offsets can be
+    // expressed in vertices and indices.
+    GeometryBuffer *geometry_buffer = &vk_state->geometry_buffer;
+    VkDeviceSize const vertices_offset = alloc_geometry_range(&geometry_buffer->vertex_bytes_used,
+      GEOMETRY_VERTEX_BUFFER_SIZE, vertices_size, vertex_stride);
+    VkDeviceSize const indices_offset = alloc_geometry_range(&geometry_buffer->index_bytes_used,
+      GEOMETRY_INDEX_BUFFER_SIZE, indices_size, index_size);
+
+    VkBuffer vertex_staging_buffer, index_staging_buffer;
+    VkDeviceMemory vertex_staging_buffer_memory, index_staging_buffer_memory;
+    VkCommandBuffer const command_buffer = vkutils::begin_command_buffer(vk_state->device, vk_state->command_pool);
+    vkutils::record_buffer_range_upload(vk_state->device, vk_state->physical_device, command_buffer,
+      geometry_buffer->vertex.buffer, vertices_offset,
+      vertex_data, vertices_size,
+      &vertex_staging_buffer, &vertex_staging_buffer_memory);
+    vkutils::record_buffer_range_upload(vk_state->device, vk_state->physical_device, command_buffer,
+      geometry_buffer->index.buffer, indices_offset,
+      index_data, indices_size,
+      &index_staging_buffer, &index_staging_buffer_memory);
+    sync::submit_one_off_and_wait(vk_state, vk_state->graphics_queue, &vk_state->graphics_timeline,
+      vk_state->command_pool, command_buffer);
+    vkDestroyBuffer(vk_state->device, vertex_staging_buffer, nullptr);
+    vkFreeMemory(vk_state->device, vertex_staging_buffer_memory, nullptr);
+    vkDestroyBuffer(vk_state->device, index_staging_buffer, nullptr);
+    vkFreeMemory(vk_state->device, index_staging_buffer_memory, nullptr);
+
+    assert(vk_state->n_meshes < MAX_N_MESHES);
+    u32 idx_mesh = vk_state->n_meshes++;
+    vk_state->meshes[idx_mesh] = {
+      .layout          = layout,
+      .index_type      = index_type,
+      .vertex_offset   = (u32)(vertices_offset / vertex_stride),
+      .n_vertices      = n_vertices,
+      .first_index     = (u32)(indices_offset / index_size),
+      .n_indices       = n_indices,
+      .position_scale  = position_scale,
+      .position_offset = position_offset,
+      .hash            = hash,
+    };
+
+    return idx_mesh;
+  }
+
+
+  static void init_entities(VkState *vk_state) {
     // Screenquad
     {
       DrawableComponent *screenquad = &vk_state->drawable_components[vk_state->n_entities++];
       *screenquad = {
+        .idx_mesh = get_or_create_mesh(vk_state, VertexLayout::full,
+          SCREENQUAD_VERTICES, LEN(SCREENQUAD_VERTICES), SCREENQUAD_INDICES, LEN(SCREENQUAD_INDICES)),
         .target_render_stages = RenderStageName::lighting,
       };
-      vkutils::create_buffer_resources(vk_state->device,
-        &screenquad->vertex,
-        vk_state->physical_device,
-        SCREENQUAD_VERTICES,
-        LEN(SCREENQUAD_VERTICES),
-        sizeof(SCREENQUAD_VERTICES),
-        VK_BUFFER_USAGE_VERTEX_BUFFER_BIT,
-        vk_state->command_pool,
-        vk_state->graphics_queue);
-      vkutils::create_buffer_resources(vk_state->device,
-        &screenquad->index,
-        vk_state->physical_device,
-        SCREENQUAD_INDICES,
-        LEN(SCREENQUAD_INDICES),
-        sizeof(SCREENQUAD_INDICES),
-        VK_BUFFER_USAGE_INDEX_BUFFER_BIT,
-        vk_state->command_pool,
-        vk_state->graphics_queue);
     }
 
     // Top sign
     {
       DrawableComponent *sign = &vk_state->drawable_components[vk_state->n_entities++];
       *sign = {
+        .idx_mesh = get_or_create_mesh(vk_state, VertexLayout::quantized,
+          SIGN_VERTICES, LEN(SIGN_VERTICES), SIGN_INDICES, LEN(SIGN_INDICES)),
         .target_render_stages = RenderStageName::geometry,
         .position = v3(0.0f, 0.0f, 0.0f),
       };
-      vkutils::create_buffer_resources(vk_state->device,
-        &sign->vertex,
-        vk_state->physical_device,
-        SIGN_VERTICES,
-        LEN(SIGN_VERTICES),
-        sizeof(SIGN_VERTICES),
-        VK_BUFFER_USAGE_VERTEX_BUFFER_BIT,
-        vk_state->command_pool,
-        vk_state->graphics_queue);
-      vkutils::create_buffer_resources(vk_state->device,
-        &sign->index,
-        vk_state->physical_device,
-        SIGN_INDICES,
-        LEN(SIGN_INDICES),
-        sizeof(SIGN_INDICES),
-        VK_BUFFER_USAGE_INDEX_BUFFER_BIT,
-        vk_state->command_pool,
-        vk_state->graphics_queue);
     }
 
     // Bottom sign
     {
       DrawableComponent *sign = &vk_state->drawable_components[vk_state->n_entities++];
       *sign = {
+        .idx_mesh = get_or_create_mesh(vk_state, VertexLayout::quantized,
+          SIGN_VERTICES, LEN(SIGN_VERTICES), SIGN_INDICES, LEN(SIGN_INDICES)),
         .target_render_stages = RenderStageName::forward_depth,
         .position = v3(0.0f, -1.0f, 0.0f),
       };
-      vkutils::create_buffer_resources(vk_state->device,
-        &sign->vertex,
-        vk_state->physical_device,
-        SIGN_VERTICES,
-        LEN(SIGN_VERTICES),
-        sizeof(SIGN_VERTICES),
-        VK_BUFFER_USAGE_VERTEX_BUFFER_BIT,
-        vk_state->command_pool,
-        vk_state->graphics_queue);
-      vkutils::create_buffer_resources(vk_state->device,
-        &sign->index,
-        vk_state->physical_device,
-        SIGN_INDICES,
-        LEN(SIGN_INDICES),
-        sizeof(SIGN_INDICES),
-        VK_BUFFER_USAGE_INDEX_BUFFER_BIT,
-        vk_state->command_pool,
-        vk_state->graphics_queue);
     }
+
+    // Cached command buffers draw whatever drawables we had when we recorded
+    // them
+    recording::mark_dirty(vk_state);
   }
 
 
   static void destroy_entities(VkState *vk_state) {
-    range (0, vk_state->n_entities) {
-      vkutils::destroy_buffer_resources(vk_state->device, &vk_state->drawable_components[idx].vertex);
-      vkutils::destroy_buffer_resources(vk_state->device, &vk_state->drawable_components[idx].index);
-    }
+    // Meshes only hold ranges in the geometry buffer, so there's nothing to free per mesh
+    vk_state->n_meshes = 0;
+    vk_state->n_entities = 0;
   }
 }
@@ -1,4 +1,8 @@
 #include "vulkan.hpp"
+#include "vkutils.hpp"
+#include "pack.hpp"
+#include "files.hpp"
+#include "logs.hpp"
 
 
 namespace vulkan::stage_common {
@@ -16,4 +20,207 @@ namespace vulkan::stage_common {
     }
     return image_view;
   }
+
+
+  static bool load_shader(VkState *vk_state, MemoryPool *pool, char const *path, u8 const **shader, size_t *size) {
+    // Prefer the cooked shader from the asset pack, which is already in memory,
+    // unless we've started hot-reloading shaders, in which case the files on
+    // disk are newer
+    if (!vk_state->should_skip_packed_shaders) {
+      char entry_name[pack::MAX_ENTRY_NAME_LENGTH];
+      pack::get_entry_name(entry_name, sizeof(entry_name), path);
+      if (pack::get_shader(&vk_state->asset_pack, entry_name, shader, size)) {
+        return true;
+      }
+    }
+    u8 *file_shader = files::load_file_to_pool_u8(pool, path, size);
+    if (!file_shader) {
+      return false;
+    }
+    // SPIR-V is made of 32-bit words, so anything else is probably a file
+    // that's still being written
+    if (*size == 0 || *size % 4 != 0) {
+      logs::error("Shader %s has an invalid size (%zu)", path, *size);
+      return false;
+    }
+    *shader = file_shader;
+    return true;
+  }
+
+
+  // Returns `VK_NULL_HANDLE` if we can't find the shader. If `reflection` isn't
+  // null, we add what the shader declares to it.
+  static VkShaderModule create_shader_module(
+    VkState *vk_state, MemoryPool *pool, char const *path, ShaderReflection *reflection
+  ) {
+    u8 const *shader;
+    size_t shader_size;
+    if (!load_shader(vk_state, pool, path, &shader, &shader_size)) {
+      return VK_NULL_HANDLE;
+    }
+    if (reflection && !reflection::reflect(shader, shader_size, reflection)) {
+      logs::error("Could not reflect shader %s", path);
+      return VK_NULL_HANDLE;
+    }
+    return vkutils::create_shader_module(vk_state->device, shader, shader_size);
+  }
+
+
+  // Fills in the stage's reflection from all of its shaders, which we make its
+  // layouts from, see `init_layouts()`
+  static void reflect_shaders(VkState *vk_state, RenderStage *stage, char const * const *paths, u32 n_paths) {
+    MemoryPool pool = {};
+    defer { memory::destroy_memory_pool(&pool); };
+    stage->reflection = {};
+    range (0, n_paths) {
+      u8 const *shader;
+      size_t shader_size;
+      if (!load_shader(vk_state, &pool, paths[idx], &shader, &shader_size)) {
+        logs::fatal("Could not load shader %s", paths[idx]);
+      }
+      if (!reflection::reflect(shader, shader_size, &stage->reflection)) {
+        logs::fatal("Could not reflect shader %s", paths[idx]);
+      }
+    }
+  }
+
+
+  // Gets the stage's own descriptor set layout and its pipeline layout, which
+  // share the global, material and entity set layouts with every other stage
+  static void init_layouts(VkState *vk_state, RenderStage *stage) {
+    u32 const idx_stage_set = (u32)DescriptorSetIndex::stage;
+    stage->stage_descriptor_set_layout = layouts::get_descriptor_set_layout(vk_state, &stage->reflection,
+      idx_stage_set);
+    stage->n_stage_descriptors = reflection::count_set_bindings(&stage->reflection, idx_stage_set);
+
+    // We push `DrawConstants` for every draw, so shaders can read some or
+    // all of it, but nothing else
+    if (stage->reflection.push_constant_size > sizeof(DrawConstants)) {
+      logs::fatal("Shaders have %d bytes of push constants, but `DrawConstants` only has %d",
+        stage->reflection.push_constant_size, (u32)sizeof(DrawConstants));
+    }
+    stage->draw_constants_range = {
+      .stageFlags = stage->reflection.push_constant_stage_flags,
+      .offset     = 0,
+      .size       = stage->reflection.push_constant_size,
+    };
+
+    VkDescriptorSetLayout const set_layouts[] = {
+      vk_state->global_descriptor_set_layout,
+      stage->stage_descriptor_set_layout,
+      vk_state->material_descriptor_set_layout,
+      vk_state->entity_descriptor_set_layout,
+    };
+    static_assert(LEN(set_layouts) == N_DESCRIPTOR_SET_INDICES);
+    stage->pipeline_layout = layouts::get_pipeline_layout(vk_state, set_layouts, LEN(set_layouts),
+      stage->draw_constants_range.size > 0 ? &stage->draw_constants_range : nullptr);
+  }
+
+
+  // Shaders we load when building pipelines can have changed since we made
+  // the stage's layouts, and we only make those once, so we refuse shaders
+  // that need anything the layouts don't have
+  static bool check_shader_layout(RenderStage const *stage, ShaderReflection const *reflection, char const *name) {
+    if (!reflection::is_compatible(reflection, &stage->reflection)) {
+      logs::error("The %s shaders' bindings or push constants have changed, restart to pick them up", name);
+      return false;
+    }
+    return true;
+  }
+
+
+  // Makes the vertex input state for `vertex_layout` with only the attributes
+  // the vertex shader reads. `attributes` needs room for `N_VERTEX_ATTRIBUTES`.
+  static bool init_vertex_input_state(
+    VkPipelineVertexInputStateCreateInfo *vertex_input_info, VkVertexInputAttributeDescription *attributes,
+    u32 idx_vertex_layout, ShaderReflection const *reflection
+  ) {
+    u32 n_attributes = 0;
+    u32 provided_locations = 0;
+    range (0, N_VERTEX_ATTRIBUTES) {
+      VkVertexInputAttributeDescription const *attribute = &VERTEX_ATTRIBUTE_DESCRIPTIONS[idx_vertex_layout][idx];
+      provided_locations |= 1u << attribute->location;
+      if (reflection->vertex_input_locations & (1u << attribute->location)) {
+        attributes[n_attributes++] = *attribute;
+      }
+    }
+    if (reflection->vertex_input_locations & ~provided_locations) {
+      logs::error("Vertex shader reads locations 0x%x, but our vertices only have 0x%x",
+        reflection->vertex_input_locations, provided_locations);
+      return false;
+    }
+    *vertex_input_info = {
+      .sType                           = VK_STRUCTURE_TYPE_PIPELINE_VERTEX_INPUT_STATE_CREATE_INFO,
+      .vertexBindingDescriptionCount   = N_VERTEX_BINDINGS,
+      .pVertexBindingDescriptions      = VERTEX_BINDING_DESCRIPTIONS[idx_vertex_layout],
+      .vertexAttributeDescriptionCount = n_attributes,
+      .pVertexAttributeDescriptions    = attributes,
+    };
+    return true;
+  }
+
+
+  static void destroy_pipelines(VkState *vk_state, VkPipeline *pipelines) {
+    range (0, N_VERTEX_LAYOUTS) {
+      vkDestroyPipeline(vk_state->device, pipelines[idx], nullptr);
+      pipelines[idx] = VK_NULL_HANDLE;
+    }
+  }
+
+
+  static void use_pipeline_variant(VkState *vk_state, RenderStage *stage, u32 idx_variant) {
+    stage->idx_current_variant = idx_variant;
+    range (0, N_VERTEX_LAYOUTS) {
+      stage->pipelines[idx] = stage->variants[idx_variant].pipelines[idx];
+    }
+    recording::mark_dirty(vk_state);
+  }
+
+
+  // Returns the index of the stage's variant for `permutation_key`, or -1 if
+  // we haven't built it
+  static i64 find_pipeline_variant(RenderStage const *stage, u32 permutation_key) {
+    range (0, stage->n_variants) {
+      if (stage->variants[idx].permutation_key == permutation_key) {
+        return idx;
+      }
+    }
+    return -1;
+  }
+
+
+  // Earlier frames might still be using any of these, so we hand them to the
+  // deletion queue rather than destroying them here
+  static void retire_pipeline_variants(VkState *vk_state, RenderStage *stage) {
+    range (0, stage->n_variants) {
+      range_named (idx_layout, 0, N_VERTEX_LAYOUTS) {
+        deletion::retire_pipeline(vk_state, stage->variants[idx].pipelines[idx_layout]);
+      }
+    }
+    stage->n_variants = 0;
+    stage->idx_current_variant = 0;
+    range (0, N_VERTEX_LAYOUTS) {
+      stage->pipelines[idx] = VK_NULL_HANDLE;
+    }
+  }
+
+
+  // Takes ownership of `pipelines` as the stage's variant for
+  // `permutation_key`, and returns its index
+  static u32 add_pipeline_variant(VkState *vk_state, RenderStage *stage, u32 permutation_key, VkPipeline *pipelines) {
+    if (stage->n_variants == MAX_N_PIPELINE_VARIANTS) {
+      // We only ever switch between a handful of variants, so if we get here,
+      // starting over is simpler than working out which ones to keep
+      logs::warning("Pipeline variant cache is full, throwing away all %d variants", MAX_N_PIPELINE_VARIANTS);
+      retire_pipeline_variants(vk_state, stage);
+    }
+    u32 const idx_variant = stage->n_variants++;
+    PipelineVariant *variant = &stage->variants[idx_variant];
+    variant->permutation_key = permutation_key;
+    range (0, N_VERTEX_LAYOUTS) {
+      variant->pipelines[idx] = pipelines[idx];
+      pipelines[idx] = VK_NULL_HANDLE;
+    }
+    return idx_variant;
+  }
 }
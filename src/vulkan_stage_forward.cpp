@@ -10,28 +10,35 @@ namespace vulkan::forward_stage {
     {{{1.0f, 0.0f}}},
   };
 
-  static constexpr VkDescriptorSetLayoutBinding DESCRIPTOR_BINDINGS[] = {
-    vkutils::descriptor_set_layout_binding(0, VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER),
+  static constexpr char const *VERT_SHADER_PATHS[N_VERTEX_LAYOUTS] = {
+    "bin/shaders/forward.vert.spv",
+    "bin/shaders/forward_quantized.vert.spv",
   };
-  static constexpr u32 N_DESCRIPTORS = LEN(DESCRIPTOR_BINDINGS);
 
 
-  static void render(VkState *vk_state, VkExtent2D extent, u32 idx_image) {
+  // The bindless shader reads the albedo texture out of the global set,
+  // using the index from the instance data, instead of the stage set
+  static char const* get_frag_shader_path(VkState *vk_state) {
+    return vk_state->is_bindless_enabled ? "bin/shaders/forward_bindless.frag.spv" : "bin/shaders/forward.frag.spv";
+  }
+
+
+  static void render(VkState *vk_state, VkExtent2D extent, u32 idx_image, bool should_record) {
     auto idx_frame               = vk_state->idx_frame;
-    auto *frame_resources        = &vk_state->frame_resources[idx_frame];
-    auto *command_buffer         = &vk_state->forward_stage.command_buffers[idx_frame];
+    auto command_buffer          = recording::get_stage_command_buffer(vk_state, &vk_state->forward_stage, idx_image);
     auto global_descriptor_set   = vk_state->global_descriptor_sets[idx_frame];
     auto stage_descriptor_set    = vk_state->forward_stage.stage_descriptor_sets[idx_frame];
     auto material_descriptor_set = vk_state->material_descriptor_sets[idx_frame];
     auto entity_descriptor_set   = vk_state->entity_descriptor_sets[idx_frame];
 
-    // Record command buffer
-    {
-      // Begin command buffer
-      vkResetCommandBuffer(*command_buffer, 0);
-      vkutils::begin_command_buffer(*command_buffer);
+    // Record command buffer, unless we've cached one that's still good
+    if (should_record) {
+      // Begin command buffer, which is either new, or was reset along with the
+      // rest of the frame's command pool, or which we've cached and can just
+      // record over
+      vkutils::begin_command_buffer(command_buffer);
 
-      // Begin render pass
+      // Render pass
       VkRenderPassBeginInfo const render_pass_info = vkutils::render_pass_begin_info(
         vk_state->forward_stage.render_pass,
         vk_state->forward_stage.framebuffers[idx_image],
@@ -39,85 +46,167 @@ namespace vulkan::forward_stage {
         LEN(forward_stage::CLEAR_COLORS),
         forward_stage::CLEAR_COLORS
       );
-      vkCmdBeginRenderPass(*command_buffer, &render_pass_info, VK_SUBPASS_CONTENTS_INLINE);
 
-      // Bind pipeline and descriptor sets
+      // Descriptor sets
       VkDescriptorSet const descriptor_sets[] = {
         global_descriptor_set,
         stage_descriptor_set,
         material_descriptor_set,
         entity_descriptor_set,
       };
-      vkCmdBindPipeline(*command_buffer, VK_PIPELINE_BIND_POINT_GRAPHICS, vk_state->forward_stage.pipeline);
-      vkCmdBindDescriptorSets(*command_buffer, VK_PIPELINE_BIND_POINT_GRAPHICS, vk_state->forward_stage.pipeline_layout,
-        0, LEN(descriptor_sets), descriptor_sets, 0, nullptr);
-
-      // Render
-      range (0, vk_state->n_entities) {
-        DrawableComponent *drawable_component = &vk_state->drawable_components[idx];
-        if (has(drawable_component->target_render_stages, RenderStageName::forward_depth)) {
-          rendering::render_drawable_component(drawable_component, command_buffer);
-        }
-      }
 
-      // End render pass and command buffer
-      vkCmdEndRenderPass(*command_buffer);
-      vkutils::check(vkEndCommandBuffer(*command_buffer));
+      // Record the render pass, with draws in the order given by the stage's
+      // sorted draw list, split across worker threads if there are enough
+      recording::record_render_pass(vk_state, &vk_state->forward_stage, command_buffer, &render_pass_info,
+        descriptor_sets);
+
+      // End command buffer
+      vkutils::check(vkEndCommandBuffer(command_buffer));
     }
 
     // Submit command buffer
-    {
-      VkSemaphore const wait_semaphores[] = {vk_state->lighting_stage.render_finished_semaphore};
-      VkPipelineStageFlags const wait_stages[] = {VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT};
-      VkSemaphore const signal_semaphores[] = {vk_state->forward_stage.render_finished_semaphore};
-      VkSubmitInfo const submit_info = {
-        .sType                = VK_STRUCTURE_TYPE_SUBMIT_INFO,
-        .waitSemaphoreCount   = 1,
-        .pWaitSemaphores      = wait_semaphores,
-        .pWaitDstStageMask    = wait_stages,
-        .commandBufferCount   = 1,
-        .pCommandBuffers      = command_buffer,
-        .signalSemaphoreCount = 1,
-        .pSignalSemaphores    = signal_semaphores,
-      };
-      vkResetFences(vk_state->device, 1, &frame_resources->frame_rendered_fence);
-      vkutils::check(vkQueueSubmit(vk_state->graphics_queue, 1, &submit_info, frame_resources->frame_rendered_fence));
-    }
+    sync::submit_stage(vk_state, &vk_state->forward_stage, command_buffer, &vk_state->lighting_stage, true);
   }
 
 
-  static void init_swapchain(VkState *vk_state, VkExtent2D extent) {
-    // Command buffers
-    {
-      range (0, N_PARALLEL_FRAMES) {
-        vkutils::create_command_buffer(vk_state->device, &vk_state->forward_stage.command_buffers[idx],
-          vk_state->command_pool);
+  // Creates one pipeline per vertex layout into `pipelines`, using whatever
+  // render pass and pipeline layout the stage currently has. This can run on
+  // a worker thread, so that we can rebuild pipelines when shaders change.
+  // The stage has no specialization constants, so it ignores `permutation_key`.
+  static bool create_pipelines(
+    VkState *vk_state, VkExtent2D extent, u32 permutation_key, VkPipeline *pipelines
+  ) {
+    range (0, N_VERTEX_LAYOUTS) {
+      pipelines[idx] = VK_NULL_HANDLE;
+    }
+
+    // Shaders
+    MemoryPool pool = {};
+    defer { memory::destroy_memory_pool(&pool); };
+    ShaderReflection frag_reflection = {};
+    auto const frag_shader_module = stage_common::create_shader_module(vk_state, &pool,
+      forward_stage::get_frag_shader_path(vk_state), &frag_reflection);
+    defer { vkDestroyShaderModule(vk_state->device, frag_shader_module, nullptr); };
+    if (frag_shader_module == VK_NULL_HANDLE) {
+      return false;
+    }
+
+    // Pipeline
+    VkPipelineInputAssemblyStateCreateInfo const input_assembly_info = {
+      .sType                  = VK_STRUCTURE_TYPE_PIPELINE_INPUT_ASSEMBLY_STATE_CREATE_INFO,
+      .topology               = VK_PRIMITIVE_TOPOLOGY_TRIANGLE_LIST,
+      .primitiveRestartEnable = VK_FALSE,
+    };
+    VkViewport const viewport = vkutils::viewport_from_extent(extent);
+    VkRect2D const scissor = vkutils::rect_from_extent(extent);
+    auto const viewport_state_info = vkutils::pipeline_viewport_state_create_info(&viewport, &scissor);
+    VkPipelineRasterizationStateCreateInfo const rasterizer_info = {
+      .sType                   = VK_STRUCTURE_TYPE_PIPELINE_RASTERIZATION_STATE_CREATE_INFO,
+      .depthClampEnable        = VK_FALSE,
+      .rasterizerDiscardEnable = VK_FALSE,
+      .polygonMode             = VK_POLYGON_MODE_FILL,
+      .cullMode                = VK_CULL_MODE_BACK_BIT,
+      .frontFace               = VK_FRONT_FACE_CLOCKWISE,
+      .depthBiasEnable         = VK_FALSE,
+      .lineWidth               = 1.0f,
+    };
+    VkPipelineMultisampleStateCreateInfo const multisampling_info = {
+      .sType                = VK_STRUCTURE_TYPE_PIPELINE_MULTISAMPLE_STATE_CREATE_INFO,
+      .rasterizationSamples = VK_SAMPLE_COUNT_1_BIT,
+      .sampleShadingEnable  = VK_FALSE,
+    };
+    VkPipelineDepthStencilStateCreateInfo const depth_stencil_info = {
+      .sType                 = VK_STRUCTURE_TYPE_PIPELINE_DEPTH_STENCIL_STATE_CREATE_INFO,
+      .depthTestEnable       = VK_TRUE,
+      .depthWriteEnable      = VK_TRUE,
+      .depthCompareOp        = VK_COMPARE_OP_LESS,
+      .depthBoundsTestEnable = VK_FALSE,
+      .stencilTestEnable     = VK_FALSE,
+    };
+    VkPipelineColorBlendAttachmentState color_blend_attachments[] = {
+      vkutils::pipeline_color_blend_attachment_state(),
+    };
+    VkPipelineColorBlendStateCreateInfo const color_blending_info = {
+      .sType           = VK_STRUCTURE_TYPE_PIPELINE_COLOR_BLEND_STATE_CREATE_INFO,
+      .logicOpEnable   = VK_FALSE,
+      .attachmentCount = LEN(color_blend_attachments),
+      .pAttachments    = color_blend_attachments,
+    };
+
+    // We need one pipeline for each vertex layout, which only differ in
+    // their vertex shader and vertex input state
+    range_named (idx_layout, 0, N_VERTEX_LAYOUTS) {
+      ShaderReflection reflection = frag_reflection;
+      auto const vert_shader_module = stage_common::create_shader_module(vk_state, &pool,
+        forward_stage::VERT_SHADER_PATHS[idx_layout], &reflection);
+      defer { vkDestroyShaderModule(vk_state->device, vert_shader_module, nullptr); };
+      VkPipelineVertexInputStateCreateInfo vertex_input_info;
+      VkVertexInputAttributeDescription vertex_attributes[N_VERTEX_ATTRIBUTES];
+      if (
+        vert_shader_module == VK_NULL_HANDLE ||
+        !stage_common::check_shader_layout(&vk_state->forward_stage, &reflection, "forward") ||
+        !stage_common::init_vertex_input_state(&vertex_input_info, vertex_attributes, idx_layout, &reflection)
+      ) {
+        stage_common::destroy_pipelines(vk_state, pipelines);
+        return false;
+      }
+      VkPipelineShaderStageCreateInfo const shader_stages[] = {
+        vkutils::pipeline_shader_stage_create_info_vert(vert_shader_module),
+        vkutils::pipeline_shader_stage_create_info_frag(frag_shader_module),
+      };
+
+      VkGraphicsPipelineCreateInfo const pipeline_info = {
+        .sType               = VK_STRUCTURE_TYPE_GRAPHICS_PIPELINE_CREATE_INFO,
+        .stageCount          = 2,
+        .pStages             = shader_stages,
+        .pVertexInputState   = &vertex_input_info,
+        .pInputAssemblyState = &input_assembly_info,
+        .pViewportState      = &viewport_state_info,
+        .pRasterizationState = &rasterizer_info,
+        .pMultisampleState   = &multisampling_info,
+        .pDepthStencilState  = &depth_stencil_info,
+        .pColorBlendState    = &color_blending_info,
+        .pDynamicState       = nullptr,
+        .layout              = vk_state->forward_stage.pipeline_layout,
+        .renderPass          = vk_state->forward_stage.render_pass,
+        .subpass             = 0,
+      };
+
+      VkResult const pipeline_res = vkCreateGraphicsPipelines(vk_state->device, vk_state->pipeline_cache, 1,
+        &pipeline_info, nullptr, &pipelines[idx_layout]);
+      if (pipeline_res != VK_SUCCESS) {
+        logs::error("Could not create forward pipeline (%d)", pipeline_res);
+        stage_common::destroy_pipelines(vk_state, pipelines);
+        return false;
       }
     }
 
-    // Descriptors
-    {
-      range (0, N_PARALLEL_FRAMES) {
-        auto *stage_descriptor_set = &vk_state->forward_stage.stage_descriptor_sets[idx];
+    return true;
+  }
 
-        // Allocate descriptor sets
-        auto const alloc_info = vkutils::descriptor_set_allocate_info(vk_state->descriptor_pool,
-          &vk_state->forward_stage.stage_descriptor_set_layout);
-        vkutils::check(vkAllocateDescriptorSets(vk_state->device, &alloc_info, stage_descriptor_set));
 
-        // Update descriptor sets
-        VkDescriptorImageInfo const image_info = {
+  // Makes the frame's stage descriptor set, which points to our textures'
+  // current views, since those change as textures stream in
+  static void update_descriptors(VkState *vk_state, u32 idx_frame) {
+    DescriptorBinding const bindings[] = {
+      {
+        .type       = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,
+        .image_info = {
           .sampler     = vk_state->alpaca.sampler,
           .imageView   = vk_state->alpaca.view,
           .imageLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL,
-        };
-        VkWriteDescriptorSet descriptor_writes[] = {
-          vkutils::write_descriptor_set_image(*stage_descriptor_set, 0, &image_info),
-        };
-        vkUpdateDescriptorSets(vk_state->device, forward_stage::N_DESCRIPTORS, descriptor_writes, 0, nullptr);
-      }
-    }
+        },
+      },
+    };
+    // We only write the bindings the shaders use, which is none of them for
+    // the bindless shaders
+    assert(vk_state->forward_stage.n_stage_descriptors <= LEN(bindings));
+    vk_state->forward_stage.stage_descriptor_sets[idx_frame] = descriptors::get_frame_set(vk_state, idx_frame,
+      vk_state->forward_stage.stage_descriptor_set_layout, bindings, vk_state->forward_stage.n_stage_descriptors);
+  }
+
 
+  static void init_swapchain(VkState *vk_state, VkExtent2D extent) {
     // Render pass
     {
       auto const color_attachment = vkutils::attachment_description_loadload(VK_FORMAT_B8G8R8A8_SRGB,
@@ -149,113 +238,27 @@ namespace vulkan::forward_stage {
       }
     }
 
-    // Pipeline
-    {
-      // Pipeline layout
-      VkDescriptorSetLayout const ds_layouts[] = {
-        vk_state->global_descriptor_set_layout,
-        vk_state->forward_stage.stage_descriptor_set_layout,
-        vk_state->material_descriptor_set_layout,
-        vk_state->entity_descriptor_set_layout,
-      };
-      auto const pipeline_layout_info = vkutils::pipeline_layout_create_info(LEN(ds_layouts), ds_layouts);
-      vkutils::check(vkCreatePipelineLayout(vk_state->device, &pipeline_layout_info, nullptr,
-        &vk_state->forward_stage.pipeline_layout));
-
-      // Shaders
-      MemoryPool pool = {};
-      auto const vert_shader_module = vkutils::create_shader_module_from_file(vk_state->device, &pool,
-        "bin/shaders/forward.vert.spv");
-      auto const frag_shader_module = vkutils::create_shader_module_from_file(vk_state->device, &pool,
-        "bin/shaders/forward.frag.spv");
-      VkPipelineShaderStageCreateInfo const shader_stages[] = {
-        vkutils::pipeline_shader_stage_create_info_vert(vert_shader_module),
-        vkutils::pipeline_shader_stage_create_info_frag(frag_shader_module),
-      };
-
-      // Pipeline
-      VkPipelineVertexInputStateCreateInfo const vertex_input_info = {
-        .sType                           = VK_STRUCTURE_TYPE_PIPELINE_VERTEX_INPUT_STATE_CREATE_INFO,
-        .vertexBindingDescriptionCount   = 1,
-        .pVertexBindingDescriptions      = &VERTEX_BINDING_DESCRIPTION,
-        .vertexAttributeDescriptionCount = LEN(VERTEX_ATTRIBUTE_DESCRIPTIONS),
-        .pVertexAttributeDescriptions    = VERTEX_ATTRIBUTE_DESCRIPTIONS,
-      };
-      VkPipelineInputAssemblyStateCreateInfo const input_assembly_info = {
-        .sType                  = VK_STRUCTURE_TYPE_PIPELINE_INPUT_ASSEMBLY_STATE_CREATE_INFO,
-        .topology               = VK_PRIMITIVE_TOPOLOGY_TRIANGLE_LIST,
-        .primitiveRestartEnable = VK_FALSE,
-      };
-      VkViewport const viewport = vkutils::viewport_from_extent(extent);
-      VkRect2D const scissor = vkutils::rect_from_extent(extent);
-      auto const viewport_state_info = vkutils::pipeline_viewport_state_create_info(&viewport, &scissor);
-      VkPipelineRasterizationStateCreateInfo const rasterizer_info = {
-        .sType                   = VK_STRUCTURE_TYPE_PIPELINE_RASTERIZATION_STATE_CREATE_INFO,
-        .depthClampEnable        = VK_FALSE,
-        .rasterizerDiscardEnable = VK_FALSE,
-        .polygonMode             = VK_POLYGON_MODE_FILL,
-        .cullMode                = VK_CULL_MODE_BACK_BIT,
-        .frontFace               = VK_FRONT_FACE_CLOCKWISE,
-        .depthBiasEnable         = VK_FALSE,
-        .lineWidth               = 1.0f,
-      };
-      VkPipelineMultisampleStateCreateInfo const multisampling_info = {
-        .sType                = VK_STRUCTURE_TYPE_PIPELINE_MULTISAMPLE_STATE_CREATE_INFO,
-        .rasterizationSamples = VK_SAMPLE_COUNT_1_BIT,
-        .sampleShadingEnable  = VK_FALSE,
-      };
-      VkPipelineDepthStencilStateCreateInfo const depth_stencil_info = {
-        .sType                 = VK_STRUCTURE_TYPE_PIPELINE_DEPTH_STENCIL_STATE_CREATE_INFO,
-        .depthTestEnable       = VK_TRUE,
-        .depthWriteEnable      = VK_TRUE,
-        .depthCompareOp        = VK_COMPARE_OP_LESS,
-        .depthBoundsTestEnable = VK_FALSE,
-        .stencilTestEnable     = VK_FALSE,
-      };
-      VkPipelineColorBlendAttachmentState color_blend_attachments[] = {
-        vkutils::pipeline_color_blend_attachment_state(),
-      };
-      VkPipelineColorBlendStateCreateInfo const color_blending_info = {
-        .sType           = VK_STRUCTURE_TYPE_PIPELINE_COLOR_BLEND_STATE_CREATE_INFO,
-        .logicOpEnable   = VK_FALSE,
-        .attachmentCount = LEN(color_blend_attachments),
-        .pAttachments    = color_blend_attachments,
-      };
-
-      VkGraphicsPipelineCreateInfo const pipeline_info = {
-        .sType               = VK_STRUCTURE_TYPE_GRAPHICS_PIPELINE_CREATE_INFO,
-        .stageCount          = 2,
-        .pStages             = shader_stages,
-        .pVertexInputState   = &vertex_input_info,
-        .pInputAssemblyState = &input_assembly_info,
-        .pViewportState      = &viewport_state_info,
-        .pRasterizationState = &rasterizer_info,
-        .pMultisampleState   = &multisampling_info,
-        .pDepthStencilState  = &depth_stencil_info,
-        .pColorBlendState    = &color_blending_info,
-        .pDynamicState       = nullptr,
-        .layout              = vk_state->forward_stage.pipeline_layout,
-        .renderPass          = vk_state->forward_stage.render_pass,
-        .subpass             = 0,
-      };
+    // The pipeline layout doesn't depend on the swapchain, so we only make it
+    // in `init()`, and the pipelines themselves get built on worker threads,
+    // along with the other stages', see `pipelines::start_builds()`
+  }
 
-      vkutils::check(vkCreateGraphicsPipelines(vk_state->device, VK_NULL_HANDLE, 1, &pipeline_info, nullptr,
-        &vk_state->forward_stage.pipeline));
 
-      vkDestroyShaderModule(vk_state->device, vert_shader_module, nullptr);
-      vkDestroyShaderModule(vk_state->device, frag_shader_module, nullptr);
+  // Reads what all of the stage's shaders declare, which we make its layouts
+  // from. This has to happen before `init()`.
+  static void reflect_shaders(VkState *vk_state) {
+    char const *paths[N_VERTEX_LAYOUTS + 1];
+    range (0, N_VERTEX_LAYOUTS) {
+      paths[idx] = forward_stage::VERT_SHADER_PATHS[idx];
     }
+    paths[N_VERTEX_LAYOUTS] = forward_stage::get_frag_shader_path(vk_state);
+    stage_common::reflect_shaders(vk_state, &vk_state->forward_stage, paths, LEN(paths));
   }
 
 
   static void init(VkState *vk_state, VkExtent2D extent) {
-    // Descriptor set layout
-    {
-      auto const layout_info = vkutils::descriptor_set_layout_create_info(forward_stage::N_DESCRIPTORS,
-        forward_stage::DESCRIPTOR_BINDINGS);
-      vkutils::check(vkCreateDescriptorSetLayout(vk_state->device, &layout_info, nullptr,
-        &vk_state->forward_stage.stage_descriptor_set_layout));
-    }
+    // Layouts, which don't depend on the swapchain, so we only make them once
+    stage_common::init_layouts(vk_state, &vk_state->forward_stage);
 
     vkutils::create_semaphore(vk_state->device, &vk_state->forward_stage.render_finished_semaphore);
 
@@ -263,21 +266,19 @@ namespace vulkan::forward_stage {
   }
 
 
+  // Earlier frames might still be using all of these, so we hand them to the
+  // deletion queue rather than destroying them here
   static void destroy_swapchain(VkState *vk_state) {
-    range (0, N_PARALLEL_FRAMES) {
-      vkFreeCommandBuffers(vk_state->device, vk_state->command_pool, 1, &vk_state->forward_stage.command_buffers[idx]);
-    }
+    auto *stage = &vk_state->forward_stage;
     range (0, vk_state->n_swapchain_images) {
-      vkDestroyFramebuffer(vk_state->device, vk_state->forward_stage.framebuffers[idx], nullptr);
+      deletion::retire_framebuffer(vk_state, stage->framebuffers[idx]);
     }
-    vkDestroyPipeline(vk_state->device, vk_state->forward_stage.pipeline, nullptr);
-    vkDestroyPipelineLayout(vk_state->device, vk_state->forward_stage.pipeline_layout, nullptr);
-    vkDestroyRenderPass(vk_state->device, vk_state->forward_stage.render_pass, nullptr);
+    stage_common::retire_pipeline_variants(vk_state, stage);
+    deletion::retire_render_pass(vk_state, stage->render_pass);
   }
 
 
   static void destroy_nonswapchain(VkState *vk_state) {
-    vkDestroyDescriptorSetLayout(vk_state->device, vk_state->forward_stage.stage_descriptor_set_layout, nullptr);
     vkDestroySemaphore(vk_state->device, vk_state->forward_stage.render_finished_semaphore, nullptr);
   }
 }
@@ -0,0 +1,280 @@
+/*
+  Streams the larger mip levels of textures onto the GPU while we render.
+*/
+
+#include <math.h>
+#include "vulkan.hpp"
+#include "vkutils.hpp"
+#include "images.hpp"
+#include "files.hpp"
+#include "logs.hpp"
+
+
+namespace vulkan::streaming {
+  static u32 get_max_mip_dimension(StreamingTexture const *texture, u32 idx_mip_level) {
+    return max(images::get_mip_dimension(texture->width, idx_mip_level),
+      images::get_mip_dimension(texture->height, idx_mip_level));
+  }
+
+
+  static void create_texture_image(
+    VkState *vk_state, StreamingTexture const *texture, ImageResources *image_resources, u32 idx_first_mip
+  ) {
+    vkutils::create_image_resources(
+      vk_state->device,
+      image_resources,
+      vk_state->physical_device,
+      images::get_mip_dimension(texture->width, idx_first_mip),
+      images::get_mip_dimension(texture->height, idx_first_mip),
+      texture->n_mip_levels - idx_first_mip,
+      texture->format,
+      VK_IMAGE_TILING_OPTIMAL,
+      VK_IMAGE_USAGE_TRANSFER_DST_BIT | VK_IMAGE_USAGE_SAMPLED_BIT,
+      VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+      VK_IMAGE_ASPECT_COLOR_BIT);
+  }
+
+
+  static void free_upload(VkState *vk_state, StreamingUpload *upload) {
+    vkDestroyFence(vk_state->device, upload->fence, nullptr);
+    vkFreeCommandBuffers(vk_state->device, vk_state->asset_command_pool, 1, &upload->command_buffer);
+    vkDestroyBuffer(vk_state->device, upload->staging_buffer, nullptr);
+    vkFreeMemory(vk_state->device, upload->staging_buffer_memory, nullptr);
+    vk_state->is_streaming_upload_running = false;
+  }
+
+
+  static void acquire_upload(VkState *vk_state, StreamingUpload const *upload) {
+    // If the asset queue is from a different family, the image still belongs
+    // to that family, so the graphics queue has to take it over before we
+    // sample it. This goes ahead of the frame's stages on the same queue, so
+    // their barriers wait for it, and the upload is already done, since we've
+    // waited for it on the CPU.
+    u32 const graphics_family = (u32)vk_state->queue_family_indices.graphics;
+    if (vk_state->asset_queue_family == graphics_family) {
+      return;
+    }
+    VkCommandBuffer const command_buffer = vkutils::begin_command_buffer(vk_state->device, vk_state->command_pool);
+    vkutils::record_image_ownership_acquire(command_buffer, upload->image_resources.image,
+      upload->image_resources.n_mip_levels, vk_state->asset_queue_family, graphics_family);
+    vkutils::check(vkEndCommandBuffer(command_buffer));
+    sync::submit_one_off(vk_state, vk_state->graphics_queue, &vk_state->graphics_timeline, command_buffer,
+      VK_NULL_HANDLE);
+    deletion::retire_command_buffer(vk_state, vk_state->command_pool, command_buffer);
+  }
+
+
+  static void finish_upload(VkState *vk_state) {
+    // Frames that are still in flight might be sampling the old image, so we
+    // keep it around until all of them are done. Every frame's descriptor
+    // sets get made anew, so they'll pick up the new image by themselves,
+    // once we've told the command buffer cache to record them again.
+    StreamingUpload *upload = &vk_state->streaming_upload;
+    StreamingTexture *texture = upload->texture;
+    ImageResources *image_resources = texture->image_resources;
+    acquire_upload(vk_state, upload);
+    deletion::retire_image_resources(vk_state, image_resources);
+
+    // Keep the sampler, since it doesn't depend on the number of levels
+    image_resources->image        = upload->image_resources.image;
+    image_resources->memory       = upload->image_resources.memory;
+    image_resources->view         = upload->image_resources.view;
+    image_resources->n_mip_levels = upload->image_resources.n_mip_levels;
+    texture->idx_resident_mip     = upload->idx_mip;
+    recording::mark_dirty(vk_state);
+
+    free_upload(vk_state, upload);
+  }
+
+
+  static void update_priorities(VkState *vk_state, m4 const *view) {
+    // Drawables don't point to their textures yet, so every texture is as
+    // close as the closest textured drawable
+    f32 closest_distance = INFINITY;
+    range (0, vk_state->n_entities) {
+      DrawableComponent const *drawable = &vk_state->drawable_components[idx];
+      if (
+        !has(drawable->target_render_stages, RenderStageName::geometry) &&
+        !has(drawable->target_render_stages, RenderStageName::forward_depth)
+      ) {
+        continue;
+      }
+      f32 const distance = length(v3((*view) * v4(drawable->position, 1.0f)));
+      closest_distance = min(closest_distance, distance);
+    }
+
+    range (0, vk_state->n_streaming_textures) {
+      StreamingTexture *texture = &vk_state->streaming_textures[idx];
+      texture->distance = closest_distance;
+      if (closest_distance == INFINITY) {
+        // Nothing uses it, so we don't need anything more than what we have
+        texture->idx_wanted_mip = texture->idx_resident_mip;
+      } else if (closest_distance <= STREAMING_FULL_DETAIL_DISTANCE) {
+        texture->idx_wanted_mip = 0;
+      } else {
+        u32 const idx_wanted_mip = (u32)log2f(closest_distance / STREAMING_FULL_DETAIL_DISTANCE);
+        texture->idx_wanted_mip = min(idx_wanted_mip, texture->n_mip_levels - 1);
+      }
+    }
+  }
+
+
+  static StreamingTexture* get_most_needed_texture(VkState *vk_state) {
+    // The texture that's missing the most levels goes first, and between
+    // ones that are missing the same number, the closest one does
+    StreamingTexture *most_needed_texture = nullptr;
+    u32 most_missing_levels = 0;
+    range (0, vk_state->n_streaming_textures) {
+      StreamingTexture *texture = &vk_state->streaming_textures[idx];
+      if (texture->idx_resident_mip <= texture->idx_wanted_mip) {
+        continue;
+      }
+      u32 const n_missing_levels = texture->idx_resident_mip - texture->idx_wanted_mip;
+      if (
+        n_missing_levels > most_missing_levels ||
+        (n_missing_levels == most_missing_levels && texture->distance < most_needed_texture->distance)
+      ) {
+        most_needed_texture = texture;
+        most_missing_levels = n_missing_levels;
+      }
+    }
+    return most_needed_texture;
+  }
+
+
+  static void start_upload(VkState *vk_state, StreamingTexture *texture) {
+    // We go up one level at a time, so that each texture gets sharper as soon
+    // as possible, and so that we never have too much in flight at once. The
+    // new image gets all its levels from the CPU-side data, rather than copying
+    // the ones we have from the old image, so that we never touch an image
+    // that we're rendering with.
+    StreamingUpload *upload = &vk_state->streaming_upload;
+    *upload = {
+      .texture = texture,
+      .idx_mip = texture->idx_resident_mip - 1,
+    };
+    u32 const n_mip_levels = texture->n_mip_levels - upload->idx_mip;
+
+    create_texture_image(vk_state, texture, &upload->image_resources, upload->idx_mip);
+
+    VkBufferImageCopy regions[MAX_N_MIP_LEVELS];
+    vkutils::stage_image_levels(vk_state->device, vk_state->physical_device,
+      &texture->level_data[upload->idx_mip], &texture->level_sizes[upload->idx_mip],
+      images::get_mip_dimension(texture->width, upload->idx_mip),
+      images::get_mip_dimension(texture->height, upload->idx_mip),
+      n_mip_levels, regions, &upload->staging_buffer, &upload->staging_buffer_memory);
+
+    // Unlike `sync::submit_one_off_and_wait()`, we don't wait for the upload
+    // here, and we check the asset timeline or the fence on later frames instead
+    upload->command_buffer = vkutils::begin_command_buffer(vk_state->device, vk_state->asset_command_pool);
+    vkutils::record_image_levels_copy(upload->command_buffer, upload->image_resources.image,
+      upload->staging_buffer, regions, n_mip_levels,
+      vk_state->asset_queue_family, (u32)vk_state->queue_family_indices.graphics);
+    vkutils::check(vkEndCommandBuffer(upload->command_buffer));
+
+    if (!vk_state->is_timeline_semaphore_enabled) {
+      VkFenceCreateInfo const fence_info = {.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO};
+      vkutils::check(vkCreateFence(vk_state->device, &fence_info, nullptr, &upload->fence));
+    }
+    upload->timeline_value = sync::submit_one_off(vk_state, vk_state->asset_queue, &vk_state->asset_timeline,
+      upload->command_buffer, upload->fence);
+    vk_state->is_streaming_upload_running = true;
+  }
+
+
+  static void init_streaming_texture(
+    VkState *vk_state, ImageResources *image_resources, VkFormat format,
+    u32 width, u32 height, u32 n_mip_levels,
+    u8 const * const *level_data, VkDeviceSize const *level_sizes,
+    files::FileView *view
+  ) {
+    // Uploads only the levels no larger than `STREAMING_MIN_RESIDENT_DIMENSION`
+    // right away, so we have something to render with, and leaves the rest for
+    // `update()`. `level_data` has to stay valid until we're destroyed. If it
+    // points into `view`, we take ownership of `view`.
+    assert(vk_state->n_streaming_textures < MAX_N_STREAMING_TEXTURES);
+    StreamingTexture *texture = &vk_state->streaming_textures[vk_state->n_streaming_textures++];
+    *texture = {
+      .image_resources = image_resources,
+      .format          = format,
+      .width           = width,
+      .height          = height,
+      .n_mip_levels    = n_mip_levels,
+    };
+    range (0, n_mip_levels) {
+      texture->level_data[idx] = level_data[idx];
+      texture->level_sizes[idx] = level_sizes[idx];
+    }
+    if (view) {
+      texture->view = *view;
+      *view = {};
+    }
+
+    u32 idx_first_mip = 0;
+    while (
+      idx_first_mip < n_mip_levels - 1 &&
+      get_max_mip_dimension(texture, idx_first_mip) > STREAMING_MIN_RESIDENT_DIMENSION
+    ) {
+      idx_first_mip++;
+    }
+    texture->idx_resident_mip = idx_first_mip;
+    texture->idx_wanted_mip = idx_first_mip;
+
+    create_texture_image(vk_state, texture, image_resources, idx_first_mip);
+    VkSamplerCreateInfo const sampler_info = vkutils::sampler_create_info(vk_state->physical_device_properties);
+    vkutils::check(vkCreateSampler(vk_state->device, &sampler_info, nullptr, &image_resources->sampler));
+
+    VkBuffer staging_buffer;
+    VkDeviceMemory staging_buffer_memory;
+    VkCommandBuffer const command_buffer = vkutils::begin_command_buffer(vk_state->device, vk_state->command_pool);
+    vkutils::record_image_levels_upload(
+      vk_state->device,
+      vk_state->physical_device,
+      command_buffer,
+      image_resources,
+      &level_data[idx_first_mip],
+      &level_sizes[idx_first_mip],
+      images::get_mip_dimension(width, idx_first_mip),
+      images::get_mip_dimension(height, idx_first_mip),
+      &staging_buffer,
+      &staging_buffer_memory);
+    sync::submit_one_off_and_wait(vk_state, vk_state->graphics_queue, &vk_state->graphics_timeline,
+      vk_state->command_pool, command_buffer);
+    vkDestroyBuffer(vk_state->device, staging_buffer, nullptr);
+    vkFreeMemory(vk_state->device, staging_buffer_memory, nullptr);
+  }
+
+
+  static void update(VkState *vk_state, CommonState *common_state) {
+    // Runs at the start of a frame, once we know its previous use is done
+    StreamingUpload *upload = &vk_state->streaming_upload;
+    if (
+      vk_state->is_streaming_upload_running &&
+      sync::is_asset_submission_done(vk_state, upload->timeline_value, upload->fence)
+    ) {
+      finish_upload(vk_state);
+    }
+
+    if (!vk_state->is_streaming_upload_running) {
+      update_priorities(vk_state, &common_state->global_uniforms.view);
+      StreamingTexture *texture = get_most_needed_texture(vk_state);
+      if (texture) {
+        start_upload(vk_state, texture);
+      }
+    }
+  }
+
+
+  static void destroy(VkState *vk_state) {
+    if (vk_state->is_streaming_upload_running) {
+      sync::wait_for_asset_submission(vk_state, vk_state->streaming_upload.timeline_value,
+        vk_state->streaming_upload.fence);
+      vkutils::destroy_image_resources(vk_state->device, &vk_state->streaming_upload.image_resources);
+      free_upload(vk_state, &vk_state->streaming_upload);
+    }
+    range (0, vk_state->n_streaming_textures) {
+      files::unmap_file(&vk_state->streaming_textures[idx].view);
+    }
+    vk_state->n_streaming_textures = 0;
+  }
+}
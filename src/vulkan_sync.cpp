@@ -0,0 +1,234 @@
+/*
+  Keeps track of how far the GPU has got with what we've submitted, using
+  timeline semaphores if the device has them, and fences otherwise.
+
+  With timeline semaphores, each queue we submit work to has its own
+  timeline, whose value only ever goes up. Every submission signals the next
+  value, so waiting for a frame, checking whether an upload is done, knowing
+  when nothing can be using a retired object anymore, and making one submission
+  wait for another all come down to comparing against a number.
+
+  Presenting can't wait on a timeline semaphore, so the last stage of a frame
+  signals a binary semaphore for that too, and acquiring an image still gives
+  us a binary semaphore that the first stage waits on.
+*/
+
+#include "vulkan.hpp"
+#include "vkutils.hpp"
+#include "logs.hpp"
+
+
+namespace vulkan::sync {
+  static void init_timeline(VkState *vk_state, Timeline *timeline) {
+    VkSemaphoreTypeCreateInfo const type_info = {
+      .sType         = VK_STRUCTURE_TYPE_SEMAPHORE_TYPE_CREATE_INFO,
+      .semaphoreType = VK_SEMAPHORE_TYPE_TIMELINE,
+      .initialValue  = 0,
+    };
+    VkSemaphoreCreateInfo const semaphore_info = {
+      .sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO,
+      .pNext = &type_info,
+    };
+    *timeline = {};
+    vkutils::check(vkCreateSemaphore(vk_state->device, &semaphore_info, nullptr, &timeline->semaphore));
+  }
+
+
+  // Gets the value the next submission on this timeline should signal
+  static u64 get_next_value(Timeline *timeline) {
+    return ++timeline->last_submitted_value;
+  }
+
+
+  static u64 get_completed_value(VkState *vk_state, Timeline const *timeline) {
+    u64 value;
+    vkutils::check(vkGetSemaphoreCounterValue(vk_state->device, timeline->semaphore, &value));
+    return value;
+  }
+
+
+  static bool is_value_reached(VkState *vk_state, Timeline const *timeline, u64 value) {
+    return get_completed_value(vk_state, timeline) >= value;
+  }
+
+
+  static void wait_for_value(VkState *vk_state, Timeline const *timeline, u64 value) {
+    VkSemaphoreWaitInfo const wait_info = {
+      .sType          = VK_STRUCTURE_TYPE_SEMAPHORE_WAIT_INFO,
+      .semaphoreCount = 1,
+      .pSemaphores    = &timeline->semaphore,
+      .pValues        = &value,
+    };
+    vkutils::check(vkWaitSemaphores(vk_state->device, &wait_info, UINT64_MAX));
+  }
+
+
+  // Waits until the GPU is done with the last time we rendered this frame, so
+  // that we can reuse its resources
+  static void wait_for_frame(VkState *vk_state, FrameResources *frame_resources) {
+    if (vk_state->is_timeline_semaphore_enabled) {
+      wait_for_value(vk_state, &vk_state->graphics_timeline, frame_resources->timeline_value);
+    } else {
+      vkWaitForFences(vk_state->device, 1, &frame_resources->frame_rendered_fence, VK_TRUE, UINT64_MAX);
+    }
+  }
+
+
+  // Submits a stage's command buffer to the graphics queue. Stages run one
+  // after the other, so each one waits for `previous_stage`, or for the
+  // swapchain image if `previous_stage` is null. The last stage also signals
+  // that we can present, and that the frame is done.
+  static void submit_stage(
+    VkState *vk_state, RenderStage *stage, VkCommandBuffer command_buffer, RenderStage const *previous_stage,
+    bool is_last_stage
+  ) {
+    FrameResources *frame_resources = &vk_state->frame_resources[vk_state->idx_frame];
+    VkPipelineStageFlags const wait_stages[] = {VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT};
+
+    if (!vk_state->is_timeline_semaphore_enabled) {
+      VkSemaphore const wait_semaphores[] = {
+        previous_stage ? previous_stage->render_finished_semaphore : frame_resources->image_available_semaphore,
+      };
+      VkSemaphore const signal_semaphores[] = {stage->render_finished_semaphore};
+      VkSubmitInfo const submit_info = {
+        .sType                = VK_STRUCTURE_TYPE_SUBMIT_INFO,
+        .waitSemaphoreCount   = 1,
+        .pWaitSemaphores      = wait_semaphores,
+        .pWaitDstStageMask    = wait_stages,
+        .commandBufferCount   = 1,
+        .pCommandBuffers      = &command_buffer,
+        .signalSemaphoreCount = 1,
+        .pSignalSemaphores    = signal_semaphores,
+      };
+      VkFence fence = VK_NULL_HANDLE;
+      if (is_last_stage) {
+        fence = frame_resources->frame_rendered_fence;
+        vkResetFences(vk_state->device, 1, &fence);
+      }
+      vkutils::check(vkQueueSubmit(vk_state->graphics_queue, 1, &submit_info, fence));
+      return;
+    }
+
+    // The value for the binary image available semaphore is ignored
+    VkSemaphore const wait_semaphores[] = {
+      previous_stage ? vk_state->graphics_timeline.semaphore : frame_resources->image_available_semaphore,
+    };
+    u64 const wait_values[] = {previous_stage ? previous_stage->timeline_value : 0};
+    stage->timeline_value = get_next_value(&vk_state->graphics_timeline);
+    VkSemaphore const signal_semaphores[] = {vk_state->graphics_timeline.semaphore, stage->render_finished_semaphore};
+    u64 const signal_values[] = {stage->timeline_value, 0};
+    u32 const n_signal_semaphores = is_last_stage ? 2 : 1;
+    VkTimelineSemaphoreSubmitInfo const timeline_info = {
+      .sType                     = VK_STRUCTURE_TYPE_TIMELINE_SEMAPHORE_SUBMIT_INFO,
+      .waitSemaphoreValueCount   = 1,
+      .pWaitSemaphoreValues      = wait_values,
+      .signalSemaphoreValueCount = n_signal_semaphores,
+      .pSignalSemaphoreValues    = signal_values,
+    };
+    VkSubmitInfo const submit_info = {
+      .sType                = VK_STRUCTURE_TYPE_SUBMIT_INFO,
+      .pNext                = &timeline_info,
+      .waitSemaphoreCount   = 1,
+      .pWaitSemaphores      = wait_semaphores,
+      .pWaitDstStageMask    = wait_stages,
+      .commandBufferCount   = 1,
+      .pCommandBuffers      = &command_buffer,
+      .signalSemaphoreCount = n_signal_semaphores,
+      .pSignalSemaphores    = signal_semaphores,
+    };
+    vkutils::check(vkQueueSubmit(vk_state->graphics_queue, 1, &submit_info, VK_NULL_HANDLE));
+    if (is_last_stage) {
+      frame_resources->timeline_value = stage->timeline_value;
+    }
+  }
+
+
+  // Submits a one-off command buffer to `queue`, whose submissions signal
+  // `timeline`. We get back the value it signals, which is what we wait on,
+  // or we use `fence`, which can be null, if we don't have timeline semaphores.
+  static u64 submit_one_off(
+    VkState *vk_state, VkQueue queue, Timeline *timeline, VkCommandBuffer command_buffer, VkFence fence
+  ) {
+    VkSubmitInfo submit_info = {
+      .sType              = VK_STRUCTURE_TYPE_SUBMIT_INFO,
+      .commandBufferCount = 1,
+      .pCommandBuffers    = &command_buffer,
+    };
+    if (!vk_state->is_timeline_semaphore_enabled) {
+      vkutils::check(vkQueueSubmit(queue, 1, &submit_info, fence));
+      return 0;
+    }
+
+    u64 const signal_value = get_next_value(timeline);
+    VkTimelineSemaphoreSubmitInfo const timeline_info = {
+      .sType                     = VK_STRUCTURE_TYPE_TIMELINE_SEMAPHORE_SUBMIT_INFO,
+      .signalSemaphoreValueCount = 1,
+      .pSignalSemaphoreValues    = &signal_value,
+    };
+    submit_info.pNext = &timeline_info;
+    submit_info.signalSemaphoreCount = 1;
+    submit_info.pSignalSemaphores = &timeline->semaphore;
+    vkutils::check(vkQueueSubmit(queue, 1, &submit_info, VK_NULL_HANDLE));
+    return signal_value;
+  }
+
+
+  // Ends and submits a one-off command buffer, then waits for that submission
+  // alone, rather than for the whole queue to go idle, and frees the command
+  // buffer. Once we return, whatever it was reading from can go too.
+  static void submit_one_off_and_wait(
+    VkState *vk_state, VkQueue queue, Timeline *timeline, VkCommandPool command_pool, VkCommandBuffer command_buffer
+  ) {
+    vkutils::check(vkEndCommandBuffer(command_buffer));
+    if (vk_state->is_timeline_semaphore_enabled) {
+      u64 const timeline_value = submit_one_off(vk_state, queue, timeline, command_buffer, VK_NULL_HANDLE);
+      wait_for_value(vk_state, timeline, timeline_value);
+    } else {
+      VkFenceCreateInfo const fence_info = {.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO};
+      VkFence fence;
+      vkutils::check(vkCreateFence(vk_state->device, &fence_info, nullptr, &fence));
+      submit_one_off(vk_state, queue, timeline, command_buffer, fence);
+      vkWaitForFences(vk_state->device, 1, &fence, VK_TRUE, UINT64_MAX);
+      vkDestroyFence(vk_state->device, fence, nullptr);
+    }
+    vkFreeCommandBuffers(vk_state->device, command_pool, 1, &command_buffer);
+  }
+
+
+  static bool is_asset_submission_done(VkState *vk_state, u64 timeline_value, VkFence fence) {
+    if (vk_state->is_timeline_semaphore_enabled) {
+      return is_value_reached(vk_state, &vk_state->asset_timeline, timeline_value);
+    }
+    VkResult const result = vkGetFenceStatus(vk_state->device, fence);
+    if (result != VK_SUCCESS && result != VK_NOT_READY) {
+      vkutils::check(result);
+    }
+    return result == VK_SUCCESS;
+  }
+
+
+  static void wait_for_asset_submission(VkState *vk_state, u64 timeline_value, VkFence fence) {
+    if (vk_state->is_timeline_semaphore_enabled) {
+      wait_for_value(vk_state, &vk_state->asset_timeline, timeline_value);
+    } else {
+      vkWaitForFences(vk_state->device, 1, &fence, VK_TRUE, UINT64_MAX);
+    }
+  }
+
+
+  static void init(VkState *vk_state) {
+    if (!vk_state->is_timeline_semaphore_enabled) {
+      return;
+    }
+    init_timeline(vk_state, &vk_state->graphics_timeline);
+    init_timeline(vk_state, &vk_state->asset_timeline);
+  }
+
+
+  static void destroy(VkState *vk_state) {
+    vkDestroySemaphore(vk_state->device, vk_state->graphics_timeline.semaphore, nullptr);
+    vkDestroySemaphore(vk_state->device, vk_state->asset_timeline.semaphore, nullptr);
+    vk_state->graphics_timeline = {};
+    vk_state->asset_timeline = {};
+  }
+}
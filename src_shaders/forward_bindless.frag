@@ -0,0 +1,18 @@
+#version 450
+#extension GL_EXT_nonuniform_qualifier : require
+
+// The bindless texture table, see `VkState::bindless_textures`
+layout (set = 0, binding = 1) uniform sampler2D textures[];
+
+layout (location = 0) in BLOCK {
+  vec3 world_position;
+  vec3 normal;
+  vec2 tex_coords;
+  flat uint idx_albedo_texture;
+} fs_in;
+
+layout (location = 0) out vec4 color;
+
+void main() {
+  color = texture(textures[nonuniformEXT(fs_in.idx_albedo_texture)], fs_in.tex_coords);
+}
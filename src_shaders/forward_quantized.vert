@@ -0,0 +1,47 @@
+#version 450
+
+layout (set = 0, binding = 0) uniform CoreSceneState {
+  mat4 model_matrix;
+  mat4 model_normal_matrix; // actually mat3, we are using mat4 for padding
+  mat4 view;
+  mat4 projection;
+} ubo;
+
+// See QuantizedVertex. The SNORM and half float formats are expanded to
+// floats for us by the vertex fetch.
+layout (location = 0) in vec4 position;
+layout (location = 1) in vec2 normal_octahedral;
+layout (location = 2) in vec2 tex_coords;
+layout (location = 3) in vec3 instance_position;
+layout (location = 4) in uint instance_idx_albedo_texture;
+
+// See DrawConstants
+layout (push_constant) uniform DrawConstants {
+  vec3 position_scale;
+  vec3 position_offset;
+} draw;
+
+layout (location = 0) out BLOCK {
+  vec3 world_position;
+  vec3 normal;
+  vec2 tex_coords;
+  flat uint idx_albedo_texture;
+} vs_out;
+
+vec3 decode_octahedral(vec2 e) {
+  vec3 v = vec3(e.x, e.y, 1.0 - abs(e.x) - abs(e.y));
+  float t = max(-v.z, 0.0);
+  v.x += v.x >= 0.0 ? -t : t;
+  v.y += v.y >= 0.0 ? -t : t;
+  return normalize(v);
+}
+
+void main() {
+  vec3 mesh_position = position.xyz * draw.position_scale + draw.position_offset;
+  vec3 normal = decode_octahedral(normal_octahedral);
+  vs_out.tex_coords = tex_coords;
+  vs_out.idx_albedo_texture = instance_idx_albedo_texture;
+  vs_out.world_position = vec3(ubo.model_matrix * vec4(mesh_position, 1.0)) + instance_position;
+  vs_out.normal = normalize(mat3(ubo.model_normal_matrix) * normal);
+  gl_Position = ubo.projection * ubo.view * vec4(vs_out.world_position, 1.0);
+}
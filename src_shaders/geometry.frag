@@ -6,6 +6,7 @@ layout (location = 0) in BLOCK {
   vec3 world_position;
   vec3 normal;
   vec2 tex_coords;
+  flat uint idx_albedo_texture;
 } fs_in;
 
 layout (location = 0) out vec4 g_position;
@@ -0,0 +1,24 @@
+#version 450
+#extension GL_EXT_nonuniform_qualifier : require
+
+// The bindless texture table, see `VkState::bindless_textures`
+layout (set = 0, binding = 1) uniform sampler2D textures[];
+
+layout (location = 0) in BLOCK {
+  vec3 world_position;
+  vec3 normal;
+  vec2 tex_coords;
+  flat uint idx_albedo_texture;
+} fs_in;
+
+layout (location = 0) out vec4 g_position;
+layout (location = 1) out vec4 g_normal;
+layout (location = 2) out vec4 g_albedo;
+layout (location = 3) out vec4 g_pbr;
+
+void main() {
+  g_albedo = texture(textures[nonuniformEXT(fs_in.idx_albedo_texture)], fs_in.tex_coords);
+  g_position = vec4(fs_in.world_position, 1.0);
+  g_normal = vec4(fs_in.normal, 1.0);
+  g_pbr = vec4(0.0, 0.0, 1.0, 1.0f);
+}
@@ -5,6 +5,15 @@ layout (set = 1, binding = 1) uniform sampler2D g_normal;
 layout (set = 1, binding = 2) uniform sampler2D g_albedo;
 layout (set = 1, binding = 3) uniform sampler2D g_pbr;
 
+// Which `LightingDebugView` to show. Each value gets its own pipeline, so
+// the branches below compile out, rather than running for every fragment.
+layout (constant_id = 0) const uint DEBUG_VIEW = 0;
+const uint DEBUG_VIEW_NONE = 0;
+const uint DEBUG_VIEW_NORMAL = 1;
+const uint DEBUG_VIEW_ALBEDO = 2;
+const uint DEBUG_VIEW_PBR = 3;
+const uint DEBUG_VIEW_SPLIT = 4;
+
 layout (location = 0) in BLOCK {
   vec2 tex_coords;
 } fs_in;
@@ -12,14 +21,23 @@ layout (location = 0) in BLOCK {
 layout (location = 0) out vec4 color;
 
 void main() {
-  // if (fs_in.tex_coords.x < 0.4) {
-  //   color = texture(g_position, fs_in.tex_coords);
-  // } else if (fs_in.tex_coords.x < 0.5) {
-  //   color = texture(g_normal, fs_in.tex_coords);
-  // } else if (fs_in.tex_coords.x < 0.6) {
-  //   color = texture(g_albedo, fs_in.tex_coords);
-  // } else {
-  //   color = texture(g_pbr, fs_in.tex_coords);
-  // }
-  color = texture(g_position, fs_in.tex_coords);
+  if (DEBUG_VIEW == DEBUG_VIEW_NORMAL) {
+    color = texture(g_normal, fs_in.tex_coords);
+  } else if (DEBUG_VIEW == DEBUG_VIEW_ALBEDO) {
+    color = texture(g_albedo, fs_in.tex_coords);
+  } else if (DEBUG_VIEW == DEBUG_VIEW_PBR) {
+    color = texture(g_pbr, fs_in.tex_coords);
+  } else if (DEBUG_VIEW == DEBUG_VIEW_SPLIT) {
+    if (fs_in.tex_coords.x < 0.4) {
+      color = texture(g_position, fs_in.tex_coords);
+    } else if (fs_in.tex_coords.x < 0.5) {
+      color = texture(g_normal, fs_in.tex_coords);
+    } else if (fs_in.tex_coords.x < 0.6) {
+      color = texture(g_albedo, fs_in.tex_coords);
+    } else {
+      color = texture(g_pbr, fs_in.tex_coords);
+    }
+  } else {
+    color = texture(g_position, fs_in.tex_coords);
+  }
 }